@@ -3,34 +3,31 @@ import os
 import sys
 import subprocess
 import shutil
-
-py_site_pkgs = os.path.join(os.path.dirname(__file__), 'py-site-packages')
-os.makedirs(py_site_pkgs, exist_ok=True)
-sys.path.append(py_site_pkgs)
-
-try:
-  import psutil
-except:
-  import pip
-  print(f'Installing psutil into {py_site_pkgs}')
-  pip.main([
-    'install', f'--target={py_site_pkgs}', 'psutil'
-  ])
-  import psutil
+import re
 
 
 def replace_matching_line(file_path, is_match_lambda, replacement_str):
+  # replacement_str may also be a function of the matched line. Returns the number of lines replaced.
   with open(file_path, 'r') as fd:
     file_contents = fd.read()
   new_file_contents = ''
+  num_replaced = 0
   for line_num, line in enumerate(file_contents.splitlines(keepends=True)):
     if is_match_lambda(line):
-      print(f'Replaced {file_path}:{line_num} original content "{line.strip()}" with new content "{replacement_str.strip()}"')
-      new_file_contents += replacement_str
+      replacement = replacement_str(line) if callable(replacement_str) else replacement_str
+      print(f'Replaced {file_path}:{line_num} original content "{line.strip()}" with new content "{replacement.strip()}"')
+      new_file_contents += replacement
+      num_replaced += 1
     else:
       new_file_contents += line
   with open(file_path, 'w') as fd:
     fd.write(new_file_contents)
+  return num_replaced
+
+
+def file_contains(file_path, text):
+  with open(file_path, 'r') as fd:
+    return text in fd.read()
 
 
 def main():
@@ -69,10 +66,85 @@ def main():
     f'#define GEMMA_MAX_SEQLEN {wanted_seq_len}\n'
   )
 
+  # Route token sampling through mirror-gaze's sampler (src/sampler.hpp): gemma.h gets a
+  # hook that gemma.cc calls instead of its Softmax + SampleTopK when it is set.
+  gemma_h = os.path.join(gemma_repo_root, 'gemma', 'gemma.h')
+  gemma_cc = os.path.join(gemma_repo_root, 'gemma', 'gemma.cc')
+  is_accept_func = lambda line: line.strip().startswith('using AcceptFunc =')
+  is_logits_softmax = lambda line: 'Softmax(activations.logits.data()' in line and not ('sample_token_hook' in line)
+  is_sample_top_k = lambda line: 'SampleTopK<' in line and 'activations.logits.data()' in line and not ('sample_token_hook' in line)
+  if not file_contains(gemma_h, 'GEMMA_SAMPLE_TOKEN_HOOK'):
+    with open(gemma_h, 'r') as fd:
+      gemma_h_lines = fd.read().splitlines()
+    with open(gemma_cc, 'r') as fd:
+      gemma_cc_lines = fd.read().splitlines()
+    if any(map(is_accept_func, gemma_h_lines)) and any(map(is_logits_softmax, gemma_cc_lines)) and any(map(is_sample_top_k, gemma_cc_lines)):
+      replace_matching_line(
+        gemma_h, is_accept_func,
+        lambda line: line + '\n'.join([
+          '#define GEMMA_SAMPLE_TOKEN_HOOK 1',
+          'using SampleTokenFunc = int (*)(float* logits, size_t vocab_size, std::mt19937& gen, float temperature, const AcceptFunc& accept_token);',
+          'inline SampleTokenFunc sample_token_hook = nullptr;',
+        ]) + '\n'
+      )
+      replace_matching_line(
+        gemma_cc, is_logits_softmax,
+        lambda line: line.replace('Softmax(', 'if (sample_token_hook == nullptr) Softmax(', 1)
+      )
+      replace_matching_line(
+        gemma_cc, is_sample_top_k,
+        lambda line: line.replace(
+          'SampleTopK<',
+          '(sample_token_hook != nullptr) ? sample_token_hook(activations.logits.data(), kVocabSize, gen, temperature, accept_token) : SampleTopK<',
+          1)
+      )
+    else:
+      print(f'Warning: could not find the sampling code in {gemma_h} / {gemma_cc}, mirror-gaze will use gemma.cpp\'s own top-k sampling')
+
+  # Let mirror-gaze read rows of the model's input embedding table (src/recall_index.hpp
+  # embeds past turns with them): the first forward pass through the embedding lookup in
+  # gemma.cc installs an accessor in gemma.h that decompresses one row.
+  embedding_lookup = re.compile(r'^(\s*)Decompress\(\s*([\w.>-]*embedder_input_embedding)\s*,\s*\w+\s*\*\s*(\w+)\s*,')
+  is_embedding_lookup = lambda line: embedding_lookup.match(line) is not None and not ('embedding_row' in line)
+  if file_contains(gemma_h, 'GEMMA_SAMPLE_TOKEN_HOOK') and not file_contains(gemma_h, 'GEMMA_EMBEDDING_ROWS'):
+    with open(gemma_cc, 'r') as fd:
+      gemma_cc_lines = fd.read().splitlines()
+    if any(map(is_embedding_lookup, gemma_cc_lines)):
+      replace_matching_line(
+        gemma_h, lambda line: line.strip() == 'namespace gcpp {',
+        lambda line: '#include <atomic>\n#include <mutex>\n' + line
+      )
+      replace_matching_line(
+        gemma_h, lambda line: line.strip().startswith('inline SampleTokenFunc sample_token_hook'),
+        lambda line: line + '\n'.join([
+          '#define GEMMA_EMBEDDING_ROWS 1',
+          '// Set by the first forward pass of the first model: writes embedding_row_dim floats, that token\'s row of embedder_input_embedding (unscaled), to out. Valid while that model lives.',
+          'inline std::function<void(int token, float* out)> embedding_row;',
+          'inline size_t embedding_row_dim = 0;',
+          'inline std::atomic<bool> embedding_row_ready{false};',
+          'inline std::once_flag embedding_row_once;',
+        ]) + '\n'
+      )
+      def install_embedding_row(line):
+        indent, weights, model_dim = embedding_lookup.match(line).groups()
+        return (f'{indent}std::call_once(embedding_row_once, [&]() {{ embedding_row_dim = {model_dim}; '
+                f'const auto* embedding_weights = &({weights}); '
+                f'embedding_row = [embedding_weights](int row, float* out) HWY_ATTR {{ Decompress(*embedding_weights, row * {model_dim}, out, {model_dim}); }}; '
+                f'embedding_row_ready.store(true, std::memory_order_release); }});\n' + line)
+      replace_matching_line(gemma_cc, is_embedding_lookup, install_embedding_row)
+    else:
+      print(f'Warning: could not find the embedding lookup in {gemma_cc}, mirror-gaze will recall past turns by their words only')
+
+  # 'bench-build' builds build/mirror-gaze-bench instead, with the allocation counter of
+  # 'mirror-gaze bench' compiled in (it replaces the global operator new, see src/main_bench.hpp)
+  bench_build = 'bench-build' in sys.argv
+  cmake_build_dir = 'build_bench' if bench_build else 'build'
+  cmake_args = [ 'cmake', '-B', cmake_build_dir ]
+  if bench_build:
+    cmake_args.append('-DCMAKE_CXX_FLAGS=-DMIRROR_GAZE_BENCH_ALLOCATIONS=1')
+
   # Now run the build
-  subprocess.run([
-    'cmake', '-B', 'build',
-  ], cwd=gemma_repo_root, check=True)
+  subprocess.run(cmake_args, cwd=gemma_repo_root, check=True)
   # ^^ on error windows just run in cmd.exe:
   #       "C:\Program Files\Microsoft Visual Studio\2022\VC\Auxiliary\Build\vcvarsall.bat" x64
 
@@ -81,11 +153,11 @@ def main():
     subprocess.run([
       #'nmake',
        'msbuild', 'gemma.vcxproj'
-    ], cwd=os.path.join(gemma_repo_root, 'build'), check=True)
+    ], cwd=os.path.join(gemma_repo_root, cmake_build_dir), check=True)
   else:
     subprocess.run([
       'make', '-j4',
-    ], cwd=os.path.join(gemma_repo_root, 'build'), check=True)
+    ], cwd=os.path.join(gemma_repo_root, cmake_build_dir), check=True)
 
 
   build_dir = os.path.join(
@@ -95,12 +167,12 @@ def main():
 
 
 
-  mirror_gaze_exe = os.path.join(build_dir, 'mirror-gaze')
+  mirror_gaze_exe = os.path.join(build_dir, 'mirror-gaze-bench' if bench_build else 'mirror-gaze')
   if sys.platform.startswith('win'):
     mirror_gaze_exe = mirror_gaze_exe+'.exe'
 
   shutil.copyfile(
-    os.path.join(gemma_repo_root, 'build', 'gemma' + ('.exe' if sys.platform.startswith('win') else '') ),
+    os.path.join(gemma_repo_root, cmake_build_dir, 'gemma' + ('.exe' if sys.platform.startswith('win') else '') ),
     mirror_gaze_exe
   )
 
@@ -150,6 +222,9 @@ def main():
 
     print(f'GEMMA_MODEL_SBS_FILE={model_file}')
     print(f'GEMMA_TOKENIZER_SPM_FILE={tokenizer_file}')
+    if len(subproc_env.get('GEMMA_SMALL_MODEL_SBS_FILE', '')) > 0:
+      # Optional 2b model that answers the light prompts of 7b sessions (model cascade)
+      print(f'GEMMA_SMALL_MODEL_SBS_FILE={subproc_env["GEMMA_SMALL_MODEL_SBS_FILE"]}')
 
     sys_argv_idx_of_dash = -1
     for i,arg_val in enumerate(sys.argv):
@@ -157,27 +232,9 @@ def main():
         sys_argv_idx_of_dash = i
         break
 
-    # systemd-run handles making sure this process never gets > 10gb of main system ram, while allowing it to swap like crazy instead of crashing.
-    if not (shutil.which('systemd-run') is None):
-      ram_size_bytes = psutil.virtual_memory().total
-      ram_size_gb = round(ram_size_bytes / (1024 * 1024 * 1024), 2)
-      if ram_size_gb < 24:
-        # Limit model to 75% of free ram so we don't bring the system to a stuttery mess
-        memory_high = int(ram_size_gb * 0.74)
-        cmd = [
-          'systemd-run', '--scope',
-            '-p', f'MemoryHigh={memory_high}G', '-p', 'MemorySwapMax=999G',
-            '--nice=18',
-          '--user',
-          mirror_gaze_exe
-        ]
-      else:
-        # We have plenty of ram to run the model!
-        cmd = [ mirror_gaze_exe ]
-    else:
-      # We can't limit the process anyway, so we won't.
-      cmd = [ mirror_gaze_exe ]
-
+    # mirror-gaze sizes its context to the memory it has (cgroup limits, MemAvailable, or
+    # MIRROR_GAZE_MEMORY_BUDGET), so it no longer needs a systemd-run MemoryHigh scope.
+    cmd = [ mirror_gaze_exe ]
 
     if sys_argv_idx_of_dash >= 0:
       cmd += sys.argv[sys_argv_idx_of_dash+1:]
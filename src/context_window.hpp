@@ -0,0 +1,295 @@
+
+#ifdef CONTEXT_WINDOW
+#error "Only include context_window.hpp ONCE!"
+#endif
+#define CONTEXT_WINDOW
+
+// Keeps a multiturn conversation inside a fixed token budget, so prefill and attention
+// cost per turn stop growing with the length of the session.
+//
+// Once the KV cache passes 3/4 of the budget, the LLM thread uses its idle time (the
+// user is still typing) to have the model summarize the conversation so far, then
+// compacts the cache to
+//
+//   [sinks] [summary turn] [recent window]
+//
+// - sinks: the opening exchange (or just the first few tokens if that is long). Keeping
+//   the first rows around is what keeps attention stable after eviction, and the
+//   opening holds the persona the rest of the session builds on.
+// - summary turn: a user/model exchange carrying the summary, prefilled at its new rows.
+// - recent window: the last turns, moved down in place. Keys are stored with RoPE
+//   already applied, so moving a row by delta positions means rotating its keys back
+//   by delta; rotations compose, so that is exact.
+//
+// If a prompt arrives before the summary is done, the summary is abandoned and tried
+// again in the next idle period. A prompt that would overflow the budget anyway gets a
+// compaction without summary first. When a compaction finds nothing to evict, no idle
+// period summarizes again until the conversation has grown.
+//
+// Griffin keeps recurrent state that can't be edited this way, so it is unsupported.
+
+class ContextWindow {
+ public:
+  struct Stats {
+    size_t compactions = 0;
+    size_t tokens_evicted = 0;
+    size_t summaries = 0;
+    size_t summaries_preempted = 0;
+    size_t summary_tokens = 0; // prompt + generated tokens spent on summaries
+    double summary_seconds = 0;
+    double compaction_seconds = 0;
+  };
+
+  static constexpr size_t kSinkTokens = 4;       // fallback when the opening is too long
+  static constexpr size_t kMaxSinkTokens = 1024; // longest opening kept whole
+  static constexpr size_t kMaxSummaryTokens = 192;
+  static constexpr size_t kResponseReserve = 512; // room left for the next response
+
+  // budget: tokens the KV cache may hold, 0 for unbounded.
+  ContextWindow(gcpp::Gemma& model, const KVCacheLayout& layout, size_t budget, bool supported)
+      : model_(model), layout_(layout), budget_(supported ? budget : 0) {
+    HWY_ASSERT(model_.Tokenizer()->Encode("<end_of_turn>\n<start_of_turn>user", &turn_marker_));
+    end_of_turn_ = turn_marker_.front();
+  }
+
+  bool enabled() const { return budget_ > 0; }
+  size_t budget() const { return budget_; }
+
+  // Worth compacting in the next idle period. Not again at a size where compacting
+  // found nothing to evict, until the conversation has grown past it.
+  bool WantsCompaction(size_t abs_pos) const {
+    return enabled() && abs_pos > budget_ * 3 / 4 && abs_pos > stuck_at_;
+  }
+
+  // Must compact before a prompt of prompt_tokens can be run.
+  bool MustCompact(size_t abs_pos, size_t prompt_tokens) const {
+    return enabled() && abs_pos + prompt_tokens + kResponseReserve > budget_;
+  }
+
+  // Has the model summarize rows [0, abs_pos) without changing them: the request and the
+  // summary are written past abs_pos, where the next turn overwrites them. keep_going is
+  // polled between steps; returns false (and no summary) once it says stop.
+  bool Summarize(gcpp::KVCache& kv_cache, hwy::ThreadPool& pool, const gcpp::InferenceArgs& args,
+                 size_t abs_pos, const std::function<bool()>& keep_going, std::string& summary) {
+    const auto start_time = std::chrono::steady_clock::now();
+    std::vector<int> prompt;
+    HWY_ASSERT(model_.Tokenizer()->Encode(
+        "<end_of_turn>\n<start_of_turn>user\nSummarize our conversation so far in a few "
+        "sentences. Keep names, facts, feelings and anything I asked you to remember."
+        "<end_of_turn>\n<start_of_turn>model\n", &prompt));
+    if (abs_pos + prompt.size() + kMaxSummaryTokens >= layout_.seq_len) {
+      return false;
+    }
+
+    std::vector<int> generated;
+    size_t streamed = 0;
+    bool stopped = false;
+    const size_t prompt_size = prompt.size();
+    gcpp::StreamFunc collect = [&](int token, float) {
+      streamed += 1;
+      if (!keep_going()) {
+        stopped = true;
+        return false;
+      }
+      if (streamed <= prompt_size) {
+        return true;
+      }
+      // Instruction-tuned models end their turn with <end_of_turn> rather than EOS; the
+      // summary stops there, without it.
+      if (token == gcpp::EOS_ID || token == end_of_turn_) {
+        return false;
+      }
+      generated.push_back(token);
+      return generated.size() < kMaxSummaryTokens;
+    };
+    gcpp::AcceptFunc accept_all = [](int) { return true; };
+    // Sampling at the session's temperature (2 for the therapist) rambles; a summary
+    // wants the likely tokens. Own RNG so the session's sampling sequence is unaffected.
+    std::mt19937 summary_gen(0);
+    gcpp::RuntimeConfig runtime_config = {
+        .max_tokens = args.max_tokens,
+        .max_generated_tokens = kMaxSummaryTokens,
+        .temperature = std::min(args.temperature, 0.5f),
+        .verbosity = 0,
+        .gen = &summary_gen,
+        .stream_token = collect,
+        .accept_token = accept_all,
+    };
+    gcpp::TimingInfo timing_info;
+    GenerateGemma(model_, runtime_config, prompt, abs_pos, kv_cache, pool, timing_info);
+
+    stats_.summary_tokens += streamed;
+    stats_.summary_seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start_time).count();
+    if (stopped) {
+      stats_.summaries_preempted += 1;
+      return false;
+    }
+    stats_.summaries += 1;
+    HWY_ASSERT(model_.Tokenizer()->Decode(generated, &summary));
+    return true;
+  }
+
+  // Compacts rows [0, abs_pos) into sinks + summary turn (if summary isn't empty) +
+  // recent window, updating abs_pos and kv_tokens (left empty if they were unknown).
+  // Returns the first row it changed, or the old abs_pos if there was nothing to evict.
+  size_t Compact(gcpp::KVCache& kv_cache, hwy::ThreadPool& pool, const gcpp::InferenceArgs& args,
+                 size_t& abs_pos, std::vector<int>& kv_tokens, const std::string& summary) {
+    if (!enabled()) {
+      return abs_pos;
+    }
+    const auto start_time = std::chrono::steady_clock::now();
+    const bool tokens_known = kv_tokens.size() == abs_pos;
+
+    // Sinks end where the second user turn starts.
+    size_t sink_end = kSinkTokens;
+    if (tokens_known) {
+      const size_t first_turn = FindTurn(kv_tokens, 1);
+      if (first_turn <= kMaxSinkTokens) {
+        sink_end = first_turn;
+      }
+    }
+
+    std::vector<int> insert;
+    if (summary.size() > 0) {
+      HWY_ASSERT(model_.Tokenizer()->Encode(
+          "<end_of_turn>\n<start_of_turn>user\nHere is a summary of what we talked about "
+          "earlier: " + summary + "<end_of_turn>\n<start_of_turn>model\nThank you, I will "
+          "keep that in mind.", &insert));
+    }
+
+    // The window starts at the first user turn that fits in half the budget, leaving
+    // the other half for the turns to come. A single huge turn is cut mid-turn.
+    const size_t kept_before_window = sink_end + insert.size();
+    const size_t window_budget = budget_ / 2 > kept_before_window ? budget_ / 2 - kept_before_window : 0;
+    size_t window_start = abs_pos - std::min(abs_pos, window_budget);
+    if (tokens_known) {
+      const size_t turn = FindTurn(kv_tokens, window_start);
+      if (turn < abs_pos) {
+        window_start = turn;
+      }
+    }
+    if (window_start <= kept_before_window || window_start <= sink_end) {
+      stuck_at_ = abs_pos;
+      return abs_pos;
+    }
+    stuck_at_ = 0;
+
+    // Move the window down, rotating its keys to the new positions.
+    const size_t window_rows = abs_pos - window_start;
+    const size_t delta = window_start - kept_before_window;
+    const size_t row_floats = layout_.floats_per_pos;
+    memmove(kv_cache.key_cache.get() + kept_before_window * row_floats,
+            kv_cache.key_cache.get() + window_start * row_floats,
+            window_rows * row_floats * sizeof(float));
+    memmove(kv_cache.value_cache.get() + kept_before_window * row_floats,
+            kv_cache.value_cache.get() + window_start * row_floats,
+            window_rows * row_floats * sizeof(float));
+    RotateKeys(kv_cache.key_cache.get() + kept_before_window * row_floats, window_rows, delta);
+
+    // Prefill the summary turn in between; stopping at the first sampled token means
+    // nothing is written at or past kept_before_window.
+    if (insert.size() > 0) {
+      size_t streamed = 0;
+      const size_t insert_size = insert.size();
+      gcpp::StreamFunc stop_after_prompt = [&streamed, insert_size](int, float) {
+        streamed += 1;
+        return streamed <= insert_size;
+      };
+      gcpp::AcceptFunc accept_all = [](int) { return true; };
+      std::mt19937 throwaway_gen(0);
+      gcpp::RuntimeConfig runtime_config = {
+          .max_tokens = args.max_tokens,
+          .max_generated_tokens = 1,
+          .temperature = args.temperature,
+          .verbosity = 0,
+          .gen = &throwaway_gen,
+          .stream_token = stop_after_prompt,
+          .accept_token = accept_all,
+      };
+      gcpp::TimingInfo timing_info;
+      GenerateGemma(model_, runtime_config, insert, sink_end, kv_cache, pool, timing_info);
+    }
+
+    if (tokens_known) {
+      std::vector<int> compacted(kv_tokens.begin(), kv_tokens.begin() + sink_end);
+      compacted.insert(compacted.end(), insert.begin(), insert.end());
+      compacted.insert(compacted.end(), kv_tokens.begin() + window_start, kv_tokens.end());
+      kv_tokens.swap(compacted);
+    }
+    abs_pos = kept_before_window + window_rows;
+
+    stats_.compactions += 1;
+    stats_.tokens_evicted += window_start - sink_end;
+    stats_.compaction_seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start_time).count();
+    return sink_end;
+  }
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  // Position of the first "<end_of_turn>\n<start_of_turn>user" at or after from, or
+  // tokens.size() if there is none.
+  size_t FindTurn(const std::vector<int>& tokens, size_t from) const {
+    auto it = std::search(tokens.begin() + std::min(from, tokens.size()), tokens.end(),
+                          turn_marker_.begin(), turn_marker_.end());
+    return it - tokens.begin();
+  }
+
+  // Applies RoPE for position -delta to every head of every key row, the inverse of the
+  // rotation gemma.cpp applied for delta positions (half-split pairs, base 10000).
+  void RotateKeys(float* rows, size_t num_rows, size_t delta) const {
+    const size_t half = layout_.qkv_dim / 2;
+    std::vector<float> cos_theta(half);
+    std::vector<float> sin_theta(half);
+    for (size_t dim = 0; dim < half; dim += 1) {
+      const double timescale = std::pow(10000.0, static_cast<double>(2 * dim) / layout_.qkv_dim);
+      const double theta = -static_cast<double>(delta) / timescale;
+      cos_theta[dim] = static_cast<float>(std::cos(theta));
+      sin_theta[dim] = static_cast<float>(std::sin(theta));
+    }
+    const size_t heads = num_rows * layout_.floats_per_pos / layout_.qkv_dim;
+    for (size_t head = 0; head < heads; head += 1) {
+      float* x = rows + head * layout_.qkv_dim;
+      for (size_t dim = 0; dim < half; dim += 1) {
+        const float x0 = x[dim];
+        const float x1 = x[dim + half];
+        x[dim] = x0 * cos_theta[dim] - x1 * sin_theta[dim];
+        x[dim + half] = x0 * sin_theta[dim] + x1 * cos_theta[dim];
+      }
+    }
+  }
+
+  gcpp::Gemma& model_;
+  KVCacheLayout layout_;
+  size_t budget_;
+  std::vector<int> turn_marker_;
+  int end_of_turn_;
+  size_t stuck_at_ = 0; // abs_pos at which Compact last had nothing to evict
+  Stats stats_;
+};
+
+// Tokens the KV cache may hold per conversation: $MIRROR_GAZE_CONTEXT_TOKENS, else 4096
+// for multiturn sessions (single-turn ones restart every response anyway). 0 disables.
+size_t context_window_budget(const gcpp::InferenceArgs& args) {
+  size_t budget = args.multiturn ? 4096 : 0;
+  if (const char* env_var = std::getenv("MIRROR_GAZE_CONTEXT_TOKENS")) {
+    budget = std::strtoull(env_var, nullptr, 10);
+  }
+  if (budget > 0) {
+    budget = std::max(budget, 2 * (ContextWindow::kMaxSinkTokens + ContextWindow::kResponseReserve));
+    budget = std::min<size_t>(budget, args.max_tokens);
+  }
+  return budget;
+}
+
+void print_context_window_stats(const ContextWindow::Stats& stats) {
+  std::cout << stats.compactions << " context compactions, " << stats.tokens_evicted
+            << " tokens evicted" << "\n"
+            << stats.summaries << " summaries (" << stats.summaries_preempted
+            << " preempted by a prompt), " << stats.summary_tokens << " tokens / "
+            << static_cast<int>(stats.summary_seconds * 1000) << " ms of idle time spent on them"
+            << "\n"
+            << static_cast<int>(stats.compaction_seconds * 1000) << " ms compacting" << "\n";
+}
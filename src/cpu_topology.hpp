@@ -0,0 +1,306 @@
+
+#ifdef CPU_TOPOLOGY
+#error "Only include cpu_topology.hpp ONCE!"
+#endif
+#define CPU_TOPOLOGY
+
+// Where the threads of the process run.
+//
+// Decode is bound by memory bandwidth, so the pool workers do best on one physical core
+// each (an SMT sibling adds a second stream of loads to the same core) and on one NUMA
+// node (weights read across the socket link are much slower). The control thread
+// filters and renders while the workers decode, and gets cores of its own so it never
+// preempts a worker mid-step.
+//
+// The topology comes from sysfs, limited to the CPUs this process may run on (taskset,
+// cgroup cpusets). MIRROR_GAZE_THREAD_PLACEMENT=off leaves every thread unpinned.
+//
+// 'mirror-gaze bench threads' measures decode speed for several num_threads and caches
+// the fastest for this machine and model; later launches use it unless --num_threads
+// is given.
+
+#include <map>
+#include <tuple>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // Linux
+
+struct CpuInfo {
+  int cpu = 0;
+  int package = 0;
+  int core = 0; // core_id, unique within a package
+  int node = 0;
+};
+
+struct CpuTopology {
+  std::vector<CpuInfo> cpus; // allowed CPUs, ascending
+
+  // One entry per physical core with at least one allowed CPU; the CPUs are its SMT
+  // siblings, ascending. Ordered by node, then by first CPU.
+  std::vector<std::vector<int>> cores;
+  std::vector<int> core_nodes;
+
+  // The node with the most allowed physical cores; workers start there.
+  int home_node = 0;
+  size_t home_node_cores = 0;
+
+  // Identifies the machine for the cached num_threads.
+  uint64_t key = 0;
+};
+
+#if defined(__linux__)
+// A sysfs file holding a single integer, or fallback.
+int read_sysfs_int(const std::string& path, int fallback) {
+  std::ifstream in(path);
+  int value = fallback;
+  if (!(in >> value)) {
+    return fallback;
+  }
+  return value;
+}
+
+int cpu_numa_node(int cpu) {
+  std::error_code ec;
+  const std::filesystem::path dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+    const std::string name = entry.path().filename().string();
+    if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+        std::isdigit(static_cast<unsigned char>(name[4]))) {
+      return std::atoi(name.c_str() + 4);
+    }
+  }
+  return 0;
+}
+#endif // Linux
+
+CpuTopology read_cpu_topology() {
+  CpuTopology topology;
+#if defined(__linux__)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return topology;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu += 1) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+    // Without topology files every CPU counts as its own core.
+    topology.cpus.push_back({
+      .cpu = cpu,
+      .package = read_sysfs_int(dir + "physical_package_id", 0),
+      .core = read_sysfs_int(dir + "core_id", cpu),
+      .node = cpu_numa_node(cpu),
+    });
+  }
+#else
+  const unsigned n = std::thread::hardware_concurrency();
+  for (unsigned cpu = 0; cpu < n; cpu += 1) {
+    topology.cpus.push_back({.cpu = static_cast<int>(cpu), .core = static_cast<int>(cpu)});
+  }
+#endif // Linux
+
+  std::vector<CpuInfo> by_core = topology.cpus;
+  std::stable_sort(by_core.begin(), by_core.end(), [](const CpuInfo& a, const CpuInfo& b) {
+    return std::tie(a.node, a.package, a.core) < std::tie(b.node, b.package, b.core);
+  });
+  std::map<int, size_t> node_cores;
+  for (size_t i = 0; i < by_core.size(); i += 1) {
+    const CpuInfo& c = by_core[i];
+    if (i == 0 || c.node != by_core[i - 1].node || c.package != by_core[i - 1].package ||
+        c.core != by_core[i - 1].core) {
+      topology.cores.emplace_back();
+      topology.core_nodes.push_back(c.node);
+      node_cores[c.node] += 1;
+    }
+    topology.cores.back().push_back(c.cpu);
+  }
+  for (const auto& [node, count] : node_cores) {
+    if (count > topology.home_node_cores) {
+      topology.home_node = node;
+      topology.home_node_cores = count;
+    }
+  }
+
+  uint64_t hash = fnv1a64("cpu-topology");
+  for (const CpuInfo& c : topology.cpus) {
+    hash = fnv1a64(&c, sizeof(c), hash);
+  }
+  topology.key = hash;
+  return topology;
+}
+
+struct ThreadPlacement {
+  std::vector<int> worker_cpus;  // worker i runs on worker_cpus[i % size]
+  std::vector<int> control_cpus; // control thread and everything it starts
+
+  std::string Describe() const {
+    auto list = [](const std::vector<int>& cpus) {
+      std::string s;
+      for (size_t i = 0; i < cpus.size(); i += 1) {
+        s += (i > 0 ? "," : "") + std::to_string(cpus[i]);
+      }
+      return s;
+    };
+    return "workers on CPUs " + list(worker_cpus) + ", control on CPUs " + list(control_cpus);
+  }
+};
+
+// Workers get the first CPU of each physical core on the home node, then of the other
+// nodes' cores, and only then SMT siblings. Control gets every allowed CPU on a core
+// without workers; if there is none, the siblings of the last worker's core, and failing
+// that, the last worker's CPU itself.
+ThreadPlacement plan_thread_placement(const CpuTopology& topology, size_t num_workers) {
+  ThreadPlacement placement;
+  if (topology.cores.size() < 1 || num_workers < 1) {
+    return placement;
+  }
+  std::vector<size_t> core_order;
+  for (size_t i = 0; i < topology.cores.size(); i += 1) {
+    if (topology.core_nodes[i] == topology.home_node) {
+      core_order.push_back(i);
+    }
+  }
+  for (size_t i = 0; i < topology.cores.size(); i += 1) {
+    if (topology.core_nodes[i] != topology.home_node) {
+      core_order.push_back(i);
+    }
+  }
+
+  std::vector<bool> core_used(topology.cores.size(), false);
+  for (size_t sibling = 0; placement.worker_cpus.size() < num_workers; sibling += 1) {
+    bool placed = false;
+    for (size_t i : core_order) {
+      if (placement.worker_cpus.size() == num_workers) {
+        break;
+      }
+      if (sibling < topology.cores[i].size()) {
+        placement.worker_cpus.push_back(topology.cores[i][sibling]);
+        core_used[i] = true;
+        placed = true;
+      }
+    }
+    if (!placed) {
+      break; // more workers than CPUs; the rest share from the start
+    }
+  }
+
+  for (size_t i : core_order) {
+    if (!core_used[i]) {
+      placement.control_cpus.insert(placement.control_cpus.end(), topology.cores[i].begin(),
+                                    topology.cores[i].end());
+    }
+  }
+  if (placement.control_cpus.size() < 1) {
+    const int last = placement.worker_cpus.back();
+    for (const std::vector<int>& core : topology.cores) {
+      if (std::find(core.begin(), core.end(), last) == core.end()) {
+        continue;
+      }
+      for (int cpu : core) {
+        if (std::find(placement.worker_cpus.begin(), placement.worker_cpus.end(), cpu) ==
+            placement.worker_cpus.end()) {
+          placement.control_cpus.push_back(cpu);
+        }
+      }
+    }
+    if (placement.control_cpus.size() < 1) {
+      placement.control_cpus.push_back(last);
+    }
+  }
+  return placement;
+}
+
+// Thread id of the control thread (the one that starts the LLM thread), so the LLM
+// thread can move it once it knows where the workers go. 0 if unknown.
+int64_t control_thread_tid = 0;
+
+int64_t current_thread_tid() {
+#if defined(__linux__)
+  return static_cast<int64_t>(syscall(SYS_gettid));
+#else
+  return 0;
+#endif // Linux
+}
+
+// Restricts thread tid (0: the calling thread) to cpus.
+bool pin_thread_to_cpus(int64_t tid, const std::vector<int>& cpus) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return cpus.size() > 0 && sched_setaffinity(static_cast<pid_t>(tid), sizeof(set), &set) == 0;
+#else
+  (void)tid;
+  (void)cpus;
+  return false;
+#endif // Linux
+}
+
+bool thread_placement_enabled() {
+  const char* mode = std::getenv("MIRROR_GAZE_THREAD_PLACEMENT");
+  return mode == nullptr || strcmp(mode, "off") != 0;
+}
+
+// Pins the workers of pool, the calling thread (which drives the pool, so it shares
+// the workers' CPUs) and the control thread. Called right after the pool is created.
+void place_threads(hwy::ThreadPool& pool, const CpuTopology& topology, int verbosity) {
+  if (!thread_placement_enabled()) {
+    return;
+  }
+  const ThreadPlacement placement = plan_thread_placement(topology, pool.NumThreads());
+  if (placement.worker_cpus.size() < 1) {
+    return;
+  }
+  // Run() hands tasks out dynamically, so one worker could take several and another
+  // none. Every task waits until all of them have started, which takes one per worker.
+  const size_t num_tasks = pool.NumThreads();
+  std::atomic<size_t> started{0};
+  pool.Run(0, num_tasks, [&placement, &started, num_tasks](uint64_t /*task*/, size_t thread) {
+    pin_thread_to_cpus(0, {placement.worker_cpus[thread % placement.worker_cpus.size()]});
+    started.fetch_add(1);
+    while (started.load() < num_tasks) {
+      std::this_thread::yield();
+    }
+  });
+  pin_thread_to_cpus(0, placement.worker_cpus);
+  if (control_thread_tid != 0) {
+    pin_thread_to_cpus(control_thread_tid, placement.control_cpus);
+  }
+  if (verbosity >= 2) {
+    std::cout << "Thread placement: " << placement.Describe() << std::endl;
+  }
+}
+
+// Cached result of 'bench threads' for this machine and weights file.
+std::filesystem::path tuned_num_threads_path(const CpuTopology& topology, const std::string& weights_path) {
+  std::stringstream file_name;
+  file_name << "threads-" << std::hex << file_identity_key(weights_path, topology.key) << ".txt";
+  return mirror_gaze_cache_dir() / file_name.str();
+}
+
+void save_tuned_num_threads(const CpuTopology& topology, const std::string& weights_path,
+                            size_t num_threads) {
+  std::ofstream(tuned_num_threads_path(topology, weights_path)) << num_threads << "\n";
+}
+
+// num_threads for a launch that didn't pass --num_threads: the calibrated value if
+// there is one, else gemma's default capped at the physical cores of the home node.
+size_t tuned_num_threads(const CpuTopology& topology, const std::string& weights_path,
+                         size_t default_num_threads) {
+  size_t cached = 0;
+  std::ifstream in(tuned_num_threads_path(topology, weights_path));
+  if (in >> cached && cached > 0) {
+    return cached;
+  }
+  if (!thread_placement_enabled() || topology.home_node_cores < 1) {
+    return default_num_threads;
+  }
+  return std::max<size_t>(1, std::min(default_num_threads, topology.home_node_cores));
+}
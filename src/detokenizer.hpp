@@ -0,0 +1,221 @@
+
+#ifdef DETOKENIZER
+#error "Only include detokenizer.hpp ONCE!"
+#endif
+#define DETOKENIZER
+
+// Token -> bytes lookup table plus an incremental decoder for the stream_token hot path.
+//
+// Decoding each token on its own through SentencePiece allocates, drops the leading
+// space of pieces like "▁word", and turns every <0xNN> byte-fallback piece of a
+// multi-byte character into U+FFFD. Instead, the bytes of every piece are worked out
+// once at model load (and cached on disk next to the other snapshots), and
+// IncrementalDetokenizer only ever emits complete UTF-8 sequences, holding back the
+// start of a character until the rest of its bytes arrive.
+
+constexpr uint32_t kTokenByteTableVersion = 1;
+
+size_t vocab_size_for_model(gcpp::Model model_type) {
+  switch (model_type) {
+    case gcpp::Model::GEMMA_2B:
+      return gcpp::ConfigGemma2B::kVocabSize;
+    case gcpp::Model::GEMMA_7B:
+      return gcpp::ConfigGemma7B::kVocabSize;
+    case gcpp::Model::GRIFFIN_2B:
+      return gcpp::ConfigGriffin2B::kVocabSize;
+  }
+  HWY_ABORT("vocab_size_for_model: unknown model type %d", static_cast<int>(model_type));
+}
+
+class TokenByteTable {
+ public:
+  bool ok() const { return offsets_.size() > 1; }
+  size_t vocab_size() const { return offsets_.size() - 1; }
+
+  std::string_view Piece(int token) const {
+    if (token < 0 || static_cast<size_t>(token) + 1 >= offsets_.size()) {
+      return std::string_view();
+    }
+    return std::string_view(bytes_.data() + offsets_[token], offsets_[token + 1] - offsets_[token]);
+  }
+
+  // Uses the given pieces as-is; for tables that don't come from a tokenizer (benchmarks).
+  void Assign(const std::vector<std::string>& pieces) {
+    offsets_.assign(1, 0);
+    bytes_.clear();
+    for (const std::string& piece : pieces) {
+      bytes_ += piece;
+      offsets_.push_back(static_cast<uint32_t>(bytes_.size()));
+    }
+  }
+
+  // Loads the table from cache_file if it was built for this tokenizer, otherwise builds
+  // it (a few hundred ms for Gemma's 256k vocabulary) and writes cache_file.
+  bool Load(const gcpp::GemmaTokenizer& tokenizer, size_t vocab_size,
+            uint64_t tokenizer_key, const std::filesystem::path& cache_file) {
+    if (LoadCache(cache_file, tokenizer_key, vocab_size)) {
+      return true;
+    }
+    if (!Build(tokenizer, vocab_size)) {
+      return false;
+    }
+    SaveCache(cache_file, tokenizer_key);
+    return true;
+  }
+
+ private:
+  struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vocab_size;
+    uint64_t tokenizer_key;
+    uint64_t byte_count;
+  };
+
+  bool Build(const gcpp::GemmaTokenizer& tokenizer, size_t vocab_size) {
+    // SentencePiece strips the leading space of the first piece it decodes, so every
+    // piece is decoded behind a fixed anchor piece that is then cut off again.
+    std::vector<int> anchor;
+    std::string anchor_text;
+    if (!tokenizer.Encode("a", &anchor) || anchor.size() < 1 ||
+        !tokenizer.Decode(anchor, &anchor_text)) {
+      return false;
+    }
+
+    // U+F0000 is in a private use plane that no piece covers, so it is encoded with
+    // byte-fallback pieces. Those are allocated as one contiguous run <0x00>..<0xFF>,
+    // which gives us every byte token from three of them.
+    int byte_base = -1;
+    std::vector<int> probe;
+    if (tokenizer.Encode("\xF3\xB0\x80\x80", &probe) && probe.size() >= 4) {
+      const int* b = probe.data() + probe.size() - 4;
+      if (b[0] - b[3] == 0xF3 - 0x80 && b[1] - b[3] == 0xB0 - 0x80 && b[2] == b[3]) {
+        byte_base = b[3] - 0x80;
+      }
+    }
+
+    offsets_.assign(1, 0);
+    bytes_.clear();
+    std::vector<int> pair = {anchor.back(), 0};
+    std::string text;
+    for (size_t token = 0; token < vocab_size; token += 1) {
+      if (byte_base >= 0 && token >= static_cast<size_t>(byte_base) &&
+          token < static_cast<size_t>(byte_base) + 256) {
+        bytes_.push_back(static_cast<char>(token - byte_base));
+      } else {
+        pair[1] = static_cast<int>(token);
+        text.clear();
+        if (tokenizer.Decode(pair, &text) && text.compare(0, anchor_text.size(), anchor_text) == 0) {
+          bytes_.append(text, anchor_text.size(), std::string::npos);
+        }
+      }
+      offsets_.push_back(static_cast<uint32_t>(bytes_.size()));
+    }
+    return true;
+  }
+
+  bool LoadCache(const std::filesystem::path& cache_file, uint64_t tokenizer_key, size_t vocab_size) {
+    MappedFile file;
+    if (!file.open(cache_file) || file.size() < sizeof(CacheHeader)) {
+      return false;
+    }
+    CacheHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    const size_t offsets_bytes = (vocab_size + 1) * sizeof(uint32_t);
+    if (memcmp(header.magic, "MGTOKB", 6) != 0 || header.version != kTokenByteTableVersion ||
+        header.vocab_size != vocab_size || header.tokenizer_key != tokenizer_key ||
+        sizeof(header) + offsets_bytes + header.byte_count != file.size()) {
+      return false;
+    }
+    offsets_.resize(vocab_size + 1);
+    memcpy(offsets_.data(), file.data() + sizeof(header), offsets_bytes);
+    bytes_.assign(reinterpret_cast<const char*>(file.data() + sizeof(header) + offsets_bytes),
+                  header.byte_count);
+    return offsets_.back() == bytes_.size();
+  }
+
+  void SaveCache(const std::filesystem::path& cache_file, uint64_t tokenizer_key) const {
+    CacheHeader header = {};
+    memcpy(header.magic, "MGTOKB\0\0", sizeof(header.magic));
+    header.version = kTokenByteTableVersion;
+    header.vocab_size = static_cast<uint32_t>(vocab_size());
+    header.tokenizer_key = tokenizer_key;
+    header.byte_count = bytes_.size();
+    const std::filesystem::path tmp_path = unique_temp_path(cache_file);
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(offsets_.data()), offsets_.size() * sizeof(uint32_t));
+    out.write(bytes_.data(), bytes_.size());
+    out.close();
+    std::error_code ec;
+    if (out) {
+      std::filesystem::rename(tmp_path, cache_file, ec);
+    }
+    if (!out || ec) {
+      std::filesystem::remove(tmp_path, ec);
+    }
+  }
+
+  std::vector<uint32_t> offsets_; // piece of token t is bytes_[offsets_[t], offsets_[t+1])
+  std::string bytes_;
+};
+
+// Length of the longest prefix of text that doesn't end in the middle of a UTF-8 sequence.
+size_t utf8_complete_prefix(std::string_view text) {
+  // A sequence is at most 4 bytes, so only the last 3 bytes can be an unfinished start.
+  for (size_t back = 1; back <= 3 && back <= text.size(); back += 1) {
+    const uint8_t c = static_cast<uint8_t>(text[text.size() - back]);
+    if ((c & 0xC0) == 0x80) {
+      continue; // continuation byte, keep looking for the lead byte
+    }
+    const size_t needed = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return needed > back ? text.size() - back : text.size();
+  }
+  return text.size(); // stray continuation bytes, nothing sensible to wait for
+}
+
+class IncrementalDetokenizer {
+ public:
+  // table must outlive the detokenizer. If the table could not be built, tokens are
+  // decoded one at a time through the tokenizer instead (allocating, but correct
+  // apart from the leading-space and byte-fallback issues described above).
+  IncrementalDetokenizer(const TokenByteTable& table, const gcpp::GemmaTokenizer* tokenizer)
+      : table_(table), tokenizer_(tokenizer) {
+    out_.reserve(256);
+  }
+
+  // Returns the complete UTF-8 text finished by this token, which may be empty.
+  // The view is valid until the next call.
+  std::string_view Push(int token) {
+    out_.assign(pending_, pending_size_);
+    if (table_.ok()) {
+      const std::string_view piece = table_.Piece(token);
+      out_.append(piece.data(), piece.size());
+    } else {
+      fallback_text_.clear();
+      HWY_ASSERT(tokenizer_->Decode(std::vector<int>{token}, &fallback_text_));
+      out_ += fallback_text_;
+    }
+    const size_t complete = utf8_complete_prefix(out_);
+    pending_size_ = out_.size() - complete;
+    memcpy(pending_, out_.data() + complete, pending_size_);
+    return std::string_view(out_.data(), complete);
+  }
+
+  // Returns whatever is still held back (an unfinished sequence at end of response)
+  // and resets for the next response.
+  std::string_view Flush() {
+    out_.assign(pending_, pending_size_);
+    pending_size_ = 0;
+    return out_;
+  }
+
+ private:
+  const TokenByteTable& table_;
+  const gcpp::GemmaTokenizer* tokenizer_;
+  std::string out_;
+  std::string fallback_text_;
+  char pending_[4];
+  size_t pending_size_ = 0;
+};
+
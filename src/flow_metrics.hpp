@@ -0,0 +1,141 @@
+
+#ifdef FLOW_METRICS
+#error "Only include flow_metrics.hpp ONCE!"
+#endif
+#define FLOW_METRICS
+
+#include <deque>
+
+// Per-prompt measurements of a whole flow (tasker, therapist), for 'bench e2e'.
+//
+// Both threads contribute to the record of a prompt: the LLM thread the model-side
+// numbers from gcpp::TimingInfo, the control thread what the user experiences
+// (first visible token, token handoff through the channel, filtering + rendering).
+// Prompts are matched up by their position in the single-session prompt channel.
+//
+// Nothing is recorded unless flow_metrics is set.
+
+struct PromptMetrics {
+  std::string label; // start of the prompt text
+
+  // LLM thread; generated == false if the response came from a snapshot or the prompt
+  // was a command.
+  bool generated = false;
+  size_t prompt_tokens = 0;
+  size_t generated_tokens = 0;
+  double prefill_tok_sec = 0;
+  double decode_tok_sec = 0;
+  double model_ttft_ms = 0;
+
+  // Control thread
+  double wall_ms = 0;           // prompt pushed -> end of response popped
+  double first_token_ms = 0;    // prompt pushed -> first response text popped
+  size_t chunks = 0;            // LlmTokens popped
+  double handoff_us_mean = 0;   // LlmToken pushed -> popped
+  double handoff_us_max = 0;
+  double render_ms = 0;         // filtering, layout and terminal writes
+};
+
+class FlowMetrics {
+ public:
+  // Called by the LLM thread for the index-th prompt it popped.
+  void RecordModel(size_t index, size_t prompt_tokens, size_t generated_tokens,
+                   const gcpp::TimingInfo& timing_info) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PromptMetrics& m = At(index);
+    m.generated = true;
+    m.prompt_tokens = prompt_tokens;
+    m.generated_tokens = generated_tokens;
+    m.prefill_tok_sec = timing_info.prefill_tok_sec;
+    m.decode_tok_sec = timing_info.gen_tok_sec;
+    m.model_ttft_ms = timing_info.time_to_first_token * 1000;
+  }
+
+  // Called by the control thread once the index-th prompt it pushed has been answered.
+  void RecordControl(size_t index, const std::string& prompt_text, const PromptMetrics& control) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PromptMetrics& m = At(index);
+    m.label = prompt_text.substr(0, utf8_complete_prefix(std::string_view(prompt_text).substr(0, 48)));
+    m.wall_ms = control.wall_ms;
+    m.first_token_ms = control.first_token_ms;
+    m.chunks = control.chunks;
+    m.handoff_us_mean = control.handoff_us_mean;
+    m.handoff_us_max = control.handoff_us_max;
+    m.render_ms = control.render_ms;
+  }
+
+  double TotalWallMs() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    double total = 0;
+    for (const PromptMetrics& m : prompts_) {
+      total += m.wall_ms;
+    }
+    return total;
+  }
+
+  // {"flow": ..., "prompts": [{...}, ...]}
+  std::string ToJson(const std::string& flow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::stringstream ss;
+    ss << "{\"flow\": " << JsonString(flow) << ", \"prompts\": [";
+    for (size_t i = 0; i < prompts_.size(); i += 1) {
+      const PromptMetrics& m = prompts_[i];
+      ss << (i > 0 ? ",\n    " : "\n    ") << "{\"index\": " << i
+         << ", \"label\": " << JsonString(m.label)
+         << ", \"generated\": " << (m.generated ? "true" : "false")
+         << ", \"prompt_tokens\": " << m.prompt_tokens
+         << ", \"generated_tokens\": " << m.generated_tokens
+         << ", \"prefill_tok_s\": " << m.prefill_tok_sec
+         << ", \"decode_tok_s\": " << m.decode_tok_sec
+         << ", \"model_ttft_ms\": " << m.model_ttft_ms
+         << ", \"first_token_ms\": " << m.first_token_ms
+         << ", \"wall_ms\": " << m.wall_ms
+         << ", \"chunks\": " << m.chunks
+         << ", \"handoff_us_mean\": " << m.handoff_us_mean
+         << ", \"handoff_us_max\": " << m.handoff_us_max
+         << ", \"render_ms\": " << m.render_ms << "}";
+    }
+    ss << "\n  ]}";
+    return ss.str();
+  }
+
+  static std::string JsonString(const std::string& s) {
+    std::string out = "\"";
+    for (unsigned char c : s) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if (c < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        out += escaped;
+      } else {
+        out += c;
+      }
+    }
+    return out + "\"";
+  }
+
+ private:
+  PromptMetrics& At(size_t index) {
+    if (prompts_.size() <= index) {
+      prompts_.resize(index + 1);
+    }
+    return prompts_[index];
+  }
+
+  std::mutex mutex_;
+  std::deque<PromptMetrics> prompts_;
+};
+
+// Set by 'bench e2e' for the flow running in this process.
+FlowMetrics* flow_metrics = nullptr;
+
+// Index of the next prompt popped by a ReplGemma loop. Counted across loops, since a model
+// cascade answers one prompt channel with two of them.
+std::atomic<size_t> flow_prompts_popped{0};
+
+// Set by 'bench e2e': flows sample with --deterministic (seed 42), and prompt_user()
+// answers from scripted_user_inputs ("%q" once they run out) instead of stdin.
+bool flows_scripted = false;
+std::deque<std::string> scripted_user_inputs;
@@ -0,0 +1,129 @@
+
+#ifdef KEYPRESS_WATCHER
+#error "Only include keypress_watcher.hpp ONCE!"
+#endif
+#define KEYPRESS_WATCHER
+
+// Lets the user cut a response short from the keyboard while it streams.
+//
+// While a response is on screen the terminal is switched to non-canonical mode without
+// echo, so keys arrive one at a time instead of a line at a time, and the control
+// thread polls for them between tokens. Any key interrupts the response. Printable
+// keys (and backspace) are kept as type-ahead: the start of the user's next line,
+// which prompt_user() shows and continues. Escape, Ctrl-C and the other control keys
+// only interrupt.
+//
+// Nothing happens unless stdin is a terminal; the previous terminal mode is put back
+// when the response ends, and at exit in case it never does.
+
+#if !defined(_WIN32)
+#include <termios.h>
+#include <unistd.h>
+#endif // Windows
+
+class KeypressWatcher {
+ public:
+  // How often the token loop looks at the keyboard.
+  static constexpr std::chrono::milliseconds kPollInterval{20};
+
+  // Starts watching for the response that is about to stream. Returns false (and
+  // does nothing) if stdin is not a terminal.
+  bool Begin() {
+#if defined(_WIN32)
+    return false;
+#else
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_) != 0) {
+      return false;
+    }
+    termios raw = saved_;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG); // Ctrl-C interrupts the response, not the program
+    raw.c_cc[VMIN] = 0; // read() returns at once, with whatever is there
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0) {
+      return false;
+    }
+    active_ = true;
+    ActiveWatcher() = this;
+    static bool registered = false;
+    if (!registered) {
+      registered = true;
+      std::atexit([]() {
+        if (ActiveWatcher() != nullptr) {
+          ActiveWatcher()->End();
+        }
+      });
+    }
+    next_poll_ = std::chrono::steady_clock::now();
+    return true;
+#endif // Windows
+  }
+
+  // True once a key was pressed since Begin(). Reads the terminal at most once per
+  // kPollInterval.
+  bool Poll(std::chrono::steady_clock::time_point now) {
+#if !defined(_WIN32)
+    if (!active_ || pressed_ || now < next_poll_) {
+      return pressed_;
+    }
+    next_poll_ = now + kPollInterval;
+    char keys[64];
+    const ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+    for (ssize_t i = 0; i < n; i += 1) {
+      pressed_ = true;
+      const unsigned char c = static_cast<unsigned char>(keys[i]);
+      if (c == 0x1b) {
+        break; // escape, or the start of an arrow key's sequence
+      } else if (c == 0x7f || c == 0x08) {
+        if (type_ahead_.size() > 0) {
+          // Drops the last character, not just its last byte.
+          size_t end = type_ahead_.size() - 1;
+          while (end > 0 && (static_cast<unsigned char>(type_ahead_[end]) & 0xC0) == 0x80) {
+            end -= 1;
+          }
+          type_ahead_.resize(end);
+        }
+      } else if (c >= 0x20 || (c == '\n' && type_ahead_.size() > 0)) {
+        type_ahead_ += static_cast<char>(c);
+      }
+    }
+#else
+    (void)now;
+#endif // Windows
+    return pressed_;
+  }
+
+  // Restores the terminal. Type-ahead stays until TakeTypeAhead().
+  void End() {
+#if !defined(_WIN32)
+    if (active_) {
+      tcsetattr(STDIN_FILENO, TCSANOW, &saved_);
+      active_ = false;
+      ActiveWatcher() = nullptr;
+    }
+#endif // Windows
+    pressed_ = false;
+  }
+
+  std::string TakeTypeAhead() {
+    std::string keys;
+    keys.swap(type_ahead_);
+    return keys;
+  }
+
+ private:
+  static KeypressWatcher*& ActiveWatcher() {
+    static KeypressWatcher* watcher = nullptr;
+    return watcher;
+  }
+
+#if !defined(_WIN32)
+  termios saved_ = {};
+#endif // Windows
+  bool active_ = false;
+  bool pressed_ = false;
+  std::string type_ahead_;
+  std::chrono::steady_clock::time_point next_poll_;
+};
+
+// Shared by prompt_llm_and_return_value() and prompt_user().
+KeypressWatcher keypress_watcher;
@@ -0,0 +1,160 @@
+
+#ifdef KV_CACHE
+#error "Only include kv_cache.hpp ONCE!"
+#endif
+#define KV_CACHE
+
+// KV caches whose unused rows can be given back to the kernel.
+//
+// The cache itself is gemma.cpp's: f32 rows for the full kSeqLen (32768, see build.py),
+// read directly by its attention; there is no quantized in-memory mode (kv_codec.hpp
+// only compresses snapshots). Like any large allocation, the arrays only take memory
+// for the pages that get written, so a conversation costs the rows it reaches.
+//
+// What this adds is giving rows back: KVRowTracker releases them (MADV_DONTNEED) when a
+// conversation restarts shorter than an earlier one, so a long session early on doesn't
+// pin its memory for the rest of the process. CreateReleasableKVCache maps the arrays
+// itself to know they are page-aligned anonymous memory that madvise may drop, and maps
+// them MAP_NORESERVE, which only makes a difference under strict overcommit
+// (vm.overcommit_memory=2), where a 15 GB array per 7b cache would be refused.
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif // Linux
+
+#if defined(__linux__)
+// hwy::AllocateAligned callbacks. The mapping length is kept in a page in front of the
+// pointer handed to hwy, which munmap needs back.
+constexpr size_t kKVMapHeader = 4096;
+
+void* kv_map_alloc(void* opaque, size_t bytes) {
+  (void)opaque;
+  void* base = mmap(nullptr, bytes + kKVMapHeader, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return nullptr;
+  }
+  *static_cast<size_t*>(base) = bytes + kKVMapHeader;
+  return static_cast<uint8_t*>(base) + kKVMapHeader;
+}
+
+void kv_map_free(void* opaque, void* memory) {
+  (void)opaque;
+  if (memory != nullptr) {
+    uint8_t* base = static_cast<uint8_t*>(memory) - kKVMapHeader;
+    munmap(base, *reinterpret_cast<size_t*>(base));
+  }
+}
+#endif // Linux
+
+gcpp::KVCache CreateReleasableKVCache(gcpp::Model model_type) {
+#if defined(__linux__)
+  const KVCacheLayout layout = kv_cache_layout(model_type);
+  gcpp::KVCache kv_cache = {};
+  const size_t floats = layout.seq_len * layout.floats_per_pos;
+  if (floats > 0) {
+    kv_cache.key_cache = hwy::AllocateAligned<float>(floats, kv_map_alloc, kv_map_free, nullptr);
+    kv_cache.value_cache = hwy::AllocateAligned<float>(floats, kv_map_alloc, kv_map_free, nullptr);
+    if (!kv_cache.key_cache || !kv_cache.value_cache) {
+      return gcpp::CreateKVCache(model_type);
+    }
+  }
+  // The recurrent state is small, and has to start out zeroed.
+  if (layout.conv1d_floats > 0) {
+    kv_cache.conv1d_cache = hwy::AllocateAligned<float>(layout.conv1d_floats);
+    memset(kv_cache.conv1d_cache.get(), 0, layout.conv1d_floats * sizeof(float));
+  }
+  if (layout.rglru_floats > 0) {
+    kv_cache.rglru_cache = hwy::AllocateAligned<float>(layout.rglru_floats);
+    memset(kv_cache.rglru_cache.get(), 0, layout.rglru_floats * sizeof(float));
+  }
+  return kv_cache;
+#else
+  return gcpp::CreateKVCache(model_type);
+#endif // Linux
+}
+
+// Bytes of key_cache + value_cache rows [0, rows) that are backed by memory, or 0 if
+// unknown.
+size_t kv_cache_resident_bytes(const gcpp::KVCache& kv_cache, const KVCacheLayout& layout,
+                               size_t rows) {
+#if defined(__linux__)
+  const size_t page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> resident;
+  size_t total = 0;
+  for (const float* array : {kv_cache.key_cache.get(), kv_cache.value_cache.get()}) {
+    if (array == nullptr || rows < 1) {
+      continue;
+    }
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(array) & ~(page - 1);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(array + rows * layout.floats_per_pos);
+    resident.resize((end - begin + page - 1) / page);
+    if (mincore(reinterpret_cast<void*>(begin), end - begin, resident.data()) != 0) {
+      return 0;
+    }
+    for (unsigned char r : resident) {
+      total += (r & 1) * page;
+    }
+  }
+  return total;
+#else
+  (void)kv_cache;
+  (void)layout;
+  (void)rows;
+  return 0;
+#endif // Linux
+}
+
+// Hands the memory of rows [from, to) back to the kernel; they read as zero afterwards.
+void kv_cache_release_rows(gcpp::KVCache& kv_cache, const KVCacheLayout& layout,
+                           size_t from, size_t to) {
+#if defined(__linux__)
+  const size_t page = sysconf(_SC_PAGESIZE);
+  for (float* array : {kv_cache.key_cache.get(), kv_cache.value_cache.get()}) {
+    if (array == nullptr || to <= from) {
+      continue;
+    }
+    // Only whole pages inside the range; the partial ones at the edges may hold live rows.
+    const uintptr_t begin = (reinterpret_cast<uintptr_t>(array + from * layout.floats_per_pos) + page - 1) & ~(page - 1);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(array + to * layout.floats_per_pos) & ~(page - 1);
+    if (end > begin) {
+      madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    }
+  }
+#else
+  (void)kv_cache;
+  (void)layout;
+  (void)from;
+  (void)to;
+#endif // Linux
+}
+
+// Remembers how far into the KV cache any conversation has reached since memory was
+// last given back.
+class KVRowTracker {
+ public:
+  explicit KVRowTracker(const KVCacheLayout& layout) : layout_(layout) {}
+
+  void Touch(size_t rows) {
+    high_water_ = std::max(high_water_, rows);
+  }
+
+  // The conversation restarts after using `rows` rows. The next one is likely about as
+  // long, so only rows beyond it - left over from an earlier, longer one - are released.
+  void Restart(gcpp::KVCache& kv_cache, size_t rows) {
+    if (high_water_ > rows) {
+      kv_cache_release_rows(kv_cache, layout_, rows, high_water_);
+      released_rows_ += high_water_ - rows;
+    }
+    high_water_ = rows;
+  }
+
+  size_t high_water() const { return high_water_; }
+  size_t released_rows() const { return released_rows_; }
+
+ private:
+  KVCacheLayout layout_;
+  size_t high_water_ = 0;
+  size_t released_rows_ = 0;
+};
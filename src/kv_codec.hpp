@@ -0,0 +1,151 @@
+
+#ifdef KV_CODEC
+#error "Only include kv_codec.hpp ONCE!"
+#endif
+#define KV_CODEC
+
+// Compressed KV snapshots: compact encodings of KV cache rows for session snapshots.
+//
+//   f32:  as stored in gcpp::KVCache, lossless.
+//   bf16: the upper half of every float; half the size.
+//   int8: groups of kKVInt8Group floats as one float scale plus kKVInt8Group int8
+//         values (symmetric, scale = max |x| / 127); a bit over a quarter of the size.
+//
+// Attention inside gemma.cpp reads the f32 rows directly, so the in-memory cache stays
+// f32 and the codecs only apply to snapshots. Encoding happens once per save; decoding
+// is on the startup path of every cached opening prompt and resumed session, so that
+// part is vectorized with Highway.
+
+enum class KVCodec : uint32_t {
+  kF32 = 0,
+  kBF16 = 1,
+  kInt8 = 2,
+};
+
+// One head's worth of a row for every model (kQKVDim).
+constexpr size_t kKVInt8Group = 256;
+
+const char* kv_codec_name(KVCodec codec) {
+  switch (codec) {
+    case KVCodec::kF32:
+      return "f32";
+    case KVCodec::kBF16:
+      return "bf16";
+    case KVCodec::kInt8:
+      return "int8";
+  }
+  return "?";
+}
+
+bool kv_codec_from_name(const std::string& name, KVCodec& codec) {
+  for (KVCodec c : {KVCodec::kF32, KVCodec::kBF16, KVCodec::kInt8}) {
+    if (name == kv_codec_name(c)) {
+      codec = c;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Codec for newly written snapshots: $MIRROR_GAZE_KV_CODEC, else f32.
+KVCodec kv_snapshot_codec() {
+  KVCodec codec = KVCodec::kF32;
+  if (const char* env_var = std::getenv("MIRROR_GAZE_KV_CODEC")) {
+    if (!kv_codec_from_name(env_var, codec)) {
+      std::cerr << "Ignoring MIRROR_GAZE_KV_CODEC=" << env_var << ", expected f32, bf16 or int8\n";
+    }
+  }
+  return codec;
+}
+
+size_t kv_encoded_bytes(KVCodec codec, size_t floats) {
+  switch (codec) {
+    case KVCodec::kF32:
+      return floats * sizeof(float);
+    case KVCodec::kBF16:
+      return floats * sizeof(hwy::bfloat16_t);
+    case KVCodec::kInt8:
+      return ((floats + kKVInt8Group - 1) / kKVInt8Group) * sizeof(float) + floats;
+  }
+  return 0;
+}
+
+// Encodes in[0, floats) into out[0, kv_encoded_bytes(codec, floats)). For int8, floats
+// must be a multiple of kKVInt8Group except for the last call of a stream.
+void kv_encode(KVCodec codec, const float* in, size_t floats, uint8_t* out) {
+  if (codec == KVCodec::kF32) {
+    memcpy(out, in, floats * sizeof(float));
+  } else if (codec == KVCodec::kBF16) {
+    hwy::bfloat16_t* bf = reinterpret_cast<hwy::bfloat16_t*>(out);
+    for (size_t i = 0; i < floats; i += 1) {
+      bf[i] = hwy::BF16FromF32(in[i]);
+    }
+  } else {
+    for (size_t g = 0; g < floats; g += kKVInt8Group) {
+      const size_t n = std::min(kKVInt8Group, floats - g);
+      float max_abs = 0;
+      for (size_t i = 0; i < n; i += 1) {
+        max_abs = std::max(max_abs, std::abs(in[g + i]));
+      }
+      const float scale = max_abs / 127.0f;
+      const float inv_scale = scale > 0 ? 1.0f / scale : 0.0f;
+      memcpy(out, &scale, sizeof(scale));
+      int8_t* q = reinterpret_cast<int8_t*>(out + sizeof(scale));
+      for (size_t i = 0; i < n; i += 1) {
+        q[i] = static_cast<int8_t>(std::lrintf(in[g + i] * inv_scale));
+      }
+      out += sizeof(scale) + n;
+    }
+  }
+}
+
+namespace kv_codec_simd {
+namespace hn = hwy::HWY_NAMESPACE;
+
+void DecodeBF16(const hwy::bfloat16_t* HWY_RESTRICT in, size_t floats, float* HWY_RESTRICT out) {
+  const hn::ScalableTag<float> df;
+  const hn::Rebind<hwy::bfloat16_t, decltype(df)> dbf;
+  const size_t N = hn::Lanes(df);
+  size_t i = 0;
+  for (; i + N <= floats; i += N) {
+    hn::StoreU(hn::PromoteTo(df, hn::LoadU(dbf, in + i)), df, out + i);
+  }
+  for (; i < floats; i += 1) {
+    out[i] = hwy::F32FromBF16(in[i]);
+  }
+}
+
+void DecodeInt8Group(const int8_t* HWY_RESTRICT in, float scale, size_t n, float* HWY_RESTRICT out) {
+  const hn::ScalableTag<float> df;
+  const hn::Rebind<int32_t, decltype(df)> di32;
+  const hn::Rebind<int8_t, decltype(df)> di8;
+  const size_t N = hn::Lanes(df);
+  const auto vscale = hn::Set(df, scale);
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    const auto v = hn::ConvertTo(df, hn::PromoteTo(di32, hn::LoadU(di8, in + i)));
+    hn::StoreU(hn::Mul(v, vscale), df, out + i);
+  }
+  for (; i < n; i += 1) {
+    out[i] = in[i] * scale;
+  }
+}
+
+}  // namespace kv_codec_simd
+
+// Inverse of kv_encode.
+void kv_decode(KVCodec codec, const uint8_t* in, size_t floats, float* out) {
+  if (codec == KVCodec::kF32) {
+    memcpy(out, in, floats * sizeof(float));
+  } else if (codec == KVCodec::kBF16) {
+    kv_codec_simd::DecodeBF16(reinterpret_cast<const hwy::bfloat16_t*>(in), floats, out);
+  } else {
+    for (size_t g = 0; g < floats; g += kKVInt8Group) {
+      const size_t n = std::min(kKVInt8Group, floats - g);
+      float scale;
+      memcpy(&scale, in, sizeof(scale));
+      kv_codec_simd::DecodeInt8Group(reinterpret_cast<const int8_t*>(in + sizeof(scale)), scale, n, out + g);
+      in += sizeof(scale) + n;
+    }
+  }
+}
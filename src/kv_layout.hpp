@@ -0,0 +1,45 @@
+
+#ifdef KV_LAYOUT
+#error "Only include kv_layout.hpp ONCE!"
+#endif
+#define KV_LAYOUT
+
+// Sizes of the arrays inside gcpp::KVCache for each model, mirroring CreateKVCache().
+//
+// key_cache and value_cache are position-major: row `pos` holds
+// kGemmaLayers * kKVHeads * kQKVDim floats, so the first n positions of a
+// conversation are one contiguous block at the front of each array.
+// conv1d_cache and rglru_cache hold Griffin's recurrent state after the most
+// recent token and are not indexed by position at all.
+struct KVCacheLayout {
+  size_t floats_per_pos = 0;
+  size_t qkv_dim = 0; // floats per head within a row
+  size_t seq_len = 0;
+  size_t conv1d_floats = 0;
+  size_t rglru_floats = 0;
+};
+
+template <class Config>
+KVCacheLayout kv_cache_layout_for_config() {
+  KVCacheLayout layout;
+  layout.floats_per_pos = Config::kGemmaLayers * Config::kKVHeads * Config::kQKVDim;
+  layout.qkv_dim = Config::kQKVDim;
+  layout.seq_len = Config::kSeqLen + gcpp::kPrefillBatchSize;
+  const size_t conv1d_width = Config::kConv1dWidth == 0 ? 0 : Config::kConv1dWidth - 1;
+  layout.conv1d_floats = Config::kGriffinLayers * conv1d_width * Config::kModelDim;
+  layout.rglru_floats = Config::kGriffinLayers * Config::kModelDim;
+  return layout;
+}
+
+KVCacheLayout kv_cache_layout(gcpp::Model model_type) {
+  switch (model_type) {
+    case gcpp::Model::GEMMA_2B:
+      return kv_cache_layout_for_config<gcpp::ConfigGemma2B>();
+    case gcpp::Model::GEMMA_7B:
+      return kv_cache_layout_for_config<gcpp::ConfigGemma7B>();
+    case gcpp::Model::GRIFFIN_2B:
+      return kv_cache_layout_for_config<gcpp::ConfigGriffin2B>();
+  }
+  HWY_ABORT("kv_cache_layout: unknown model type %d", static_cast<int>(model_type));
+}
+
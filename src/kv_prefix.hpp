@@ -0,0 +1,82 @@
+
+#ifdef KV_PREFIX
+#error "Only include kv_prefix.hpp ONCE!"
+#endif
+#define KV_PREFIX
+
+// Lets several prompts that start with the same text share one prefill of that text.
+//
+// gemma's KVCache is indexed by absolute position, and generating at position p only
+// ever writes row p and reads rows [0, p]. So once a prefix has been prefilled into
+// rows [0, n), a continuation started at abs_pos = n can never modify the prefix rows;
+// everything it writes lands past the prefix and is simply overwritten by the next
+// fork. That makes a fork free (no copy) until something writes below n again, at
+// which point the snapshot is dropped.
+//
+// Griffin models keep recurrent state outside of the position-indexed rows, so forking
+// is disabled for them and callers fall back to prefilling the whole prompt.
+class KVPrefixCache {
+ public:
+  explicit KVPrefixCache(bool supported) : supported_(supported) {}
+
+  // Positions the caller at the end of `prefix` inside kv_cache, prefilling it only if
+  // the currently snapshotted prefix differs. Returns the abs_pos to continue from, or
+  // 0 if forking is unsupported (caller must then prefill prefix itself).
+  size_t Fork(gcpp::Gemma& model, const std::vector<int>& prefix,
+              gcpp::KVCache& kv_cache, hwy::ThreadPool& pool,
+              const gcpp::InferenceArgs& args) {
+    if (!supported_ || prefix.size() < 1) {
+      return 0;
+    }
+    if (prefix == snapshot_tokens_) {
+      prefill_tokens_saved_ += prefix.size();
+      forks_ += 1;
+      return prefix.size();
+    }
+
+    // Run the prefix as a prompt and refuse the first sampled token, which stops
+    // generation right after the last prefix row has been written. The refused sample
+    // uses its own RNG so the session's sampling sequence is unaffected.
+    std::mt19937 throwaway_gen(0);
+    size_t streamed = 0;
+    const size_t prefix_size = prefix.size();
+    gcpp::StreamFunc stop_after_prefix = [&streamed, prefix_size](int, float) {
+      streamed += 1;
+      return streamed <= prefix_size;
+    };
+    gcpp::AcceptFunc accept_all = [](int) { return true; };
+    gcpp::RuntimeConfig runtime_config = {
+        .max_tokens = args.max_tokens,
+        .max_generated_tokens = 1,
+        .temperature = args.temperature,
+        .verbosity = 0,
+        .gen = &throwaway_gen,
+        .stream_token = stop_after_prefix,
+        .accept_token = accept_all,
+    };
+    gcpp::TimingInfo timing_info;
+    GenerateGemma(model, runtime_config, prefix, /*start_pos=*/0, kv_cache, pool,
+                  timing_info);
+
+    snapshot_tokens_ = prefix;
+    return prefix.size();
+  }
+
+  // Must be called before anything is generated at start_pos; drops the snapshot if
+  // that write would clobber one of its rows.
+  void OnGenerate(size_t start_pos) {
+    if (start_pos < snapshot_tokens_.size()) {
+      snapshot_tokens_.clear();
+    }
+  }
+
+  size_t prefill_tokens_saved() const { return prefill_tokens_saved_; }
+  size_t forks() const { return forks_; }
+
+ private:
+  bool supported_;
+  std::vector<int> snapshot_tokens_;
+  size_t prefill_tokens_saved_ = 0;
+  size_t forks_ = 0;
+};
+
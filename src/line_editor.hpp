@@ -0,0 +1,150 @@
+
+#ifdef LINE_EDITOR
+#error "Only include line_editor.hpp ONCE!"
+#endif
+#define LINE_EDITOR
+
+// Reads the user's line a key at a time, so the model can prefill it while it is typed
+// (see typing_prefill.hpp).
+//
+// The terminal is put in non-canonical mode without echo and the editor echoes keys
+// itself. Every time the completed words of the line change (a word is finished, or
+// editing reaches back into finished words), on_words gets the line up to its last
+// finished word. The word being typed is left out because its tokens would likely
+// change with the next key.
+//
+// Editing: backspace, Ctrl-U (clear line), Ctrl-W (delete word). Arrow keys and other
+// escape sequences are ignored. Ctrl-C ends the program as it would in canonical mode,
+// and Ctrl-D on an empty line ends the input.
+
+#if !defined(_WIN32)
+#include <termios.h>
+#include <unistd.h>
+#endif // Windows
+
+class LineEditor {
+ public:
+  // Whether ReadLine() can be used; if not, read with std::getline.
+  static bool Available() {
+#if defined(_WIN32)
+    return false;
+#else
+    return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+#endif // Windows
+  }
+
+  // Shows prompt followed by line (text typed ahead), and edits line until Enter.
+  // Returns false at end of input.
+  static bool ReadLine(const std::string& prompt, std::string& line,
+                       const std::function<void(const std::string&)>& on_words) {
+#if defined(_WIN32)
+    (void)prompt;
+    (void)line;
+    (void)on_words;
+    return false;
+#else
+    termios saved;
+    if (tcgetattr(STDIN_FILENO, &saved) != 0) {
+      return false;
+    }
+    termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    std::cout << prompt << line << std::flush;
+
+    std::string sent_words;
+    auto words_changed = [&]() {
+      const size_t end = line.find_last_of(" \t");
+      if (end == std::string::npos) {
+        return;
+      }
+      const size_t words_end = line.find_last_not_of(" \t", end);
+      const std::string words = words_end == std::string::npos ? "" : line.substr(0, words_end + 1);
+      if (words.size() > 0 && words != sent_words) {
+        sent_words = words;
+        on_words(words);
+      }
+    };
+    auto erase_char = [&]() {
+      if (line.size() < 1) {
+        return;
+      }
+      size_t end = line.size() - 1;
+      while (end > 0 && (static_cast<unsigned char>(line[end]) & 0xC0) == 0x80) {
+        end -= 1;
+      }
+      line.resize(end);
+      std::cout << "\b \b";
+    };
+    words_changed();
+
+    bool ok = true;
+    while (true) {
+      char c = 0;
+      const ssize_t n = read(STDIN_FILENO, &c, 1);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        ok = false;
+        break;
+      }
+      const unsigned char key = static_cast<unsigned char>(c);
+      if (key == '\n' || key == '\r') {
+        break;
+      } else if (key == 0x03) { // Ctrl-C
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        std::cout << std::endl;
+        raise(SIGINT);
+        return false;
+      } else if (key == 0x04) { // Ctrl-D
+        if (line.size() < 1) {
+          ok = false;
+          break;
+        }
+      } else if (key == 0x7f || key == 0x08) {
+        erase_char();
+      } else if (key == 0x15) { // Ctrl-U
+        while (line.size() > 0) {
+          erase_char();
+        }
+      } else if (key == 0x17) { // Ctrl-W
+        while (line.size() > 0 && (line.back() == ' ' || line.back() == '\t')) {
+          erase_char();
+        }
+        while (line.size() > 0 && line.back() != ' ' && line.back() != '\t') {
+          erase_char();
+        }
+      } else if (key == 0x1b) {
+        SkipEscapeSequence();
+      } else if (key >= 0x20 || key == '\t') {
+        line += c;
+        std::cout << c;
+      }
+      std::cout << std::flush;
+      words_changed();
+    }
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    std::cout << std::endl;
+    return ok;
+#endif // Windows
+  }
+
+ private:
+#if !defined(_WIN32)
+  // After ESC: "[" or "O", parameters, then a final byte in 0x40-0x7E.
+  static void SkipEscapeSequence() {
+    char c = 0;
+    if (read(STDIN_FILENO, &c, 1) != 1 || (c != '[' && c != 'O')) {
+      return;
+    }
+    while (read(STDIN_FILENO, &c, 1) == 1) {
+      if (c >= 0x40 && c <= 0x7E) {
+        return;
+      }
+    }
+  }
+#endif // Windows
+};
@@ -0,0 +1,185 @@
+
+#ifdef LLM_BACKEND
+#error "Only include llm_backend.hpp ONCE!"
+#endif
+#define LLM_BACKEND
+
+// LLM backends: whatever answers the prompts of the control thread. A backend runs on
+// its own thread, pops prompts from an input channel and streams responses into an
+// output channel until "%q" or until the channels are closed, then calls request_exit().
+//
+// - run_llm_thread: the model, in this process.
+// - run_daemon_client_thread: a session of a running 'mirror-gaze daemon'.
+// - run_replay_backend: responses from a recording, no model needed.
+//
+// MIRROR_GAZE_RECORD=file records whichever of the first two is used (prompts, streamed
+// responses with their timing, and the user's input lines). MIRROR_GAZE_REPLAY=file
+// plays such a recording back to the same tasker/therapist flow, with user input
+// scripted from the recording too. MIRROR_GAZE_REPLAY_SPEED=max streams as fast as the
+// control side can take it instead of at the recorded pace, which is how the filtering
+// and rendering paths get profiled (see 'bench replay').
+
+using LlmBackend = std::function<void(LlmPromptChannel& input, LlmTokenChannel& output)>;
+
+// Runs backend on private channels and forwards between them and input/output,
+// recording everything that passes through into llm_recorder.
+void run_recording_backend(const LlmBackend& backend, LlmPromptChannel& input, LlmTokenChannel& output) {
+  LlmPromptChannel inner_input;
+  LlmTokenChannel inner_output;
+  std::thread inner([&]() { backend(inner_input, inner_output); });
+  std::thread prompts([&]() {
+    LlmPrompt prompt;
+    while (input.pop(prompt)) {
+      // Drafts get no response, so a replay has nothing to answer them with.
+      if (!prompt.draft) {
+        llm_recorder->Record(kRecordedPrompt, prompt.shared_prefix + prompt.text);
+        output.clear_stop();
+      }
+      if (!inner_input.push(std::move(prompt))) {
+        break;
+      }
+    }
+    inner_input.close();
+  });
+  LlmToken token;
+  while (inner_output.pop(token)) {
+    if (output.stop_requested()) {
+      inner_output.request_stop();
+    }
+    llm_recorder->Record(token.end_of_response ? kRecordedEnd : kRecordedText, token.text());
+    if (!output.push(token)) {
+      break;
+    }
+  }
+  inner_output.close();
+  request_exit(input, output);
+  prompts.join();
+  inner.join();
+  llm_recorder->Flush();
+}
+
+// One recorded prompt and the response events that followed it.
+struct ReplayedResponse {
+  std::string prompt;
+  std::vector<LlmRecordedEvent> events; // delta_us made relative to the prompt
+};
+
+std::vector<ReplayedResponse> replay_responses(const std::vector<LlmRecordedEvent>& events) {
+  std::vector<ReplayedResponse> responses;
+  uint64_t since_prompt_us = 0;
+  for (const LlmRecordedEvent& event : events) {
+    since_prompt_us += event.delta_us;
+    if (event.type == kRecordedPrompt) {
+      responses.push_back({event.payload, {}});
+      since_prompt_us = 0;
+    } else if ((event.type == kRecordedText || event.type == kRecordedEnd) && responses.size() > 0) {
+      responses.back().events.push_back({event.type, since_prompt_us, event.payload});
+    }
+  }
+  // The quit prompt has no response to replay; it ends the replay instead.
+  responses.erase(std::remove_if(responses.begin(), responses.end(), [](const ReplayedResponse& r) {
+    return r.prompt == "%q" || r.prompt == "%Q";
+  }), responses.end());
+  return responses;
+}
+
+// Answers the n-th prompt with the n-th recorded response, cycling through them if more
+// prompts come than were recorded. realtime keeps the recorded time from prompt to each
+// chunk; otherwise chunks are pushed as fast as the output channel takes them. An
+// interrupt ends the response at the next chunk, like it does for the model.
+void run_replay_backend(const std::vector<ReplayedResponse>& responses, bool realtime,
+                        LlmPromptChannel& input, LlmTokenChannel& output) {
+  size_t next = 0;
+  bool warned = false;
+  LlmPrompt prompt;
+  while (input.pop(prompt)) {
+    if (prompt.draft) {
+      continue;
+    }
+    if (prompt.text == "%q" || prompt.text == "%Q") {
+      break;
+    }
+    output.clear_stop();
+    if (responses.size() < 1) {
+      push_end_of_response(output);
+      continue;
+    }
+    const ReplayedResponse& response = responses[next % responses.size()];
+    next += 1;
+    if (!warned && response.prompt != prompt.shared_prefix + prompt.text) {
+      std::cerr << "Replay: prompt " << next << " differs from the recording, replaying anyway\n";
+      warned = true;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    bool ended = false;
+    for (const LlmRecordedEvent& event : response.events) {
+      if (realtime) {
+        std::this_thread::sleep_until(start + std::chrono::microseconds(event.delta_us));
+      }
+      if (event.type == kRecordedText && !output.stop_requested()) {
+        push_text_to_output(output, event.payload);
+      } else {
+        push_end_of_response(output);
+        ended = true;
+        break;
+      }
+    }
+    if (!ended) {
+      push_end_of_response(output); // recording ended mid-response
+    }
+  }
+  request_exit(input, output);
+}
+
+// Starts the thread that answers llm_input_queue: a replay if MIRROR_GAZE_REPLAY is set,
+// else a relay to the daemon if one is running, otherwise the model itself.
+std::thread start_llm_thread(std::vector<char*>& args) {
+  if (const char* replay_file = std::getenv("MIRROR_GAZE_REPLAY")) {
+    std::vector<LlmRecordedEvent> events;
+    if (!read_llm_recording(replay_file, events)) {
+      HWY_ABORT("Cannot read recording %s", replay_file);
+    }
+    // The user's side of the conversation is replayed too.
+    flows_scripted = true;
+    for (const LlmRecordedEvent& event : events) {
+      if (event.type == kRecordedUserInput) {
+        scripted_user_inputs.push_back(event.payload);
+      }
+    }
+    const char* speed = std::getenv("MIRROR_GAZE_REPLAY_SPEED");
+    const bool realtime = speed == nullptr || strcmp(speed, "max") != 0;
+    std::cout << "Replaying " << replay_file << (realtime ? "" : " at full speed") << std::endl;
+    return std::thread([responses = replay_responses(events), realtime]() {
+      run_replay_backend(responses, realtime, llm_input_queue, llm_output_tokens_queue);
+    });
+  }
+
+  // The model thread moves this thread off its workers' cores (see place_threads).
+  control_thread_tid = current_thread_tid();
+
+  LlmBackend backend;
+  const int fd = daemon_open_session(args);
+  if (fd >= 0) {
+    std::cout << "Connected to mirror-gaze daemon at " << daemon_socket_path() << std::endl;
+    backend = [fd](LlmPromptChannel& input, LlmTokenChannel& output) {
+      run_daemon_client_thread(fd, input, output);
+    };
+  } else {
+    backend = [argc = args.size(), argv = args.data()](LlmPromptChannel& input, LlmTokenChannel& output) {
+      run_llm_thread(argc, argv, input, output);
+    };
+  }
+
+  if (const char* record_file = std::getenv("MIRROR_GAZE_RECORD")) {
+    static LlmRecorder recorder;
+    if (recorder.Open(record_file)) {
+      llm_recorder = &recorder;
+      std::cout << "Recording to " << record_file << std::endl;
+      return std::thread([backend]() {
+        run_recording_backend(backend, llm_input_queue, llm_output_tokens_queue);
+      });
+    }
+    std::cerr << "Cannot record to " << record_file << "\n";
+  }
+  return std::thread([backend]() { backend(llm_input_queue, llm_output_tokens_queue); });
+}
@@ -0,0 +1,149 @@
+
+#ifdef LLM_CHANNEL
+#error "Only include llm_channel.hpp ONCE!"
+#endif
+#define LLM_CHANNEL
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Single-producer / single-consumer ring buffer used to hand prompts and tokens
+// between the control thread and the LLM thread.
+//
+// The fast path is lock-free (one atomic load + one atomic store per side).
+// A side that finds the ring empty (consumer) or full (producer) registers itself
+// as a waiter and sleeps on a condition variable; the other side only takes the
+// mutex to notify when someone is actually waiting, so a streaming token never
+// pays for a syscall unless the consumer is asleep.
+template <typename T, size_t kCapacity>
+class SpscChannel {
+  static_assert(kCapacity > 0 && (kCapacity & (kCapacity - 1)) == 0,
+                "SpscChannel capacity must be a power of two");
+
+ public:
+  // Blocks while the ring is full. Returns false (and drops value) if the channel was closed.
+  bool push(T value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) >= kCapacity) {
+      wait_until([&] { return tail - head_.load(std::memory_order_acquire) < kCapacity; });
+    }
+    if (closed_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    slots_[tail & (kCapacity - 1)] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_seq_cst);
+    wake_waiters();
+    return true;
+  }
+
+  // Blocks until a value is available. Returns false once the channel is closed and drained.
+  bool pop(T& out) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (tail_.load(std::memory_order_acquire) == head) {
+      wait_until([&] { return tail_.load(std::memory_order_acquire) != head; });
+      if (tail_.load(std::memory_order_acquire) == head) {
+        return false; // closed and empty
+      }
+    }
+    out = std::move(slots_[head & (kCapacity - 1)]);
+    head_.store(head + 1, std::memory_order_seq_cst);
+    wake_waiters();
+    return true;
+  }
+
+  // Like pop(), but gives up at deadline. Returns false on timeout, or once the channel
+  // is closed and drained.
+  bool pop_until(T& out, std::chrono::steady_clock::time_point deadline) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (tail_.load(std::memory_order_acquire) == head) {
+      wait_until([&] { return tail_.load(std::memory_order_acquire) != head; }, &deadline);
+      if (tail_.load(std::memory_order_acquire) == head) {
+        return false; // timed out, or closed and empty
+      }
+    }
+    out = std::move(slots_[head & (kCapacity - 1)]);
+    head_.store(head + 1, std::memory_order_seq_cst);
+    wake_waiters();
+    return true;
+  }
+
+  // Wakes both sides; pending values can still be popped, new pushes are refused.
+  void close() {
+    closed_.store(true, std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_all();
+  }
+
+  // Nothing to pop right now. Only meaningful on the consumer side.
+  bool empty() const {
+    return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_relaxed);
+  }
+
+  // A push() right now would block. Only meaningful on the producer side.
+  bool full() const {
+    return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) >= kCapacity;
+  }
+
+  bool is_closed() const {
+    return closed_.load(std::memory_order_acquire);
+  }
+
+  // Consumer -> producer: cut the current stream short (for tokens: end the response
+  // being generated). The producer clears it when it starts on the next request, which
+  // the consumer can only have sent after the interrupted stream ended.
+  void request_stop() {
+    stop_requested_.store(true, std::memory_order_release);
+  }
+
+  bool stop_requested() const {
+    return stop_requested_.load(std::memory_order_acquire);
+  }
+
+  void clear_stop() {
+    stop_requested_.store(false, std::memory_order_release);
+  }
+
+ private:
+  template <typename Pred>
+  void wait_until(const Pred& ready,
+                  const std::chrono::steady_clock::time_point* deadline = nullptr) {
+    // A short spin covers the common case where the other side is mid-handoff.
+    for (int i = 0; i < 64; i += 1) {
+      if (ready() || is_closed()) {
+        return;
+      }
+    }
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (deadline != nullptr) {
+        cv_.wait_until(lock, *deadline, [&] { return ready() || is_closed(); });
+      } else {
+        cv_.wait(lock, [&] { return ready() || is_closed(); });
+      }
+    }
+    waiters_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  void wake_waiters() {
+    // seq_cst pairs with the fetch_add in wait_until: either we see the waiter,
+    // or the waiter sees our index update when it re-checks under the lock.
+    if (waiters_.load(std::memory_order_seq_cst) > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
+    }
+  }
+
+  std::array<T, kCapacity> slots_;
+  alignas(64) std::atomic<size_t> head_{0}; // only written by the consumer
+  alignas(64) std::atomic<size_t> tail_{0}; // only written by the producer
+  alignas(64) std::atomic<int> waiters_{0};
+  std::atomic<bool> closed_{false};
+  std::atomic<bool> stop_requested_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
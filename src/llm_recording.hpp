@@ -0,0 +1,123 @@
+
+#ifdef LLM_RECORDING
+#error "Only include llm_recording.hpp ONCE!"
+#endif
+#define LLM_RECORDING
+
+// Recordings of the traffic between the control thread and an LLM backend, so the
+// control side can later run against a replay instead of a model (see llm_backend.hpp).
+//
+// File layout:
+//
+//   "MGREC\0\0\0", u32 version
+//   events: [u8 type][varint microseconds since the previous event][varint size][payload]
+//
+// Most events are one streamed LlmToken, so a response costs a few bytes per token
+// on top of its text.
+
+constexpr uint32_t kLlmRecordingVersion = 1;
+
+enum LlmRecordedType : uint8_t {
+  kRecordedUserInput = 'U', // a line prompt_user() returned
+  kRecordedPrompt = 'P',    // shared_prefix + text of a prompt sent to the backend
+  kRecordedText = 'T',      // one chunk of response text
+  kRecordedEnd = 'E',       // end of response
+};
+
+struct LlmRecordedEvent {
+  uint8_t type = 0;
+  uint64_t delta_us = 0;
+  std::string payload;
+};
+
+// Appends events to a recording; safe to call from the control and backend threads.
+class LlmRecorder {
+ public:
+  bool Open(const std::filesystem::path& path) {
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    out_.write("MGREC\0\0\0", 8);
+    out_.write(reinterpret_cast<const char*>(&kLlmRecordingVersion), sizeof(kLlmRecordingVersion));
+    last_event_ = std::chrono::steady_clock::now();
+    return static_cast<bool>(out_);
+  }
+
+  void Record(uint8_t type, std::string_view payload) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    const uint64_t delta_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - last_event_).count();
+    last_event_ = now;
+    buffer_.clear();
+    buffer_.push_back(static_cast<char>(type));
+    AppendVarint(delta_us);
+    AppendVarint(payload.size());
+    buffer_.append(payload.data(), payload.size());
+    out_.write(buffer_.data(), buffer_.size());
+  }
+
+  void Flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out_.flush();
+  }
+
+ private:
+  void AppendVarint(uint64_t value) {
+    while (value >= 0x80) {
+      buffer_.push_back(static_cast<char>(value | 0x80));
+      value >>= 7;
+    }
+    buffer_.push_back(static_cast<char>(value));
+  }
+
+  std::mutex mutex_;
+  std::ofstream out_;
+  std::string buffer_;
+  std::chrono::steady_clock::time_point last_event_;
+};
+
+// Reads a whole recording. A truncated last event (recording cut short by a crash)
+// is dropped; anything else malformed fails the read.
+bool read_llm_recording(const std::filesystem::path& path, std::vector<LlmRecordedEvent>& events) {
+  MappedFile file;
+  if (!file.open(path) || file.size() < 12 || memcmp(file.data(), "MGREC\0\0\0", 8) != 0) {
+    return false;
+  }
+  uint32_t version;
+  memcpy(&version, file.data() + 8, sizeof(version));
+  if (version != kLlmRecordingVersion) {
+    return false;
+  }
+  const uint8_t* p = file.data() + 12;
+  const uint8_t* end = file.data() + file.size();
+  auto read_varint = [&](uint64_t& value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+      const uint8_t byte = *p++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+  events.clear();
+  while (p < end) {
+    LlmRecordedEvent event;
+    event.type = *p++;
+    uint64_t size = 0;
+    if (!read_varint(event.delta_us) || !read_varint(size) || size > static_cast<size_t>(end - p)) {
+      break;
+    }
+    if (event.type != kRecordedUserInput && event.type != kRecordedPrompt &&
+        event.type != kRecordedText && event.type != kRecordedEnd) {
+      return false;
+    }
+    event.payload.assign(reinterpret_cast<const char*>(p), size);
+    p += size;
+    events.push_back(std::move(event));
+  }
+  return true;
+}
+
+// Set while MIRROR_GAZE_RECORD is recording this process.
+LlmRecorder* llm_recorder = nullptr;
@@ -11,6 +11,9 @@
 #include <filesystem>
 #include <queue>
 #include <optional>
+#include <atomic>
+#include <mutex>
+#include <memory>
 #include <chrono>
 #include <sstream>
 #include <algorithm>
@@ -27,17 +30,148 @@
 #include "hwy/profiler.h"
 #include "hwy/timer.h"
 
+#include "trace.hpp"
+#include "llm_channel.hpp"
+#include "kv_prefix.hpp"
+#include "kv_layout.hpp"
+#include "context_window.hpp"
+#include "mapped_file.hpp"
+#include "kv_cache.hpp"
+#include "kv_codec.hpp"
+#include "memory_budget.hpp"
+#include "session_snapshot.hpp"
+#include "prompt_builder.hpp"
+#include "typing_prefill.hpp"
+#include "cpu_topology.hpp"
+#include "detokenizer.hpp"
+#include "token_grammar.hpp"
+#include "sampler.hpp"
+#include "output_filter.hpp"
+#include "terminal_renderer.hpp"
+#include "keypress_watcher.hpp"
+#include "line_editor.hpp"
+#include "stop_conditions.hpp"
+#include "model_cascade.hpp"
+#include "response_cache.hpp"
+#include "recall_index.hpp"
+#include "slice_scheduler.hpp"
+#include "flow_metrics.hpp"
+#include "llm_recording.hpp"
+
+// One request for the LLM thread.
+struct LlmPrompt {
+  std::string text;
+  // Optional leading text that several prompts have in common. The model sees
+  // shared_prefix + text, but the prefix is only prefilled once (see KVPrefixCache).
+  std::string shared_prefix;
+  // If set and the conversation is empty, the state after this prompt's response is
+  // snapshotted to disk and restored on later launches instead of being regenerated.
+  bool cache_opening_state = false;
+  // With "%q": save the session here before quitting. With "%r": resume from here.
+  std::string session_file;
+  // Checked on every generated token; the response ends as soon as one is met.
+  StopConditions stop;
+  // If set, the response has to match this regular expression (see token_grammar.hpp).
+  std::string grammar;
+  // Which model answers, when a small one is loaded next to the main one (see model_cascade.hpp).
+  ModelTier tier = ModelTier::kAuto;
+  // Not a prompt yet: the words the user has typed so far, which the next prompt will
+  // start with. Only prefilled (see TypingPrefill), never answered.
+  bool draft = false;
+};
+
+// One chunk of streamed response text, or the end-of-response marker. Fixed-size so
+// streaming a token to the control thread never allocates; text longer than kMaxBytes
+// is split over several chunks at UTF-8 boundaries.
+struct LlmToken {
+  static constexpr size_t kMaxBytes = 54;
+  bool end_of_response = false;
+  uint8_t size = 0;
+  char bytes[kMaxBytes];
+  // Only stamped while flow_metrics is set, to measure the handoff.
+  std::chrono::steady_clock::time_point pushed_at;
+
+  std::string_view text() const { return std::string_view(bytes, size); }
+};
+
+using LlmPromptChannel = SpscChannel<LlmPrompt, 16>;
+using LlmTokenChannel = SpscChannel<LlmToken, 1024>;
+
 // These are global state variables used to move between the logical control system
 // and the LLM-based response-generation system.
 //
 // Recieves entire prompts
-std::queue<std::string> llm_input_queue;
-// Returns word-by-word generated decoded tokens, and None when generation completes.
-std::queue<std::optional<std::string>> llm_output_tokens_queue;
-// These are updated periodically and ought be used to read the current terminal dimensions
-int term_w = 120;
-int term_h = 40;
-bool exit_requested = false;
+LlmPromptChannel llm_input_queue;
+// Returns word-by-word generated decoded tokens, and end_of_response when generation completes.
+LlmTokenChannel llm_output_tokens_queue;
+// Set by whichever side shuts down first; both channels are closed at the same time
+// so nobody is left blocked on a pop().
+std::atomic<bool> exit_requested{false};
+
+// Called by an LLM backend (see llm_backend.hpp) when it is done serving input/output.
+void request_exit(LlmPromptChannel& input, LlmTokenChannel& output) {
+  exit_requested = true;
+  input.close();
+  output.close();
+}
+
+// Pushes token; a daemon session (scheduler set, and held) lets go of the model while the
+// channel is full, or a client that stops reading would stall every other session too.
+void push_to_output(LlmTokenChannel& output, const LlmToken& token, SliceScheduler* scheduler) {
+  if (scheduler != nullptr && output.full()) {
+    scheduler->Release();
+    output.push(token);
+    scheduler->Acquire();
+    return;
+  }
+  output.push(token);
+}
+
+void push_text_to_output(LlmTokenChannel& output, std::string_view text,
+                         SliceScheduler* scheduler = nullptr) {
+  TRACE_ZONE("handoff_push");
+  while (text.size() > 0) {
+    LlmToken token;
+    size_t n = std::min(text.size(), LlmToken::kMaxBytes);
+    if (n < text.size() && utf8_complete_prefix(text.substr(0, n)) > 0) {
+      n = utf8_complete_prefix(text.substr(0, n));
+    }
+    memcpy(token.bytes, text.data(), n);
+    token.size = static_cast<uint8_t>(n);
+    if (flow_metrics != nullptr) {
+      token.pushed_at = std::chrono::steady_clock::now();
+    }
+    push_to_output(output, token, scheduler);
+    text.remove_prefix(n);
+  }
+}
+
+void push_end_of_response(LlmTokenChannel& output, SliceScheduler* scheduler = nullptr) {
+  LlmToken token;
+  token.end_of_response = true;
+  if (flow_metrics != nullptr) {
+    token.pushed_at = std::chrono::steady_clock::now();
+  }
+  push_to_output(output, token, scheduler);
+}
+
+// Sends an already-generated response to the control thread word by word, the same
+// way stream_token does while generating.
+void stream_text_to_output(LlmTokenChannel& output, const std::string& text,
+                           SliceScheduler* scheduler = nullptr) {
+  size_t word_start = 0;
+  while (word_start < text.size()) {
+    size_t word_end = text.find(' ', word_start + 1);
+    if (word_end == std::string::npos) {
+      word_end = text.size();
+    }
+    push_text_to_output(output, std::string_view(text).substr(word_start, word_end - word_start), scheduler);
+    word_start = word_end;
+  }
+  push_end_of_response(output, scheduler);
+}
+
+const char* model_from_file_name(std::string& file_name);
 
 namespace gcpp {
 
@@ -59,6 +193,8 @@ void ShowHelp(gcpp::LoaderArgs& loader, gcpp::InferenceArgs& inference,
   inference.Help();
   std::cerr << "\n*Application Arguments*\n\n";
   app.Help();
+  std::cerr << "\n*Sampling Arguments*\n\n";
+  SamplerArgs(0, nullptr).Help();
   std::cerr << "\n";
 }
 
@@ -86,13 +222,69 @@ void ShowConfig(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app) {
   }
 }
 
-void ReplGemma(gcpp::Gemma& model, ModelTraining training,
-               gcpp::KVCache& kv_cache, hwy::ThreadPool& pool,
-               const InferenceArgs& args, int verbosity,
-               const gcpp::AcceptFunc& accept_token, std::string& eot_line) {
+void ReplGemma(gcpp::Gemma& model, ModelTraining training, gcpp::Model model_type,
+               uint64_t model_key, gcpp::KVCache& kv_cache, hwy::ThreadPool& pool,
+               const InferenceArgs& args, const SamplerArgs& sampler_args, int verbosity,
+               const gcpp::AcceptFunc& accept_token, std::string& eot_line,
+               const TokenByteTable& token_bytes,
+               LlmPromptChannel& input, LlmTokenChannel& output, SliceScheduler* scheduler) {
   size_t abs_pos = 0;      // absolute token index over all turns
   int current_pos = 0;  // token index within the current turn
   int prompt_size{};
+  // Tokens streamed into the KV cache since it was last rebuilt from scratch (empty after
+  // restoring a snapshot, whose tokens aren't stored).
+  std::vector<int> kv_tokens;
+  kv_tokens.reserve(args.max_tokens);
+  // Whether ContextWindow::Compact has run since the cache was last empty. Its rotated
+  // and summary rows were computed against turns it evicted, so the KV contents are no
+  // longer a function of kv_tokens.
+  bool kv_compacted = false;
+  KVPrefixCache prefix_cache(model_type != gcpp::Model::GRIFFIN_2B);
+  // The user's next prompt, prefilled while it is typed.
+  TypingPrefill typing(model_type != gcpp::Model::GRIFFIN_2B);
+  const KVCacheLayout kv_layout = kv_cache_layout(model_type);
+  // How far the conversations have reached into kv_cache, to give memory back on restarts.
+  KVRowTracker kv_rows(kv_layout);
+  // Keeps multiturn conversations inside a token budget, see context_window.hpp.
+  ContextWindow context(model, kv_layout, context_window_budget(args),
+                        model_type != gcpp::Model::GRIFFIN_2B);
+  // Text of the response being generated, kept for session snapshots.
+  std::string last_response;
+  IncrementalDetokenizer detokenizer(token_bytes, model.Tokenizer());
+  // Whitespace before the first visible character of a response is dropped.
+  bool trim_response_start = true;
+  // Per-prompt stop conditions, and whether the current response is still streaming.
+  StopMatcher stop_matcher;
+  size_t max_response_tokens = 0;
+  size_t response_tokens = 0;
+  bool response_open = false;
+  // Turns prompt text into tokens, re-tokenizing only text it hasn't seen.
+  PromptBuilder prompt_builder(model.Tokenizer());
+  // Instruction-tuned models end a response with "<end_of_turn>" rather than EOS.
+  const int end_of_turn_id = prompt_builder.end_of_turn_id();
+  // Per-prompt grammar: accept_token only lets through tokens that keep the response
+  // matching it.
+  TokenGrammarCache grammars(token_bytes, end_of_turn_id);
+  GrammarCursor grammar_cursor;
+  const gcpp::AcceptFunc constrained_accept_token = [&grammar_cursor, &accept_token](int token) {
+    return grammar_cursor.Allows(token) && accept_token(token);
+  };
+  std::vector<int> prompt;
+  // Appends what a prompt starts with: "<bos>" at the start of a conversation, the user
+  // turn (closing the model's turn before it), the text. For instruction-tuned models a
+  // forked prefix has already opened the turn and holds the shared prefix.
+  auto start_prompt = [&](std::vector<int>& out, const LlmPrompt& request, bool forked_prefix) {
+    if (abs_pos == 0) {
+      out.push_back(kGemmaBosId);
+    }
+    if (training == ModelTraining::GEMMA_IT && !forked_prefix) {
+      prompt_builder.AppendUserTurn(out, /*continuation=*/abs_pos != 0);
+    }
+    if (!forked_prefix) {
+      prompt_builder.AppendText(out, request.shared_prefix);
+    }
+    prompt_builder.AppendText(out, request.text);
+  };
 
   std::mt19937 gen;
   if (args.deterministic) {
@@ -102,56 +294,162 @@ void ReplGemma(gcpp::Gemma& model, ModelTraining training,
     std::random_device rd;
     gen.seed(rd());
   }
+  // Samples every token this session's GenerateGemma picks (see sampler.hpp).
+  Sampler sampler(sampler_args);
+  SessionSamplerScope sampler_scope(sampler, gen);
+
+  // Snapshots carry the RNG state, which only --deterministic wants back: any other
+  // launch restoring it would replay the draws of the run that saved it.
+  auto reseed_after_restore = [&args, &gen]() {
+    if (!args.deterministic) {
+      std::random_device rd;
+      gen.seed(rd());
+    }
+  };
+
+  // Ends the current response: at EOS or "<end_of_turn>", when a stop condition is met,
+  // on an interrupt from the control thread, or when --max_generated_tokens runs out. In
+  // all of them the last token streamed is the one whose row is never written, so abs_pos
+  // needs no correction and the cache continues cleanly into the next turn.
+  auto end_response = [&abs_pos, &args, &gen, &last_response, &kv_tokens, &kv_compacted,
+                       &detokenizer, &kv_cache, &kv_rows, &output, &stop_matcher, &response_open,
+                       scheduler]() {
+    if (!args.multiturn) {
+      kv_rows.Restart(kv_cache, abs_pos);
+      abs_pos = 0;
+      kv_tokens.clear();
+      kv_compacted = false;
+      if (args.deterministic) {
+        std::cout << "args.deterministic == true!" << std::endl;
+        gen.seed(42);
+      }
+    }
+    /*if (verbosity >= 2) {
+      std::cout << "\n[ End ]\n";
+    }*/
+    std::string_view tail = stop_matcher.Push(detokenizer.Flush());
+    last_response.append(tail.data(), tail.size());
+    push_text_to_output(output, tail, scheduler);
+    tail = stop_matcher.Finish();
+    last_response.append(tail.data(), tail.size());
+    push_text_to_output(output, tail, scheduler);
+    push_end_of_response(output, scheduler);
+    response_open = false;
+  };
+
+  // Start of the current prefill or decode step, for the trace.
+  double step_start_us = 0;
+  // Every token streamed after the prompt, for the response cache.
+  std::vector<int> generated_tokens;
+  generated_tokens.reserve(args.max_generated_tokens + 1);
+  // Deterministic responses are replayed from disk when possible, see response_cache.hpp.
+  ResponseCache response_cache(mirror_gaze_cache_dir() / "responses",
+                               args.deterministic ? ResponseCache::ConfiguredMaxBytes() : 0);
+  std::vector<int> cached_tokens;
+  std::string cached_rng_state;
 
   // callback function invoked for each generated token.
-  auto stream_token = [&abs_pos, &current_pos, &args, &gen, &prompt_size,
-                       tokenizer = model.Tokenizer(),
-                       verbosity](int token, float) {
+  // Nothing in here allocates per token: detokenizer writes into its own reused buffer,
+  // LlmToken is fixed-size and kv_tokens/last_response are reserved up front.
+  auto stream_token = [&abs_pos, &current_pos, &prompt_size, &last_response, &kv_tokens,
+                       &detokenizer, &trim_response_start, &kv_rows, &output, &stop_matcher,
+                       &max_response_tokens, &response_tokens, &end_response,
+                       &grammar_cursor, &token_bytes, &step_start_us, &generated_tokens,
+                       end_of_turn_id, scheduler](int token, float) {
+    if (scheduler != nullptr) {
+      scheduler->Yield(); // let other sessions have a turn between steps
+    }
     ++abs_pos;
     ++current_pos;
+    kv_rows.Touch(abs_pos);
+    kv_tokens.push_back(token);
     // <= since position is incremented before
+    if (trace_enabled && current_pos > prompt_size) {
+      // The first sampled token ends prefill, each later one a decode step.
+      const bool first = current_pos == prompt_size + 1;
+      trace_span(first ? "prefill" : "decode", step_start_us, first ? prompt_size : token);
+      step_start_us = trace_clock();
+    }
+    if (current_pos > prompt_size) {
+      generated_tokens.push_back(token);
+    }
     if (current_pos <= prompt_size) {
       //std::cerr << "." << std::flush;
     } else if (token == gcpp::EOS_ID) {
-      if (!args.multiturn) {
-        abs_pos = 0;
-        if (args.deterministic) {
-          std::cout << "args.deterministic == true!" << std::endl;
-          gen.seed(42);
-        }
-      }
-      /*if (verbosity >= 2) {
-        std::cout << "\n[ End ]\n";
-      }*/
-      llm_output_tokens_queue.push(std::nullopt);
+      end_response();
+    } else if (token == end_of_turn_id) {
+      end_response();
+      return false; // GenerateGemma only stops by itself at EOS
     } else {
-      std::string token_text;
-      HWY_ASSERT(tokenizer->Decode(std::vector<int>{token}, &token_text));
-      // +1 since position is incremented above
-      if (current_pos == prompt_size + 1) {
-        // first token of response
-        token_text.erase(0, token_text.find_first_not_of(" \t\n"));
-        /*if (verbosity >= 1) {
-          std::cout << "\n\n";
-        }*/
+      const double detokenize_start_us = trace_clock();
+      std::string_view token_text = detokenizer.Push(token);
+      trace_span("detokenize", detokenize_start_us);
+      if (trim_response_start) {
+        token_text.remove_prefix(std::min(token_text.size(), token_text.find_first_not_of(" \t\n")));
+        trim_response_start = token_text.size() < 1;
       }
+      token_text = stop_matcher.Push(token_text);
       //std::cout << token_text << std::flush;
-      llm_output_tokens_queue.push(token_text);
+      last_response.append(token_text.data(), token_text.size());
+      push_text_to_output(output, token_text, scheduler);
+      response_tokens += 1;
+      grammar_cursor.Advance(token_bytes.Piece(token));
+      if (stop_matcher.stopped() || output.stop_requested() || grammar_cursor.finished() ||
+          (max_response_tokens > 0 && response_tokens >= max_response_tokens)) {
+        end_response();
+        return false; // GenerateGemma treats a refused token like EOS
+      }
     }
-    return true;
+    return !output.is_closed(); // nobody left to read the rest
   };
 
   while (abs_pos < args.max_tokens) {
-    std::string prompt_string;
-    // Poll/Read from queue
-    while (llm_input_queue.size() < 1) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // Idle until the next prompt: a good time to shrink a long conversation. Gives up
+    // as soon as a prompt arrives.
+    // Not while the user is typing: the summary would overwrite the prefilled draft.
+    if (context.WantsCompaction(abs_pos) && input.empty() && !typing.active()) {
+      SliceLease lease(scheduler);
+      std::string summary;
+      auto keep_going = [&input, &output, scheduler]() {
+        if (scheduler != nullptr) {
+          scheduler->Yield();
+        }
+        return input.empty() && !output.is_closed();
+      };
+      kv_rows.Touch(abs_pos + ContextWindow::kMaxSummaryTokens + 64);
+      if (context.Summarize(kv_cache, pool, args, abs_pos, keep_going, summary)) {
+        prefix_cache.OnGenerate(context.Compact(kv_cache, pool, args, abs_pos, kv_tokens, summary));
+        kv_rows.Restart(kv_cache, abs_pos);
+        kv_compacted = true;
+      }
+    }
+
+    LlmPrompt request;
+    // Blocks until the control thread hands us a prompt
+    if (!input.pop(request)) {
+      return; // channel closed, shutting down
+    }
+    if (request.draft) {
+      // Prefill what the user has typed so far into the rows after abs_pos, unless it
+      // wouldn't fit without compacting.
+      SliceLease lease(scheduler);
+      prompt.clear();
+      start_prompt(prompt, request, /*forked_prefix=*/false);
+      if (typing.supported() && !context.MustCompact(abs_pos, prompt.size()) &&
+          abs_pos + prompt.size() + 1 < args.max_tokens) {
+        prefix_cache.OnGenerate(abs_pos);
+        kv_rows.Touch(abs_pos + prompt.size());
+        typing.Prefill(model, prompt, abs_pos, kv_cache, pool, args);
+      }
+      continue;
     }
-    // We know llm_input_queue.size() > 0 now
-    prompt_string = llm_input_queue.front();
-    llm_input_queue.pop();
+    const size_t flow_index = flow_prompts_popped.fetch_add(1);
+    // An interrupt for the previous response may have come in after it ended.
+    output.clear_stop();
+    // The model is ours until the response is done, apart from the steps given away in Yield().
+    SliceLease lease(scheduler);
+    std::string& prompt_string = request.text;
 
-    std::vector<int> prompt;
     current_pos = 0;
 
     /*{
@@ -173,32 +471,124 @@ void ReplGemma(gcpp::Gemma& model, ModelTraining training,
     }*/
 
     if (prompt_string == "%q" || prompt_string == "%Q") {
-      exit_requested = true;
+      if (verbosity >= 2 && prefix_cache.forks() > 0) {
+        std::cout << prefix_cache.prefill_tokens_saved() << " prefill tokens saved by "
+                  << prefix_cache.forks() << " shared-prefix forks this session\n";
+      }
+      if (verbosity >= 2 && context.stats().compactions > 0) {
+        print_context_window_stats(context.stats());
+      }
+      if (verbosity >= 2) {
+        print_prompt_builder_stats(prompt_builder.stats());
+      }
+      if (verbosity >= 2 && typing.stats().drafts > 0) {
+        print_typing_prefill_stats(typing.stats());
+      }
+      if (verbosity >= 2 && response_cache.enabled()) {
+        print_response_cache_stats(response_cache.stats());
+      }
+      if (request.session_file.size() > 0 &&
+          !save_session_snapshot(request.session_file, model_key, /*prompt_key=*/0,
+                                 kv_layout, kv_cache, abs_pos, gen, last_response)) {
+        std::cerr << "Could not save session to " << request.session_file << "\n";
+      }
+      input.close();
+      output.close();
       return;
     }
 
+    if (prompt_string == "%r" || prompt_string == "%R") {
+      // Resume: replays the last response of the saved session, or sends nothing back
+      // if there is no usable snapshot.
+      typing.Clear();
+      if (load_session_snapshot(request.session_file, model_key, /*prompt_key=*/0,
+                                kv_layout, kv_cache, abs_pos, gen, last_response)) {
+        reseed_after_restore();
+        kv_rows.Restart(kv_cache, abs_pos);
+        kv_tokens.clear();
+        stream_text_to_output(output, last_response, scheduler);
+      } else {
+        push_end_of_response(output, scheduler);
+      }
+      continue;
+    }
+
+    // The opening prompt of a session is the same on every launch, so the state after
+    // its response is restored from disk when possible.
+    std::filesystem::path opening_state_file;
+    uint64_t opening_prompt_key = 0;
+    if (request.cache_opening_state && abs_pos == 0) {
+      opening_prompt_key = fnv1a64(request.shared_prefix + "\n" + prompt_string);
+      opening_prompt_key = generation_settings_hash(args, sampler_args, request.stop, request.grammar,
+                                                    opening_prompt_key);
+      std::stringstream file_name;
+      file_name << "opening-" << std::hex << model_key << "-" << opening_prompt_key << ".snap";
+      opening_state_file = mirror_gaze_cache_dir() / file_name.str();
+      if (load_session_snapshot(opening_state_file, model_key, opening_prompt_key, kv_layout,
+                                kv_cache, abs_pos, gen, last_response)) {
+        reseed_after_restore();
+        typing.Clear();
+        kv_rows.Restart(kv_cache, abs_pos);
+        kv_tokens.clear();
+        stream_text_to_output(output, last_response, scheduler);
+        continue;
+      }
+    }
+
     if (prompt_string == "%c" || prompt_string == "%C") {
+      kv_rows.Restart(kv_cache, abs_pos);
       abs_pos = 0;
+      kv_tokens.clear();
+      kv_compacted = false;
+      typing.Clear();
       continue;
     }
 
-    if (training == ModelTraining::GEMMA_IT) {
-      // For instruction-tuned models: add control tokens.
-      prompt_string = "<start_of_turn>user\n" + prompt_string +
-                      "<end_of_turn>\n<start_of_turn>model\n";
-      if (abs_pos != 0) {
-        // Prepend "<end_of_turn>" token if this is a multi-turn dialogue
-        // continuation.
-        prompt_string = "<end_of_turn>\n" + prompt_string;
+    // Prompts with a shared prefix fork it out of the KV cache instead of prefilling it
+    // again. That only applies at the start of a conversation; mid-conversation the
+    // prefix is just more prompt text.
+    bool forked_prefix = false;
+    size_t prefix_tokens_reused = 0;
+    if (request.shared_prefix.size() > 0 && abs_pos == 0 &&
+        training == ModelTraining::GEMMA_IT) {
+      typing.Clear(); // the fork writes from row 0
+      std::vector<int> prefix = {kGemmaBosId};
+      prompt_builder.AppendUserTurn(prefix, /*continuation=*/false);
+      prompt_builder.AppendText(prefix, request.shared_prefix);
+      const size_t saved_before = prefix_cache.prefill_tokens_saved();
+      abs_pos = prefix_cache.Fork(model, prefix, kv_cache, pool, args);
+      forked_prefix = abs_pos > 0;
+      if (forked_prefix) {
+        kv_tokens = prefix;
+        kv_rows.Touch(abs_pos);
       }
+      prefix_tokens_reused = prefix_cache.prefill_tokens_saved() - saved_before;
     }
 
-    HWY_ASSERT(model.Tokenizer()->Encode(prompt_string, &prompt));
+    {
+      TRACE_ZONE("tokenize");
+      prompt.clear();
+      start_prompt(prompt, request, forked_prefix);
+      // For instruction-tuned models: close the user turn and open the model's.
+      if (training == ModelTraining::GEMMA_IT) {
+        prompt_builder.AppendModelTurn(prompt);
+      }
+    }
 
-    // For both pre-trained and instruction-tuned models: prepend "<bos>" token
-    // if needed.
-    if (abs_pos == 0) {
-      prompt.insert(prompt.begin(), 2);
+    // The prompt came before the idle-time summary could finish; make room without one.
+    if (context.MustCompact(abs_pos, prompt.size())) {
+      prefix_cache.OnGenerate(context.Compact(kv_cache, pool, args, abs_pos, kv_tokens, ""));
+      kv_rows.Restart(kv_cache, abs_pos);
+      kv_compacted = true;
+    }
+
+    // Whatever the user's drafts of this prompt already prefilled is taken as is.
+    const size_t typed_tokens = typing.Take(prompt, abs_pos);
+    if (typed_tokens > 0) {
+      kv_tokens.insert(kv_tokens.end(), prompt.begin(), prompt.begin() + typed_tokens);
+      abs_pos += typed_tokens;
+      kv_rows.Touch(abs_pos);
+      prompt.erase(prompt.begin(), prompt.begin() + typed_tokens);
     }
 
     prompt_size = prompt.size();
@@ -220,18 +610,88 @@ void ReplGemma(gcpp::Gemma& model, ModelTraining training,
         .verbosity = verbosity,
         .gen = &gen,
         .stream_token = stream_token,
-        .accept_token = accept_token,
+        .accept_token = constrained_accept_token,
     };
-    GenerateGemma(model, runtime_config, prompt, abs_pos, kv_cache, pool,
-                  timing_info);
+    prefix_cache.OnGenerate(abs_pos);
+    last_response.clear();
+    last_response.reserve(16 * 1024);
+    trim_response_start = true;
+    stop_matcher.Begin(request.stop);
+    max_response_tokens = request.stop.max_tokens;
+    response_tokens = 0;
+    response_open = true;
+    grammar_cursor.Begin(request.grammar.empty() ? nullptr : grammars.Get(request.grammar));
+    // Keyed before BeginResponse draws from gen. Needs the KV contents to follow from
+    // kv_tokens, which they don't after restoring a snapshot (its tokens aren't stored)
+    // or after a compaction.
+    const bool cacheable = response_cache.enabled() && kv_tokens.size() == abs_pos && !kv_compacted;
+    const uint64_t response_key = cacheable ? response_cache_key({
+        .model_key = model_key, .history = kv_tokens, .prompt = prompt, .gen = gen, .args = args,
+        .sampler_args = sampler_args, .stop = request.stop, .grammar = request.grammar}) : 0;
+    const size_t response_start_pos = abs_pos;
+    sampler.BeginResponse((static_cast<uint64_t>(gen()) << 32) | gen());
+    generated_tokens.clear();
+    step_start_us = trace_clock();
+    if (cacheable && response_cache.Lookup(response_key, cached_tokens, cached_rng_state)) {
+      // The same calls GenerateGemma would make, minus the model.
+      bool streaming = true;
+      for (int token : prompt) {
+        streaming = streaming && stream_token(token, 0.0f);
+      }
+      for (size_t i = 0; streaming && i < cached_tokens.size(); i += 1) {
+        streaming = stream_token(cached_tokens[i], 0.0f) && cached_tokens[i] != gcpp::EOS_ID;
+      }
+      if (response_open) {
+        end_response();
+      }
+      std::stringstream(cached_rng_state) >> gen;
+      // The next turn continues from the rows generating would have written: everything
+      // streamed except the last token.
+      if (args.multiturn && abs_pos > response_start_pos + 1) {
+        TRACE_ZONE("response_cache_prefill");
+        prefill_kv_rows(model, std::vector<int>(kv_tokens.begin() + response_start_pos, kv_tokens.end() - 1),
+                        response_start_pos, kv_cache, pool, args);
+      }
+    } else {
+      GenerateGemma(model, runtime_config, prompt, abs_pos, kv_cache, pool,
+                    timing_info);
+      if (response_open) {
+        end_response(); // --max_generated_tokens ran out before EOS
+      }
+      // A response cut short by the user or a closed channel isn't the model's to replay.
+      if (cacheable && !output.stop_requested() && !output.is_closed()) {
+        std::stringstream rng_ss;
+        rng_ss << gen;
+        response_cache.Store(response_key, generated_tokens, rng_ss.str());
+      }
+    }
+    if (flow_metrics != nullptr) {
+      flow_metrics->RecordModel(flow_index, prompt_size, current_pos - prompt_size, timing_info);
+    }
+    if (!opening_state_file.empty()) {
+      save_session_snapshot(opening_state_file, model_key, opening_prompt_key,
+                            kv_layout, kv_cache, abs_pos, gen, last_response);
+    }
+    if (verbosity >= 1) {
+      warn_if_over_memory_budget();
+    }
     if (verbosity >= 2) {
       std::cout << current_pos << " tokens (" << abs_pos << " total tokens)"
+                << "\n"
+                << prefix_tokens_reused << " prefix tokens reused from the KV cache"
                 << "\n"
                 << timing_info.prefill_tok_sec << " prefill tokens / sec"
                 << "\n"
                 << timing_info.gen_tok_sec << " tokens / sec" << "\n"
                 << static_cast<int>(timing_info.time_to_first_token * 1000)
-                << " milliseconds time to first token" << "\n";
+                << " milliseconds time to first token" << "\n"
+                << kv_cache_resident_bytes(kv_cache, kv_layout, kv_rows.high_water()) / (1024 * 1024)
+                << " MiB of KV cache in use (" << kv_rows.released_rows()
+                << " rows released so far)" << "\n";
+      print_memory_use();
+      if (context.enabled()) {
+        print_context_window_stats(context.stats());
+      }
     }
     //std::cout << "\n\n";
   }
@@ -241,19 +701,145 @@ void ReplGemma(gcpp::Gemma& model, ModelTraining training,
       << "command line flag.\n";
 }
 
-void Run(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app) {
-  hwy::ThreadPool pool(app.num_threads);
-  // For many-core, pinning threads to cores helps.
-  if (app.num_threads > 10) {
-    PinThreadToCore(app.num_threads - 1);  // Main thread
+// Bytes of every vocabulary piece, for the allocation-free detokenizer in ReplGemma.
+void load_token_byte_table(LoaderArgs& loader, gcpp::Gemma& model, TokenByteTable& token_bytes) {
+  const uint64_t tokenizer_key = file_identity_key(loader.tokenizer.path, kTokenByteTableVersion);
+  std::stringstream file_name;
+  file_name << "tokens-" << std::hex << tokenizer_key << ".bin";
+  if (!token_bytes.Load(*model.Tokenizer(), vocab_size_for_model(loader.ModelType()),
+                        tokenizer_key, mirror_gaze_cache_dir() / file_name.str())) {
+    std::cerr << "Could not build the token byte table, decoding tokens one at a time\n";
+  }
+}
 
-    pool.Run(0, pool.NumThreads(),
-             [](uint64_t /*task*/, size_t thread) { PinThreadToCore(thread); });
+// A 2b model loaded next to the main one, sharing its tokenizer and thread pool: the
+// small model of a cascade. nullptr, with the reason on stderr, if sbs_file can't be
+// used.
+std::unique_ptr<gcpp::Gemma> load_companion_model(const char* env_name, const char* sbs_file,
+                                                  const LoaderArgs& loader, const MemoryPlan& memory_plan,
+                                                  hwy::ThreadPool& pool) {
+  std::string file_name = std::filesystem::path(sbs_file).filename().string();
+  std::vector<char*> companion_args = {
+    (char*)"mirror-gaze",
+    (char*)"--tokenizer", (char*)loader.tokenizer.path.c_str(),
+    (char*)"--weights", (char*)sbs_file,
+    (char*)"--model", (char*)model_from_file_name(file_name),
+  };
+  gcpp::LoaderArgs companion_loader(companion_args.size(), companion_args.data());
+  if (const char* error = companion_loader.Validate()) {
+    std::cerr << "Ignoring " << env_name << ": " << error << "\n";
+    return nullptr;
+  }
+  if (companion_loader.ModelType() != gcpp::Model::GEMMA_2B) {
+    // Callers give it a 2b KV cache, and the memory plan counts on a 2b.
+    std::cerr << "Ignoring " << env_name << ": it must be a 2b model\n";
+    return nullptr;
   }
+  return std::make_unique<gcpp::Gemma>(companion_loader.tokenizer, companion_loader.weights,
+                                       companion_loader.ModelType(), pool);
+}
 
+using ReplLoop = std::function<void(LlmPromptChannel& input, LlmTokenChannel& output, SliceScheduler* scheduler)>;
+
+// Answers input/output with two ReplGemma loops, one per model, sending each prompt to one
+// of them (see model_cascade.hpp). Only one prompt is in flight at a time, but the loops
+// also use their model while idle (typing prefill, compaction), so they hold a shared
+// SliceScheduler whenever they do.
+void run_model_cascade(const ReplLoop& large_loop, const ReplLoop& small_loop, bool multiturn,
+                       int verbosity, LlmPromptChannel& input, LlmTokenChannel& output) {
+  SliceScheduler scheduler(std::chrono::milliseconds(10));
+  LlmPromptChannel large_input;
+  LlmTokenChannel large_output;
+  LlmPromptChannel small_input;
+  LlmTokenChannel small_output;
+  std::thread large_t([&]() {
+    trace_thread_name("llm large");
+    large_loop(large_input, large_output, &scheduler);
+  });
+  std::thread small_t([&]() {
+    trace_thread_name("llm small");
+    small_loop(small_input, small_output, &scheduler);
+  });
+  CascadeStats stats;
+  LlmPrompt prompt;
+  while (input.pop(prompt)) {
+    const std::string& text = prompt.text;
+    const bool quit = text == "%q" || text == "%Q";
+    // Drafts are prefilled where multiturn prompts go, and the commands are about the
+    // conversation, which only the large model holds; the small one answers from scratch
+    // every time. Of the commands, only resuming sends a response back.
+    const bool command = text == "%r" || text == "%R" || text == "%c" || text == "%C" || quit;
+    const bool to_small = !prompt.draft && !command &&
+                          route_to_small_model(prompt.tier, prompt.stop, prompt.grammar, multiturn);
+    const bool responds = !prompt.draft && (!command || text == "%r" || text == "%R");
+    if (responds) {
+      output.clear_stop();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    if (!(to_small ? small_input : large_input).push(std::move(prompt))) {
+      break;
+    }
+    if (quit) {
+      break; // the large loop saves the session and returns; the small one is closed below
+    }
+    if (!responds) {
+      continue;
+    }
+    LlmTokenChannel& model_output = to_small ? small_output : large_output;
+    LlmToken token;
+    bool forwarding = true;
+    while (forwarding && model_output.pop(token)) {
+      if (output.stop_requested()) {
+        model_output.request_stop();
+      }
+      forwarding = !token.end_of_response;
+      if (!output.push(token)) {
+        forwarding = false;
+      }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    (to_small ? stats.small_prompts : stats.large_prompts) += 1;
+    (to_small ? stats.small_seconds : stats.large_seconds) += seconds;
+    if (output.is_closed()) {
+      break;
+    }
+  }
+  small_input.close();
+  small_output.close();
+  large_t.join(); // after %q, once the session is saved
+  large_input.close();
+  large_output.close();
+  small_t.join();
+  if (verbosity >= 2) {
+    print_cascade_stats(stats);
+  }
+}
+
+void Run(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app, const SamplerArgs& sampling,
+         const MemoryPlan& memory_plan, LlmPromptChannel& input, LlmTokenChannel& output) {
+  hwy::ThreadPool pool(app.num_threads);
+  const CpuTopology topology = read_cpu_topology();
+  place_threads(pool, topology, app.verbosity);
+
+  const double load_start_us = trace_clock();
   gcpp::Gemma model(loader.tokenizer, loader.weights, loader.ModelType(), pool);
+  trace_span("load_weights", load_start_us);
 
-  auto kv_cache = CreateKVCache(loader.ModelType());
+  auto kv_cache = CreateReleasableKVCache(loader.ModelType());
+
+  TokenByteTable token_bytes;
+  load_token_byte_table(loader, model, token_bytes);
+  recall_tokenizer.store(model.Tokenizer(), std::memory_order_release); // see recall_index.hpp
+  if (recall_wants_model_rows.load()) {
+    recall_install_model_rows(model, kv_cache, pool);
+  }
+
+  // Optional small model that answers the light prompts, see model_cascade.hpp.
+  std::unique_ptr<gcpp::Gemma> small_model;
+  if (const char* small_model_sbs_file = cascade_small_model_file()) {
+    small_model = load_companion_model("GEMMA_SMALL_MODEL_SBS_FILE", small_model_sbs_file, loader,
+                                       memory_plan, pool);
+  }
 
   if (const char* error = inference.Validate()) {
     ShowHelp(loader, inference, app);
@@ -282,35 +868,36 @@ void Run(LoaderArgs& loader, InferenceArgs& inference, AppArgs& app) {
     std::cout << "\n" << instructions << "\n";
   }*/
 
-  ReplGemma(
-      model, loader.ModelTraining(), kv_cache, pool, inference, app.verbosity,
-      /*accept_token=*/[](int) { return true; }, app.eot_line);
-}
-
-} // namespace gcpp
+  const uint64_t model_key = model_files_key(loader.weights.path, loader.tokenizer.path);
+  if (small_model == nullptr) {
+    ReplGemma(
+        model, loader.ModelTraining(), loader.ModelType(), model_key, kv_cache, pool, inference, sampling,
+        app.verbosity, /*accept_token=*/[](int) { return true; }, app.eot_line, token_bytes,
+        input, output, /*scheduler=*/nullptr);
+    return;
+  }
 
-#if defined(_WIN32)
-#define WIN32_LEAN_AND_MEAN
-#define VC_EXTRALEAN
-#include <Windows.h>
-#elif defined(__linux__)
-#include <sys/ioctl.h>
-#endif // Windows/Linux
-
-void get_terminal_size(int& width, int& height) {
-#if defined(_WIN32)
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-    width = (int)(csbi.srWindow.Right-csbi.srWindow.Left+1);
-    height = (int)(csbi.srWindow.Bottom-csbi.srWindow.Top+1);
-#elif defined(__linux__)
-    struct winsize w;
-    ioctl(fileno(stdout), TIOCGWINSZ, &w);
-    width = (int)(w.ws_col);
-    height = (int)(w.ws_row);
-#endif // Windows/Linux
+  // Both models share the tokenizer, so the token byte table too, and are taken to be trained alike (both -it or both -pt).
+  const ReplLoop large_loop = [&](LlmPromptChannel& large_input, LlmTokenChannel& large_output,
+                                  SliceScheduler* scheduler) {
+    ReplGemma(
+        model, loader.ModelTraining(), loader.ModelType(), model_key, kv_cache, pool, inference, sampling,
+        app.verbosity, /*accept_token=*/[](int) { return true; }, app.eot_line, token_bytes,
+        large_input, large_output, scheduler);
+  };
+  const ReplLoop small_loop = [&](LlmPromptChannel& small_input, LlmTokenChannel& small_output,
+                                  SliceScheduler* scheduler) {
+    auto small_kv_cache = CreateReleasableKVCache(gcpp::Model::GEMMA_2B);
+    ReplGemma(
+        *small_model, loader.ModelTraining(), gcpp::Model::GEMMA_2B,
+        model_files_key(cascade_small_model_file(), loader.tokenizer.path), small_kv_cache, pool, inference,
+        sampling, app.verbosity, /*accept_token=*/[](int) { return true; }, app.eot_line, token_bytes,
+        small_input, small_output, scheduler);
+  };
+  run_model_cascade(large_loop, small_loop, inference.multiturn, app.verbosity, input, output);
 }
 
+} // namespace gcpp
 
 std::string get_username_from_env() {
   if (const char* env_var = std::getenv("username")) { // Windows
@@ -352,10 +939,15 @@ const char* model_from_file_name(std::string& file_name) {
 }
 
 
-void run_llm_thread(int argc, char** argv) {
+void run_llm_thread(int argc, char** argv, LlmPromptChannel& input, LlmTokenChannel& output) {
+  trace_thread_name("llm");
+  const double parse_start_us = trace_clock();
   gcpp::LoaderArgs loader(argc, argv);
   gcpp::InferenceArgs inference(argc, argv);
   gcpp::AppArgs app(argc, argv);
+  if (std::none_of(argv, argv + argc, [](const char* arg) { return strcmp(arg, "--num_threads") == 0; })) {
+    app.num_threads = tuned_num_threads(read_cpu_topology(), loader.weights.path, app.num_threads);
+  }
 
   if (gcpp::HasHelp(argc, argv)) {
     ShowHelp(loader, inference, app);
@@ -369,126 +961,193 @@ void run_llm_thread(int argc, char** argv) {
     std::exit(0);
   }
 
-  gcpp::Run(loader, inference, app);
-
-  exit_requested = true;
-}
-
+  const SamplerArgs sampling(argc, argv);
+  if (const char* error = sampling.Validate()) {
+    ShowHelp(loader, inference, app);
+    HWY_ABORT("\nInvalid args: %s", error);
+  }
 
-void update_term_size_globals_thread() {
-  while (!exit_requested) {
-    get_terminal_size(term_w, term_h);
-    std::this_thread::sleep_for(std::chrono::milliseconds(750));
+  const MemoryPlan memory_plan = plan_memory_for_model(loader.weights.path, loader.ModelType(),
+                                                       {cascade_small_model_file()});
+  apply_memory_plan(memory_plan, inference, argc, argv, app.verbosity);
+  if (app.verbosity >= 2 || (app.verbosity >= 1 && memory_plan.over_budget)) {
+    print_memory_plan(memory_plan);
   }
-}
+  trace_span("parse_args", parse_start_us);
 
-std::string prompt_llm_and_return_value(std::string prompt_txt, bool print_tokens_to_screen) {
-  std::stringstream ss;
-  llm_input_queue.push(prompt_txt);
-  int active_line_chars_printed = 0;
-
-  bool seen_first_token = false;
-  bool first_token_had_quote = false;
-  int last_printed_token_quote_neg_offset = -1;
-  bool trim_leading_space_from_next_token = false;
-
-  while (!exit_requested) {
-    while (llm_output_tokens_queue.size() < 1) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(50));
-    }
-    // We know llm_output_tokens_queue.size() > 0 now
-    auto token = llm_output_tokens_queue.front();
-    llm_output_tokens_queue.pop();
-    if (token.has_value()) {
-      auto val = token.value();
-
-      if (!seen_first_token) {
-        // Trim any leading " chars
-        if (val.size() > 0 && val[0] == '"') {
-          val.erase(0, 1); // in-place mod of val
-          first_token_had_quote = true;
-        }
-        seen_first_token = true;
-      }
-      else if (first_token_had_quote) {
-        // We don't 100% know this is the last one
-        if (val.size() > 0 && val[val.size()-1] == '"') {
-          last_printed_token_quote_neg_offset = 1;
-        }
-        else if (val.size() > 1 && val[val.size()-2] == '"') {
-          last_printed_token_quote_neg_offset = 2;
-        }
-        else {
-          last_printed_token_quote_neg_offset = -1; // no quote at end
-        }
-      }
+  gcpp::Run(loader, inference, app, sampling, memory_plan, input, output);
+  recall_tokenizer.store(nullptr, std::memory_order_release);
 
-      // Also trim leading + trailing "**" tokens
-      auto next_star_pos = val.find("**");
-      while (next_star_pos != std::string::npos) {
-        val.erase(next_star_pos, 2);
-        next_star_pos = val.find("**");
-      }
+  request_exit(input, output);
+}
 
 
-      ss << val;
+std::string prompt_llm_and_return_value(LlmPrompt prompt, bool print_tokens_to_screen) {
+  // Reused across calls so steady-state streaming doesn't allocate.
+  static OutputFilter output_filter = OutputFilter::Default();
+  static TerminalRenderer renderer(fileno(stdout));
+  static size_t prompts_pushed = 0;
+  std::string response;
+  const std::string prompt_text = flow_metrics != nullptr ? prompt.text : std::string();
+  const auto push_time = std::chrono::steady_clock::now();
+  PromptMetrics metrics;
+  llm_input_queue.push(std::move(prompt));
+  prompts_pushed += 1;
+  renderer.Begin();
+  // A key pressed while the response streams on screen ends it early.
+  const bool watch_keys = print_tokens_to_screen && !flows_scripted && keypress_watcher.Begin();
+  bool interrupted = false;
+
+  // Filtered text goes both to the returned string and to the screen.
+  auto emit = [&](std::string_view val) {
+    response.append(val.data(), val.size());
+    if (print_tokens_to_screen && val.size() > 0) {
+      TRACE_ZONE("render");
+      renderer.Write(val);
+      renderer.MaybeFlush();
+    }
+  };
+  // Times the handoff of each token and the work done on it, if flow_metrics is set.
+  auto measure_token = [&](const LlmToken& token, std::chrono::steady_clock::time_point popped) {
+    const double handoff_us = std::chrono::duration<double, std::micro>(popped - token.pushed_at).count();
+    if (metrics.chunks == 0) {
+      metrics.first_token_ms = std::chrono::duration<double, std::milli>(popped - push_time).count();
+    }
+    metrics.chunks += 1;
+    metrics.handoff_us_mean += handoff_us;
+    metrics.handoff_us_max = std::max(metrics.handoff_us_max, handoff_us);
+  };
+  auto render_time_since = [&](std::chrono::steady_clock::time_point start) {
+    metrics.render_ms += std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+  };
 
-      if (print_tokens_to_screen) {
-        if (active_line_chars_printed + val.size() >= term_w) {
-          std::cout << std::endl << std::flush;
-          active_line_chars_printed = 0;
-          trim_leading_space_from_next_token = true;
-        }
-        if (trim_leading_space_from_next_token) {
-          while (val.size() > 0 && val[0] == ' ') {
-            val.erase(0, 1); // in-place mod of val
-          }
-          trim_leading_space_from_next_token = false;
-        }
-        std::cout << val << std::flush;
-        active_line_chars_printed += val.size();
+  LlmToken token;
+  while (true) {
+    // Block for the next token, or only until the buffered frame is due (or the
+    // keyboard is next looked at).
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (renderer.HasPendingFrame()) {
+      deadline = renderer.NextFrameTime();
+    }
+    if (watch_keys && !interrupted) {
+      deadline = std::min(deadline, std::chrono::steady_clock::now() + KeypressWatcher::kPollInterval);
+    }
+    const double wait_start_us = trace_clock();
+    const bool got_token = deadline != std::chrono::steady_clock::time_point::max()
+        ? llm_output_tokens_queue.pop_until(token, deadline)
+        : llm_output_tokens_queue.pop(token);
+    trace_span("handoff_wait", wait_start_us);
+    const auto popped = std::chrono::steady_clock::now();
+    if (watch_keys && !interrupted && keypress_watcher.Poll(popped)) {
+      // The LLM thread ends the response at its next token; keep reading until it has.
+      llm_output_tokens_queue.request_stop();
+      interrupted = true;
+    }
+    if (!got_token && !llm_output_tokens_queue.is_closed()) {
+      if (renderer.HasPendingFrame() && popped >= renderer.NextFrameTime()) {
+        TRACE_ZONE("render");
+        renderer.Flush();
+        render_time_since(popped);
       }
-
+      continue;
+    }
+    if (!got_token && !llm_output_tokens_queue.pop(token)) {
+      break; // the LLM thread has exited
+    }
+    if (flow_metrics != nullptr) {
+      measure_token(token, popped);
+    }
+    if (!token.end_of_response) {
+      const double filter_start_us = trace_clock();
+      const std::string_view filtered = output_filter.Push(token.text());
+      trace_span("filter", filter_start_us);
+      emit(filtered);
+      render_time_since(popped);
     }
     else {
+      emit(output_filter.Finish());
       if (print_tokens_to_screen) {
-        if (last_printed_token_quote_neg_offset >= 0) {
-          // Erase the last 1/2 chars and print spaces before new line
-          for (int i=0; i<last_printed_token_quote_neg_offset; i+=1) {
-            std::cout << "\b";
-            ss.seekp(-1,ss.cur);
-          }
-          std::cout << std::flush;
-          for (int i=0; i<last_printed_token_quote_neg_offset; i+=1) {
-            std::cout << " ";
-            ss << " ";
-          }
-          std::cout << std::flush;
-        }
-        std::cout << std::endl << std::endl;
+        renderer.Write("\n\n");
       }
-      ss << std::endl;
+      response += "\n";
+      render_time_since(popped);
       break; // end of token generation!
     }
   }
-  return ss.str();
+  if (watch_keys) {
+    keypress_watcher.End();
+  }
+  const auto flush_start = std::chrono::steady_clock::now();
+  {
+    TRACE_ZONE("render");
+    renderer.Flush();
+  }
+  render_time_since(flush_start);
+  if (flow_metrics != nullptr) {
+    metrics.wall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - push_time).count();
+    metrics.handoff_us_mean /= std::max<size_t>(metrics.chunks, 1);
+    flow_metrics->RecordControl(prompts_pushed - 1, prompt_text, metrics);
+  }
+  return response;
 }
 
 std::string prompt_llm_and_return_value_silent(std::string prompt_txt) {
-  return prompt_llm_and_return_value(prompt_txt, false);
+  return prompt_llm_and_return_value({prompt_txt}, false);
 }
 
 std::string prompt_llm_and_return_value_interactive(std::string prompt_txt) {
-  return prompt_llm_and_return_value(prompt_txt, true);
+  return prompt_llm_and_return_value({prompt_txt}, true);
+}
+
+// Same as prompt_llm_and_return_value_interactive(shared_prefix + prompt_txt), but lets
+// consecutive prompts that start with the same shared_prefix reuse its prefill.
+std::string prompt_llm_and_return_value_interactive(std::string prompt_txt, std::string shared_prefix) {
+  return prompt_llm_and_return_value({prompt_txt, shared_prefix}, true);
 }
 
 std::string prompt_user(std::string prompt_txt) {
+  if (flows_scripted) {
+    if (scripted_user_inputs.size() < 1) {
+      return "%q";
+    }
+    std::string scripted = scripted_user_inputs.front();
+    scripted_user_inputs.pop_front();
+    std::cout << prompt_txt << scripted << std::endl;
+    return scripted;
+  }
   std::string user_resp;
+  // Keys typed to interrupt the last response start the line; if they included Enter,
+  // they are the whole line.
+  std::string typed = keypress_watcher.TakeTypeAhead();
   while (user_resp.size() < 1) {
-    std::cout << prompt_txt << std::flush;
-    std::getline(std::cin, user_resp);
+    const size_t newline = typed.find('\n');
+    if (newline == std::string::npos && LineEditor::Available()) {
+      // Each finished word goes to the model as a draft to prefill (see TypingPrefill).
+      user_resp = typed;
+      if (!LineEditor::ReadLine(prompt_txt, user_resp, [](const std::string& words) {
+            llm_input_queue.push({.text = words, .draft = true});
+          })) {
+        return "%q";
+      }
+      typed.clear();
+      continue;
+    }
+    std::cout << prompt_txt << typed.substr(0, newline) << std::flush;
+    if (newline != std::string::npos) {
+      user_resp = typed.substr(0, newline);
+      std::cout << "\n";
+    } else {
+      std::getline(std::cin, user_resp);
+      user_resp = typed + user_resp;
+    }
+    typed.clear();
   }
   std::cout << std::endl;
+  if (llm_recorder != nullptr) {
+    llm_recorder->Record(kRecordedUserInput, user_resp);
+  }
   return user_resp;
 }
 
@@ -525,10 +1184,17 @@ bool argv_contains(int argc, char** argv, const char* value) {
   return false;
 }
 
+#include "main_daemon.hpp"
+#include "llm_backend.hpp"
 #include "main_therapist_twoway.hpp"
 #include "main_tasker.hpp"
+#include "main_bench.hpp"
 
 int main(int argc, char** argv) {
+  trace_start_from_env();
+#ifdef GEMMA_SAMPLE_TOKEN_HOOK
+  gcpp::sample_token_hook = sample_with_session_sampler;
+#endif
   if (argv_contains(argc, argv, "therapist")) {
     std::cout << "Running 'therapist'" << std::endl;
     return main_therapist_twoway(argc, argv);
@@ -537,8 +1203,16 @@ int main(int argc, char** argv) {
     std::cout << "Running 'tasker'" << std::endl;
     return main_tasker(argc, argv);
   }
+  else if (argv_contains(argc, argv, "bench")) {
+    std::cout << "Running 'bench'" << std::endl;
+    return main_bench(argc, argv);
+  }
+  else if (argv_contains(argc, argv, "daemon")) {
+    std::cout << "Running 'daemon'" << std::endl;
+    return main_daemon(argc, argv);
+  }
   else {
-    std::cout << "Unknown sub-program to launch! Expected one of: therapist, tasker, " << std::endl;
+    std::cout << "Unknown sub-program to launch! Expected one of: therapist, tasker, daemon, bench, " << std::endl;
   }
 
 
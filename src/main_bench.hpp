@@ -0,0 +1,1432 @@
+
+#ifdef MAIN_BENCH
+#error "Only include main_bench.hpp ONCE!"
+#endif
+#define MAIN_BENCH
+
+// Microbenchmarks for the pieces of mirror-gaze that live outside the model.
+// None of these need model files, so they can run anywhere:
+//
+//   mirror-gaze bench handoff [num_tokens] [token_interval_us]
+//   mirror-gaze bench detokenize [num_tokens] (times the tokenizer too with model files)
+//   mirror-gaze bench grammar [decode_steps]
+//   mirror-gaze bench sampler [tokens]
+//   mirror-gaze bench filter [num_responses]
+//   mirror-gaze bench render [num_responses] [token_interval_us]
+//   mirror-gaze bench kvcodec [snapshot_files...]
+//   mirror-gaze bench replay <recording> [passes]
+//
+// except the daemon load test, which talks to a running 'mirror-gaze daemon', and the
+// benchmarks that load GEMMA_MODEL_SBS_FILE / GEMMA_TOKENIZER_SPM_FILE:
+//
+//   mirror-gaze bench daemon [max_sessions] [prompts_per_session]
+//   mirror-gaze bench threads [decode_tokens]
+//   mirror-gaze bench e2e [json_file]
+//   mirror-gaze bench cascade (also needs GEMMA_SMALL_MODEL_SBS_FILE)
+//   mirror-gaze bench isolation [decode_tokens]
+//
+
+#if defined(__linux__)
+#include <sys/wait.h>
+#endif // Linux
+
+#if defined(MIRROR_GAZE_BENCH_ALLOCATIONS)
+// Counts heap allocations per thread so benchmarks can check that hot paths don't
+// allocate. It replaces the global operator new for the whole program, so it is only
+// compiled into bench builds ('python build.py bench-build', build/mirror-gaze-bench).
+thread_local size_t bench_thread_allocations = 0;
+
+void* operator new(size_t size) {
+  bench_thread_allocations += 1;
+  if (void* p = std::malloc(size > 0 ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+constexpr bool kBenchCountsAllocations = true;
+size_t bench_allocations() { return bench_thread_allocations; }
+#else
+constexpr bool kBenchCountsAllocations = false;
+size_t bench_allocations() { return 0; }
+#endif // MIRROR_GAZE_BENCH_ALLOCATIONS
+
+struct BenchLatencyStats {
+  double p50_us = 0;
+  double p99_us = 0;
+  double max_us = 0;
+  double mean_us = 0;
+};
+
+BenchLatencyStats bench_summarize_us(std::vector<double> samples_us) {
+  BenchLatencyStats stats;
+  if (samples_us.size() < 1) {
+    return stats;
+  }
+  std::sort(samples_us.begin(), samples_us.end());
+  double sum = 0;
+  for (double s : samples_us) {
+    sum += s;
+  }
+  stats.p50_us = samples_us[samples_us.size() / 2];
+  stats.p99_us = samples_us[std::min(samples_us.size() - 1, (samples_us.size() * 99) / 100)];
+  stats.max_us = samples_us.back();
+  stats.mean_us = sum / samples_us.size();
+  return stats;
+}
+
+void bench_print_latency(const char* name, const BenchLatencyStats& stats) {
+  std::cout << name
+            << ": p50 " << stats.p50_us << " us"
+            << ", p99 " << stats.p99_us << " us"
+            << ", max " << stats.max_us << " us"
+            << ", mean " << stats.mean_us << " us" << std::endl;
+}
+
+// Measures the time between a token being handed off inside stream_token and the
+// control thread receiving it. "polled" reproduces the original std::queue + 50ms sleep
+// loop (behind a mutex so the benchmark itself is well-defined), "channel" is SpscChannel.
+int bench_token_handoff(size_t num_tokens, int token_interval_us) {
+  using clock = std::chrono::steady_clock;
+  std::vector<clock::time_point> sent_at(num_tokens);
+  std::vector<double> latencies_us(num_tokens);
+
+  auto pace = [token_interval_us]() {
+    if (token_interval_us > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(token_interval_us));
+    }
+  };
+
+  {
+    std::mutex polled_mutex;
+    std::queue<std::optional<std::string>> polled_queue;
+    std::thread producer([&]() {
+      for (size_t i = 0; i < num_tokens; i += 1) {
+        pace();
+        std::lock_guard<std::mutex> lock(polled_mutex);
+        sent_at[i] = clock::now();
+        polled_queue.push(std::string("tok"));
+      }
+    });
+    for (size_t i = 0; i < num_tokens; ) {
+      bool got_token = false;
+      {
+        std::lock_guard<std::mutex> lock(polled_mutex);
+        while (polled_queue.size() > 0) {
+          polled_queue.pop();
+          latencies_us[i] = std::chrono::duration<double, std::micro>(clock::now() - sent_at[i]).count();
+          i += 1;
+          got_token = true;
+        }
+      }
+      if (!got_token) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+    }
+    producer.join();
+    bench_print_latency("polled std::queue", bench_summarize_us(latencies_us));
+  }
+
+  {
+    auto channel = std::make_unique<SpscChannel<LlmToken, 1024>>();
+    std::thread producer([&]() {
+      LlmToken token;
+      memcpy(token.bytes, "tok", 3);
+      token.size = 3;
+      for (size_t i = 0; i < num_tokens; i += 1) {
+        pace();
+        sent_at[i] = clock::now();
+        channel->push(token);
+      }
+      channel->close();
+    });
+    LlmToken token;
+    size_t i = 0;
+    while (channel->pop(token)) {
+      latencies_us[i] = std::chrono::duration<double, std::micro>(clock::now() - sent_at[i]).count();
+      i += 1;
+    }
+    producer.join();
+    bench_print_latency("SpscChannel      ", bench_summarize_us(latencies_us));
+  }
+
+  return 0;
+}
+
+// Synthetic vocabulary: short ASCII pieces (half of them with a leading space, like
+// SentencePiece's "▁word") followed by the 256 byte-fallback pieces.
+std::vector<std::string> bench_vocab_pieces(std::mt19937& gen) {
+  std::vector<std::string> pieces;
+  std::uniform_int_distribution<int> letter('a', 'z');
+  std::uniform_int_distribution<int> length(1, 9);
+  for (int i = 0; i < 32000; i += 1) {
+    std::string piece = (i % 2 == 0) ? " " : "";
+    for (int n = length(gen); n > 0; n -= 1) {
+      piece += static_cast<char>(letter(gen));
+    }
+    pieces.push_back(piece);
+  }
+  for (int b = 0; b < 256; b += 1) {
+    pieces.push_back(std::string(1, static_cast<char>(b)));
+  }
+  return pieces;
+}
+
+// Replays a token stream through the stream_token decode + handoff path, with the
+// control thread draining the channel, and reports time and allocations per token on
+// the producing (LLM) thread:
+// - "tokenizer Decode": the original path, a std::vector<int>{token} through the
+//   tokenizer's Decode into a std::string, queued as an optional<string>. The tokenizer
+//   only comes with a loaded model, so this needs GEMMA_MODEL_SBS_FILE and
+//   GEMMA_TOKENIZER_SPM_FILE; the tokens are then English text encoded by it.
+// - "IncrementalDetokenizer": the path stream_token takes now, through the model's token
+//   byte table, or through a synthetic vocabulary without model files.
+// Allocations are only counted in bench builds (MIRROR_GAZE_BENCH_ALLOCATIONS).
+int bench_detokenize(size_t num_tokens) {
+  const char* weights = std::getenv("GEMMA_MODEL_SBS_FILE");
+  const char* tokenizer = std::getenv("GEMMA_TOKENIZER_SPM_FILE");
+  std::unique_ptr<hwy::ThreadPool> pool;
+  std::unique_ptr<gcpp::Gemma> model;
+  TokenByteTable table;
+  std::vector<int> tokens;
+  if (weights != nullptr && tokenizer != nullptr) {
+    std::string file_name = std::filesystem::path(weights).filename().string();
+    std::vector<char*> args = {
+      (char*)"mirror-gaze",
+      (char*)"--tokenizer", (char*)tokenizer,
+      (char*)"--weights", (char*)weights,
+      (char*)"--model", (char*)model_from_file_name(file_name),
+    };
+    gcpp::LoaderArgs loader(args.size(), args.data());
+    if (const char* error = loader.Validate()) {
+      std::cout << "Invalid args: " << error << std::endl;
+      return 1;
+    }
+    pool = std::make_unique<hwy::ThreadPool>(1);
+    model = std::make_unique<gcpp::Gemma>(loader.tokenizer, loader.weights, loader.ModelType(), *pool);
+    gcpp::load_token_byte_table(loader, *model, table);
+    // Prose with the multi-byte characters that byte-fallback pieces spell out.
+    std::vector<int> text_tokens;
+    HWY_ASSERT(model->Tokenizer()->Encode(
+        "I keep a small notebook by the bed. Last week I wrote about the caf\xc3\xa9 near "
+        "work, the \xe2\x82\xac" "4 coffee, and how na\xc3\xafve I felt asking for help \xf0\x9f\x98\x85. "
+        "Today I want to plan the next three steps: call my sister, tidy the desk, and rest.\n",
+        &text_tokens));
+    while (tokens.size() < num_tokens) {
+      tokens.insert(tokens.end(), text_tokens.begin(), text_tokens.end());
+    }
+    tokens.resize(num_tokens);
+    std::cout << "Tokens from the tokenizer in " << tokenizer << std::endl;
+  } else {
+    std::mt19937 gen(42);
+    const std::vector<std::string> pieces = bench_vocab_pieces(gen);
+    const int byte_base = static_cast<int>(pieces.size()) - 256;
+    table.Assign(pieces);
+    // 1 in 10 "tokens" is a euro sign spelled as three byte-fallback pieces.
+    std::uniform_int_distribution<int> word(0, byte_base - 1);
+    while (tokens.size() < num_tokens) {
+      if (tokens.size() % 10 == 9) {
+        tokens.push_back(byte_base + 0xE2);
+        tokens.push_back(byte_base + 0x82);
+        tokens.push_back(byte_base + 0xAC);
+      } else {
+        tokens.push_back(word(gen));
+      }
+    }
+    std::cout << "Synthetic vocabulary; set GEMMA_MODEL_SBS_FILE and GEMMA_TOKENIZER_SPM_FILE "
+                 "to time the original tokenizer Decode path too" << std::endl;
+  }
+
+  auto report = [&](const char* name, double seconds, size_t allocations) {
+    std::cout << name << ": " << 1e9 * seconds / tokens.size() << " ns/token";
+    if (kBenchCountsAllocations) {
+      std::cout << ", " << static_cast<double>(allocations) / tokens.size() << " allocations/token";
+    }
+    std::cout << std::endl;
+  };
+  if (!kBenchCountsAllocations) {
+    std::cout << "(allocations are only counted by bench builds: python build.py bench-build)" << std::endl;
+  }
+
+  if (model != nullptr) {
+    const gcpp::GemmaTokenizer* gemma_tokenizer = model->Tokenizer();
+    auto channel = std::make_unique<SpscChannel<std::optional<std::string>, 1024>>();
+    std::thread consumer([&]() {
+      std::optional<std::string> text;
+      while (channel->pop(text)) {
+      }
+    });
+    const size_t allocations_before = bench_allocations();
+    const auto start = std::chrono::steady_clock::now();
+    for (int token : tokens) {
+      std::string token_text;
+      HWY_ASSERT(gemma_tokenizer->Decode(std::vector<int>{token}, &token_text));
+      channel->push(token_text);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report("tokenizer Decode      ", seconds, bench_allocations() - allocations_before);
+    channel->close();
+    consumer.join();
+  }
+
+  {
+    auto channel = std::make_unique<SpscChannel<LlmToken, 1024>>();
+    std::thread consumer([&]() {
+      LlmToken token;
+      while (channel->pop(token)) {
+      }
+    });
+    IncrementalDetokenizer detokenizer(table, model != nullptr ? model->Tokenizer() : nullptr);
+    size_t bytes_out = 0;
+    const size_t allocations_before = bench_allocations();
+    const auto start = std::chrono::steady_clock::now();
+    for (int token : tokens) {
+      const std::string_view text = detokenizer.Push(token);
+      if (text.size() > 0) {
+        LlmToken out;
+        memcpy(out.bytes, text.data(), std::min(text.size(), LlmToken::kMaxBytes));
+        out.size = static_cast<uint8_t>(std::min(text.size(), LlmToken::kMaxBytes));
+        channel->push(out);
+        bytes_out += out.size;
+      }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report("IncrementalDetokenizer", seconds, bench_allocations() - allocations_before);
+    channel->close();
+    consumer.join();
+    std::cout << "(" << bytes_out << " bytes of complete UTF-8 emitted)" << std::endl;
+  }
+  return 0;
+}
+
+// Constrained decoding with the tasker's three-step grammar over a synthetic vocabulary
+// the size of Gemma's: mask building with WalkTokens against one token at a time, and
+// the per-step cost the sampler sees (accept_token on a candidate set, then Advance,
+// including the masks built the first time a state is reached).
+int bench_grammar(size_t decode_steps) {
+  std::mt19937 gen(42);
+  const char* alphabet = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJ0123456789 .,:;-\n";
+  std::uniform_int_distribution<size_t> letter(0, strlen(alphabet) - 1);
+  std::uniform_int_distribution<int> length(1, 12);
+  std::vector<std::string> pieces;
+  while (pieces.size() + 256 < 256000) {
+    std::string piece = (pieces.size() % 2 == 0) ? " " : "";
+    const int n = pieces.size() % 500 == 0 ? 24 : length(gen); // a few longer than kPlanes
+    for (int i = 0; i < n; i += 1) {
+      piece += alphabet[letter(gen)];
+    }
+    pieces.push_back(piece);
+  }
+  for (int b = 0; b < 256; b += 1) {
+    pieces.push_back(std::string(1, static_cast<char>(b)));
+  }
+  TokenByteTable table;
+  table.Assign(pieces);
+
+  auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+  auto start = std::chrono::steady_clock::now();
+  const GrammarVocabulary vocab(table, gcpp::EOS_ID); // no separate end-of-turn token
+  std::cout << "vocabulary layout: " << 1e3 * seconds_since(start) << " ms for "
+            << vocab.vocab_size() << " tokens" << std::endl;
+  TokenGrammar grammar(vocab);
+  std::string error;
+  start = std::chrono::steady_clock::now();
+  if (!grammar.Compile(kThreeStepsGrammar, error)) {
+    std::cout << "Grammar does not compile: " << error << std::endl;
+    return 1;
+  }
+  std::cout << "compile: " << 1e3 * seconds_since(start) << " ms, " << grammar.states()
+            << " DFA states" << std::endl;
+
+  // Every state's mask, both ways; they have to agree.
+  start = std::chrono::steady_clock::now();
+  for (size_t state = 1; state < grammar.states(); state += 1) {
+    grammar.Mask(static_cast<int>(state));
+  }
+  const double walk_seconds = seconds_since(start);
+  std::vector<uint64_t> scalar(vocab.words());
+  size_t mismatches = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t state = 1; state < grammar.states(); state += 1) {
+    std::fill(scalar.begin(), scalar.end(), 0);
+    for (size_t token = 0; token < vocab.vocab_size(); token += 1) {
+      const std::string_view piece = table.Piece(static_cast<int>(token));
+      if (piece.size() > 0 && grammar.Next(static_cast<int>(state), piece) != 0) {
+        scalar[token >> 6] |= uint64_t{1} << (token & 63);
+      }
+    }
+    if (grammar.accepting(static_cast<int>(state))) {
+      scalar[gcpp::EOS_ID >> 6] |= uint64_t{1} << (gcpp::EOS_ID & 63);
+      scalar[vocab.end_of_turn() >> 6] |= uint64_t{1} << (vocab.end_of_turn() & 63);
+    }
+    const uint64_t* mask = grammar.Mask(static_cast<int>(state));
+    mismatches += memcmp(mask, scalar.data(), vocab.words() * sizeof(uint64_t)) != 0 ? 1 : 0;
+  }
+  const double scalar_seconds = seconds_since(start);
+  const size_t states = grammar.states() - 1;
+  std::cout << "mask build, WalkTokens:        " << 1e3 * walk_seconds / states << " ms / state" << std::endl;
+  std::cout << "mask build, one token at a time: " << 1e3 * scalar_seconds / states << " ms / state ("
+            << mismatches << " masks differ)" << std::endl;
+
+  // Decoding: each step asks accept_token about 1024 candidates (about what top-k
+  // selection over a peaked distribution does) and takes a random allowed one.
+  TokenGrammarCache grammars(table, gcpp::EOS_ID);
+  std::uniform_int_distribution<int> any_token(0, static_cast<int>(vocab.vocab_size()) - 1);
+  std::vector<int> candidates(1024);
+  size_t steps = 0;
+  size_t responses = 0;
+  size_t accepted = 0;
+  start = std::chrono::steady_clock::now();
+  while (steps < decode_steps) {
+    GrammarCursor cursor;
+    cursor.Begin(grammars.Get(kThreeStepsGrammar));
+    responses += 1;
+    for (size_t step = 0; step < 256 && steps < decode_steps && !cursor.finished(); step += 1) {
+      for (int& candidate : candidates) {
+        candidate = any_token(gen);
+      }
+      candidates[0] = table.vocab_size() - 256 + '\n'; // so lines end now and then
+      candidates[1] = table.vocab_size() - 256 + '1' + static_cast<int>(step % 3);
+      candidates[2] = table.vocab_size() - 256 + '.';
+      int chosen = -1;
+      for (int candidate : candidates) {
+        if (cursor.Allows(candidate)) {
+          accepted += 1;
+          chosen = chosen < 0 || candidate == candidates[0] ? candidate : chosen;
+        }
+      }
+      if (chosen < 0 || chosen == gcpp::EOS_ID) {
+        break;
+      }
+      cursor.Advance(table.Piece(chosen));
+      steps += 1;
+    }
+  }
+  const double decode_seconds = seconds_since(start);
+  std::cout << "decode: " << 1e6 * decode_seconds / std::max<size_t>(steps, 1) << " us / step over "
+            << steps << " steps in " << responses << " responses, "
+            << 1e9 * decode_seconds / std::max<size_t>(steps * candidates.size(), 1)
+            << " ns / accept_token (" << 100.0 * accepted / std::max<size_t>(steps * candidates.size(), 1)
+            << "% of candidates allowed)" << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
+
+// ns per sampled token across vocabulary sizes: a full softmax and sort of the whole
+// vocabulary (then top-p) against Sampler with a few settings, on logits shaped like a
+// language model's (a broad bulk plus a handful of likely tokens).
+int bench_sampler(size_t num_tokens) {
+  std::mt19937 gen(42);
+  const gcpp::AcceptFunc accept_all = [](int) { return true; };
+  for (size_t vocab_size : {32000, 128000, 256000}) {
+    std::vector<std::vector<float>> logit_sets(16, std::vector<float>(vocab_size));
+    std::normal_distribution<float> bulk(0.0f, 2.5f);
+    std::uniform_int_distribution<size_t> any_token(0, vocab_size - 1);
+    for (std::vector<float>& logits : logit_sets) {
+      for (float& logit : logits) {
+        logit = bulk(gen);
+      }
+      for (int i = 0; i < 20; i += 1) {
+        logits[any_token(gen)] = 10.0f + i * 0.25f;
+      }
+    }
+    std::vector<float> logits(vocab_size);
+    std::cout << "vocab " << vocab_size << ":" << std::endl;
+
+    auto time_per_token = [&](const std::function<int(float*)>& sample) {
+      double seconds = 0;
+      size_t checksum = 0;
+      for (size_t i = 0; i < num_tokens; i += 1) {
+        logits = logit_sets[i % logit_sets.size()];
+        const auto start = std::chrono::steady_clock::now();
+        checksum += static_cast<size_t>(sample(logits.data()));
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      }
+      return std::make_pair(1e9 * seconds / num_tokens, checksum);
+    };
+
+    std::vector<int32_t> order(vocab_size);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    const auto full = time_per_token([&](float* l) {
+      const float max_logit = *std::max_element(l, l + vocab_size);
+      double total = 0;
+      for (size_t t = 0; t < vocab_size; t += 1) {
+        l[t] = std::exp(l[t] - max_logit);
+        total += l[t];
+      }
+      std::iota(order.begin(), order.end(), 0);
+      std::sort(order.begin(), order.end(), [l](int32_t a, int32_t b) { return l[a] > l[b]; });
+      double cumulative = 0;
+      size_t nucleus = 0;
+      while (nucleus < vocab_size && cumulative < 0.95 * total) {
+        cumulative += l[order[nucleus]];
+        nucleus += 1;
+      }
+      double u = uniform(gen) * cumulative;
+      for (size_t i = 0; i < nucleus; i += 1) {
+        u -= l[order[i]];
+        if (u < 0) {
+          return order[i];
+        }
+      }
+      return order[0];
+    });
+    std::cout << "  full softmax + sort, top_p 0.95: " << full.first << " ns / token" << std::endl;
+
+    struct Setting {
+      const char* name;
+      std::vector<const char*> args;
+    };
+    const Setting settings[] = {
+      {"temperature 1", {}},
+      {"top_k 40", {"--top_k", "40"}},
+      {"top_p 0.95", {"--top_p", "0.95"}},
+      {"min_p 0.1, repetition_penalty 1.1", {"--min_p", "0.1", "--repetition_penalty", "1.1"}},
+    };
+    for (const Setting& setting : settings) {
+      std::vector<char*> argv = {const_cast<char*>("bench")};
+      for (const char* arg : setting.args) {
+        argv.push_back(const_cast<char*>(arg));
+      }
+      const SamplerArgs args(static_cast<int>(argv.size()), argv.data());
+      Sampler sampler(args);
+      sampler.BeginResponse(42);
+      const auto result = time_per_token([&](float* l) {
+        return sampler.Sample(l, vocab_size, 1.0f, accept_all);
+      });
+      std::cout << "  Sampler, " << setting.name << ": " << result.first << " ns / token" << std::endl;
+    }
+  }
+  return 0;
+}
+
+// Synthetic responses in the style the model produces (bold, italics, bullets, wrapped
+// in quotes, runs of blank lines), split into token-sized chunks at random boundaries
+// so markup regularly straddles two tokens.
+std::vector<std::vector<std::string>> bench_token_streams(size_t num_responses, std::mt19937& gen) {
+  const char* sentences[] = {
+    "**Step 1:** Find a quiet place to *focus* on the task. ",
+    "It's okay to feel overwhelmed sometimes. ",
+    "* Write down your three most important goals.\n",
+    "\n\n\nThen, **celebrate** each small win!   \n",
+    "What is one thing you could do *today* to move forward? ",
+  };
+  std::uniform_int_distribution<size_t> which(0, 4);
+  std::uniform_int_distribution<size_t> length(1, 8);
+  std::vector<std::vector<std::string>> streams;
+  for (size_t r = 0; r < num_responses; r += 1) {
+    std::string text = "\"";
+    for (int i = 0; i < 12; i += 1) {
+      text += sentences[which(gen)];
+    }
+    text += "\"\n";
+    std::vector<std::string> tokens;
+    for (size_t pos = 0; pos < text.size(); ) {
+      const size_t n = std::min(length(gen), text.size() - pos);
+      tokens.push_back(text.substr(pos, n));
+      pos += n;
+    }
+    streams.push_back(tokens);
+  }
+  return streams;
+}
+
+// Throughput of the response filters over replayed token streams. "per-token find/erase"
+// is the original clean-up from prompt_llm_and_return_value ("**" removed per token,
+// leading quote of the first token); stray '*' left in the output are counted for both.
+int bench_filter(size_t num_responses) {
+  std::mt19937 gen(42);
+  const auto streams = bench_token_streams(num_responses, gen);
+  size_t num_tokens = 0;
+  size_t num_bytes = 0;
+  for (const auto& tokens : streams) {
+    num_tokens += tokens.size();
+    for (const auto& token : tokens) {
+      num_bytes += token.size();
+    }
+  }
+
+  auto report = [&](const char* name, double seconds, size_t stray_stars) {
+    std::cout << name << ": " << 1e9 * seconds / num_tokens << " ns/token, "
+              << num_bytes / seconds / (1024 * 1024) << " MiB/s, "
+              << stray_stars << " stray '*' in output" << std::endl;
+  };
+  auto count_stars = [](const std::string& s) {
+    size_t stars = 0;
+    for (size_t i = 0; i < s.size(); i += 1) {
+      // a '*' with whitespace on both sides is a bullet, not emphasis
+      const bool spaced = (i == 0 || isspace(s[i - 1])) && i + 1 < s.size() && isspace(s[i + 1]);
+      stars += s[i] == '*' && !spaced ? 1 : 0;
+    }
+    return stars;
+  };
+
+  {
+    size_t stray_stars = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto& tokens : streams) {
+      std::stringstream ss;
+      bool seen_first_token = false;
+      for (const auto& token : tokens) {
+        std::string val = token;
+        if (!seen_first_token) {
+          if (val.size() > 0 && val[0] == '"') {
+            val.erase(0, 1);
+          }
+          seen_first_token = true;
+        }
+        auto next_star_pos = val.find("**");
+        while (next_star_pos != std::string::npos) {
+          val.erase(next_star_pos, 2);
+          next_star_pos = val.find("**");
+        }
+        ss << val;
+      }
+      stray_stars += count_stars(ss.str());
+    }
+    report("per-token find/erase", std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count(), stray_stars);
+  }
+
+  {
+    OutputFilter filter = OutputFilter::Default();
+    size_t stray_stars = 0;
+    std::string response;
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto& tokens : streams) {
+      response.clear();
+      for (const auto& token : tokens) {
+        const std::string_view out = filter.Push(token);
+        response.append(out.data(), out.size());
+      }
+      const std::string_view out = filter.Finish();
+      response.append(out.data(), out.size());
+      stray_stars += count_stars(response);
+    }
+    report("OutputFilter        ", std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count(), stray_stars);
+  }
+  return 0;
+}
+
+// write() calls per token when streaming replayed responses to /dev/null at a fixed token
+// rate: the original cout-and-flush per token, against TerminalRenderer frames.
+int bench_render(size_t num_responses, int token_interval_us) {
+  std::mt19937 gen(42);
+  const auto streams = bench_token_streams(num_responses, gen);
+  const int fd = open("/dev/null", O_WRONLY);
+  if (fd < 0) {
+    std::cout << "Cannot open /dev/null" << std::endl;
+    return 1;
+  }
+  size_t num_tokens = 0;
+  size_t flush_writes = 0;
+  for (const auto& tokens : streams) {
+    for (const auto& token : tokens) {
+      flush_writes += write(fd, token.data(), token.size()) >= 0 ? 1 : 0;
+      num_tokens += 1;
+    }
+  }
+
+  TerminalRenderer renderer(fd, /*fixed_width=*/80);
+  double layout_seconds = 0;
+  for (const auto& tokens : streams) {
+    renderer.Begin();
+    for (const auto& token : tokens) {
+      std::this_thread::sleep_for(std::chrono::microseconds(token_interval_us));
+      const auto start = std::chrono::steady_clock::now();
+      renderer.Write(token);
+      renderer.MaybeFlush();
+      layout_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    renderer.Write("\n\n");
+    renderer.Flush();
+  }
+  close(fd);
+
+  std::cout << "cout << token << flush: " << static_cast<double>(flush_writes) / num_tokens
+            << " writes/token" << std::endl;
+  std::cout << "TerminalRenderer      : " << static_cast<double>(renderer.writes()) / num_tokens
+            << " writes/token, " << 1e9 * layout_seconds / num_tokens << " ns/token" << std::endl;
+  return 0;
+}
+
+// Load test for 'mirror-gaze daemon'. For 1, 2, 4 ... max_sessions concurrent sessions,
+// every session sends its prompts back to back; time to first token is measured from
+// sending a prompt to receiving the first text of its response.
+int bench_daemon(size_t max_sessions, size_t prompts_per_session) {
+#if defined(_WIN32)
+  std::cout << "'bench daemon' needs Unix sockets" << std::endl;
+  return 1;
+#else
+  const char* prompts[] = {
+    "Briefly greet me and ask what I want to accomplish.",
+    "I want to learn to cook. Identify three steps to accomplish this.",
+    "Tell me where and how I can accomplish step one.",
+    "Energetically say goodbye and wish me success!",
+  };
+  std::vector<char*> session_args = {
+    (char*)"mirror-gaze", (char*)"--multiturn", (char*)"0",
+    (char*)"--max_generated_tokens", (char*)"64",
+  };
+
+  for (size_t num_sessions = 1; num_sessions <= max_sessions; num_sessions *= 2) {
+    std::vector<std::vector<double>> ttft_us(num_sessions);
+    std::vector<size_t> text_messages(num_sessions, 0);
+    std::atomic<size_t> failed_sessions{0};
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (size_t s = 0; s < num_sessions; s += 1) {
+      clients.emplace_back([&, s]() {
+        const int fd = daemon_open_session(session_args);
+        if (fd < 0) {
+          failed_sessions += 1;
+          return;
+        }
+        uint8_t type = 0;
+        std::string payload;
+        for (size_t p = 0; p < prompts_per_session; p += 1) {
+          LlmPrompt prompt;
+          prompt.text = prompts[(s + p) % 4];
+          const auto sent_at = std::chrono::steady_clock::now();
+          if (!daemon_send(fd, kDaemonPrompt, daemon_encode_prompt(prompt))) {
+            failed_sessions += 1;
+            break;
+          }
+          bool first = true;
+          bool ok = true;
+          while ((ok = daemon_recv(fd, type, payload)) && type != kDaemonEnd) {
+            if (type == kDaemonText && first) {
+              ttft_us[s].push_back(std::chrono::duration<double, std::micro>(
+                  std::chrono::steady_clock::now() - sent_at).count());
+              first = false;
+            }
+            text_messages[s] += type == kDaemonText ? 1 : 0;
+          }
+          if (!ok) {
+            failed_sessions += 1;
+            break;
+          }
+        }
+        close(fd);
+      });
+    }
+    for (std::thread& client : clients) {
+      client.join();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (failed_sessions > 0) {
+      std::cout << failed_sessions << " of " << num_sessions << " sessions failed; is 'mirror-gaze daemon' "
+                << "listening on " << daemon_socket_path() << "?" << std::endl;
+      return 1;
+    }
+
+    std::vector<double> all_ttft_us;
+    size_t all_text_messages = 0;
+    for (size_t s = 0; s < num_sessions; s += 1) {
+      all_ttft_us.insert(all_ttft_us.end(), ttft_us[s].begin(), ttft_us[s].end());
+      all_text_messages += text_messages[s];
+    }
+    const BenchLatencyStats stats = bench_summarize_us(all_ttft_us);
+    std::cout << num_sessions << " sessions: time to first token p50 " << stats.p50_us / 1000
+              << " ms, p99 " << stats.p99_us / 1000 << " ms; "
+              << all_text_messages / seconds << " tokens/sec over all sessions" << std::endl;
+  }
+  return 0;
+#endif // Windows
+}
+
+struct GenerationSpeed {
+  double prefill_tok_sec = 0;
+  double decode_tok_sec = 0;
+};
+
+// Runs prompt from position 0 and decodes `tokens` more (EOS is refused), timed from
+// the stream so the numbers don't depend on gemma's verbosity.
+GenerationSpeed measure_generation_speed(gcpp::Gemma& model, const std::vector<int>& prompt,
+                                         gcpp::KVCache& kv_cache, hwy::ThreadPool& pool, size_t tokens) {
+  std::mt19937 gen(42);
+  size_t streamed = 0;
+  const auto start = std::chrono::steady_clock::now();
+  auto first_token = start;
+  auto last_token = start;
+  gcpp::RuntimeConfig runtime_config = {
+      .max_tokens = prompt.size() + tokens + 1,
+      .max_generated_tokens = tokens,
+      .temperature = 1.0f,
+      .verbosity = 0,
+      .gen = &gen,
+      .stream_token = [&](int, float) {
+        streamed += 1;
+        if (streamed == prompt.size() + 1) {
+          first_token = std::chrono::steady_clock::now();
+        }
+        last_token = std::chrono::steady_clock::now();
+        return true;
+      },
+      .accept_token = [](int token) { return token != gcpp::EOS_ID; },
+  };
+  gcpp::TimingInfo timing_info;
+  GenerateGemma(model, runtime_config, prompt, /*start_pos=*/0, kv_cache, pool, timing_info);
+  const size_t generated = streamed > prompt.size() ? streamed - prompt.size() : 0;
+  const double prefill_seconds = std::chrono::duration<double>(first_token - start).count();
+  const double decode_seconds = std::chrono::duration<double>(last_token - first_token).count();
+  GenerationSpeed speed;
+  speed.prefill_tok_sec = generated > 0 ? prompt.size() / prefill_seconds : 0.0;
+  speed.decode_tok_sec = generated > 1 ? (generated - 1) / decode_seconds : 0.0;
+  return speed;
+}
+
+std::vector<int> generation_speed_prompt(gcpp::Gemma& model) {
+  std::vector<int> prompt;
+  HWY_ASSERT(model.Tokenizer()->Encode(
+      "<start_of_turn>user\nWrite a long story about a lighthouse keeper.<end_of_turn>\n"
+      "<start_of_turn>model\n", &prompt));
+  prompt.insert(prompt.begin(), kGemmaBosId);
+  return prompt;
+}
+
+// Decode speed for a range of num_threads, each pool placed by place_threads(). The
+// fastest is cached for this machine and weights file, and used by later launches that
+// don't pass --num_threads.
+int bench_threads(size_t decode_tokens) {
+  const char* weights = std::getenv("GEMMA_MODEL_SBS_FILE");
+  const char* tokenizer = std::getenv("GEMMA_TOKENIZER_SPM_FILE");
+  if (weights == nullptr || tokenizer == nullptr) {
+    std::cout << "Set GEMMA_MODEL_SBS_FILE and GEMMA_TOKENIZER_SPM_FILE" << std::endl;
+    return 1;
+  }
+  std::string file_name = std::filesystem::path(weights).filename().string();
+  std::vector<char*> args = {
+    (char*)"mirror-gaze",
+    (char*)"--tokenizer", (char*)tokenizer,
+    (char*)"--weights", (char*)weights,
+    (char*)"--model", (char*)model_from_file_name(file_name),
+  };
+  gcpp::LoaderArgs loader(args.size(), args.data());
+  gcpp::InferenceArgs inference(args.size(), args.data());
+  if (const char* error = loader.Validate()) {
+    std::cout << "Invalid args: " << error << std::endl;
+    return 1;
+  }
+
+  const CpuTopology topology = read_cpu_topology();
+  std::cout << topology.cpus.size() << " CPUs, " << topology.cores.size() << " physical cores, "
+            << topology.home_node_cores << " on node " << topology.home_node << std::endl;
+
+  // Powers of two, and the sizes the placement treats differently: one node's physical
+  // cores (with and without one left for control), all physical cores, all CPUs.
+  std::vector<size_t> candidates;
+  for (size_t n = 1; n < topology.cores.size(); n *= 2) {
+    candidates.push_back(n);
+  }
+  for (size_t n : {topology.home_node_cores - 1, topology.home_node_cores, topology.cores.size(),
+                   topology.cpus.size()}) {
+    candidates.push_back(n);
+  }
+  candidates.erase(std::remove(candidates.begin(), candidates.end(), size_t(0)), candidates.end());
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+  std::unique_ptr<gcpp::Gemma> model;
+  {
+    hwy::ThreadPool load_pool(candidates.back());
+    model = std::make_unique<gcpp::Gemma>(loader.tokenizer, loader.weights, loader.ModelType(), load_pool);
+  }
+  const std::vector<int> prompt = generation_speed_prompt(*model);
+  gcpp::KVCache kv_cache = CreateReleasableKVCache(loader.ModelType());
+
+  size_t best = 0;
+  double best_tok_sec = 0;
+  for (size_t num_threads : candidates) {
+    hwy::ThreadPool pool(num_threads);
+    place_threads(pool, topology, /*verbosity=*/0);
+    // Warm-up: faults the pages this placement touches in.
+    measure_generation_speed(*model, prompt, kv_cache, pool, 4);
+    double tok_sec = 0;
+    double prefill_tok_sec = 0;
+    for (int run = 0; run < 2; run += 1) {
+      const GenerationSpeed speed = measure_generation_speed(*model, prompt, kv_cache, pool, decode_tokens);
+      prefill_tok_sec = std::max(prefill_tok_sec, speed.prefill_tok_sec);
+      tok_sec = std::max(tok_sec, speed.decode_tok_sec);
+    }
+    std::cout << std::setw(4) << num_threads << " threads: " << tok_sec << " decode tok/s, "
+              << prefill_tok_sec << " prefill tok/s ("
+              << plan_thread_placement(topology, num_threads).Describe() << ")" << std::endl;
+    if (tok_sec > best_tok_sec) {
+      best = num_threads;
+      best_tok_sec = tok_sec;
+    }
+  }
+  if (best < 1) {
+    std::cout << "No run decoded any tokens" << std::endl;
+    return 1;
+  }
+  save_tuned_num_threads(topology, loader.weights.path, best);
+  std::cout << "Best: " << best << " threads, saved to "
+            << tuned_num_threads_path(topology, loader.weights.path) << std::endl;
+  return 0;
+}
+
+// Whether other generations on the session's thread (summaries, prefix and typing
+// prefills, a second model) leave what the session samples alone (see SessionSamplerScope).
+// Every prompt is generated twice from the same seed: alone, and with a one-token
+// generation on a second KV cache, with its own generator, inside each stream_token. The
+// tokens have to come out the same both times, or this exits with 1.
+int bench_isolation(size_t decode_tokens) {
+#if !defined(GEMMA_SAMPLE_TOKEN_HOOK)
+  std::cout << "'bench isolation' needs the sample_token_hook build.py patches into gemma.cpp" << std::endl;
+  return 1;
+#else
+  const char* weights = std::getenv("GEMMA_MODEL_SBS_FILE");
+  const char* tokenizer = std::getenv("GEMMA_TOKENIZER_SPM_FILE");
+  if (weights == nullptr || tokenizer == nullptr) {
+    std::cout << "Set GEMMA_MODEL_SBS_FILE and GEMMA_TOKENIZER_SPM_FILE" << std::endl;
+    return 1;
+  }
+  std::string file_name = std::filesystem::path(weights).filename().string();
+  std::vector<char*> args = {
+    (char*)"mirror-gaze",
+    (char*)"--tokenizer", (char*)tokenizer,
+    (char*)"--weights", (char*)weights,
+    (char*)"--model", (char*)model_from_file_name(file_name),
+  };
+  gcpp::LoaderArgs loader(args.size(), args.data());
+  gcpp::InferenceArgs inference(args.size(), args.data());
+  gcpp::AppArgs app(args.size(), args.data());
+  const SamplerArgs sampler_args(args.size(), args.data());
+  if (const char* error = loader.Validate()) {
+    std::cout << "Invalid args: " << error << std::endl;
+    return 1;
+  }
+
+  const CpuTopology topology = read_cpu_topology();
+  hwy::ThreadPool pool(tuned_num_threads(topology, loader.weights.path, app.num_threads));
+  place_threads(pool, topology, /*verbosity=*/0);
+  gcpp::Gemma model(loader.tokenizer, loader.weights, loader.ModelType(), pool);
+  gcpp::KVCache kv_cache = CreateReleasableKVCache(loader.ModelType());
+  gcpp::KVCache side_kv_cache = CreateReleasableKVCache(loader.ModelType());
+
+  std::vector<int> side_prompt;
+  HWY_ASSERT(model.Tokenizer()->Encode("Summarize the conversation so far.", &side_prompt));
+  side_prompt.insert(side_prompt.begin(), kGemmaBosId);
+  std::mt19937 side_gen(7);
+  size_t side_generations = 0;
+  // One sampled token, the way a summary or a prefill runs between the session's steps.
+  auto generate_on_the_side = [&]() {
+    gcpp::RuntimeConfig runtime_config = {
+        .max_tokens = side_prompt.size() + 2,
+        .max_generated_tokens = 1,
+        .temperature = inference.temperature,
+        .verbosity = 0,
+        .gen = &side_gen,
+        .stream_token = [](int, float) { return true; },
+        .accept_token = [](int) { return true; },
+    };
+    gcpp::TimingInfo timing_info;
+    GenerateGemma(model, runtime_config, side_prompt, /*start_pos=*/0, side_kv_cache, pool, timing_info);
+    side_generations += 1;
+  };
+
+  // Generates decode_tokens tokens (EOS is refused) for prompt, seeded the way a
+  // --deterministic ReplGemma is.
+  auto generate = [&](const std::vector<int>& prompt, bool with_side, std::vector<int>& tokens) {
+    std::mt19937 gen(42);
+    Sampler sampler(sampler_args);
+    SessionSamplerScope sampler_scope(sampler, gen);
+    sampler.BeginResponse((static_cast<uint64_t>(gen()) << 32) | gen());
+    tokens.clear();
+    size_t pos = 0;
+    gcpp::RuntimeConfig runtime_config = {
+        .max_tokens = prompt.size() + decode_tokens + 1,
+        .max_generated_tokens = decode_tokens,
+        .temperature = inference.temperature,
+        .verbosity = 0,
+        .gen = &gen,
+        .stream_token = [&](int token, float) {
+          pos += 1;
+          if (pos <= prompt.size()) {
+            return true; // prefill
+          }
+          tokens.push_back(token);
+          if (with_side) {
+            generate_on_the_side();
+          }
+          return tokens.size() < decode_tokens;
+        },
+        .accept_token = [](int token) { return token != gcpp::EOS_ID; },
+    };
+    gcpp::TimingInfo timing_info;
+    GenerateGemma(model, runtime_config, prompt, /*start_pos=*/0, kv_cache, pool, timing_info);
+  };
+
+  const char* prompts[] = {
+    "I can't sleep because I keep thinking about work.",
+    "Help me plan a week of cheap vegetarian dinners.",
+    "Explain to a ten year old why the sky is blue.",
+  };
+  bool identical = true;
+  for (const char* text : prompts) {
+    std::vector<int> prompt;
+    HWY_ASSERT(model.Tokenizer()->Encode(
+        std::string("<start_of_turn>user\n") + text + "<end_of_turn>\n<start_of_turn>model\n", &prompt));
+    prompt.insert(prompt.begin(), kGemmaBosId);
+    std::vector<int> alone;
+    std::vector<int> with_side;
+    generate(prompt, /*with_side=*/false, alone);
+    generate(prompt, /*with_side=*/true, with_side);
+    const auto mismatch = std::mismatch(alone.begin(), alone.end(), with_side.begin(), with_side.end());
+    if (mismatch.first != alone.end() || mismatch.second != with_side.end()) {
+      std::cout << "  \"" << text << "\": the tokens differ with generations on the side, from token "
+                << mismatch.first - alone.begin() << " on" << std::endl;
+      identical = false;
+      continue;
+    }
+    std::cout << "  \"" << text << "\": " << alone.size() << " tokens identical" << std::endl;
+  }
+  if (!identical) {
+    return 1;
+  }
+  std::cout << "Session tokens identical with and without " << side_generations
+            << " generations on the side" << std::endl;
+  return 0;
+#endif // GEMMA_SAMPLE_TOKEN_HOOK
+}
+
+// Control-side throughput: replays a MIRROR_GAZE_RECORD recording at full speed through
+// prompt_llm_and_return_value (filtering, wrapping, rendering to /dev/null).
+int bench_replay(const char* recording, size_t passes) {
+#if !defined(__linux__)
+  (void)recording;
+  (void)passes;
+  std::cout << "'bench replay' needs /dev/null" << std::endl;
+  return 1;
+#else
+  std::vector<LlmRecordedEvent> events;
+  if (!read_llm_recording(recording, events)) {
+    std::cout << "Cannot read recording " << recording << std::endl;
+    return 1;
+  }
+  const std::vector<ReplayedResponse> responses = replay_responses(events);
+  size_t chunks = 0;
+  size_t bytes = 0;
+  for (const ReplayedResponse& response : responses) {
+    for (const LlmRecordedEvent& event : response.events) {
+      chunks += 1;
+      bytes += event.payload.size();
+    }
+  }
+  std::cout << responses.size() << " responses, " << chunks << " chunks, " << bytes
+            << " bytes of text per pass" << std::endl;
+
+  std::thread replay_thread([&responses]() {
+    run_replay_backend(responses, /*realtime=*/false, llm_input_queue, llm_output_tokens_queue);
+  });
+  // Rendering goes to /dev/null; the report to the real stdout.
+  std::cout << std::flush;
+  const int saved_stdout = dup(STDOUT_FILENO);
+  const int devnull = ::open("/dev/null", O_WRONLY);
+  if (devnull >= 0) {
+    dup2(devnull, STDOUT_FILENO);
+  }
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t pass = 0; pass < passes; pass += 1) {
+    for (const ReplayedResponse& response : responses) {
+      prompt_llm_and_return_value({response.prompt}, true);
+    }
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << std::flush;
+  dup2(saved_stdout, STDOUT_FILENO);
+  llm_input_queue.push({"%q"});
+  replay_thread.join();
+
+  std::cout << passes * chunks / seconds << " chunks / sec, "
+            << passes * bytes / seconds / 1e6 << " MB / sec of response text, "
+            << 1e9 * seconds / std::max<size_t>(passes * chunks, 1) << " ns / chunk" << std::endl;
+  return 0;
+#endif // Linux
+}
+
+// KV cache memory: snapshot codecs on recorded sessions, and rows given back by KVRowTracker.
+int bench_kvcodec(const std::vector<std::filesystem::path>& files) {
+  struct Rows {
+    std::string name;
+    std::vector<float> keys;
+    std::vector<float> values;
+    size_t floats_per_pos = 0;
+  };
+  std::vector<Rows> inputs;
+  for (const auto& path : files) {
+    Rows rows;
+    rows.name = path.filename().string();
+    if (read_snapshot_kv_rows(path, rows.keys, rows.values, rows.floats_per_pos) &&
+        rows.keys.size() > 0) {
+      inputs.push_back(std::move(rows));
+    }
+  }
+  if (inputs.size() < 1) {
+    // No recorded sessions: 2b-shaped rows with a few large channels, like real keys.
+    Rows rows;
+    rows.name = "synthetic (no snapshots found)";
+    rows.floats_per_pos = kv_cache_layout(gcpp::Model::GEMMA_2B).floats_per_pos;
+    std::mt19937 gen(42);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    rows.keys.resize(512 * rows.floats_per_pos);
+    rows.values.resize(rows.keys.size());
+    for (size_t i = 0; i < rows.keys.size(); i += 1) {
+      rows.keys[i] = normal(gen) * (i % 97 == 0 ? 20.0f : 1.0f);
+      rows.values[i] = normal(gen) * 0.5f;
+    }
+    inputs.push_back(std::move(rows));
+  }
+
+  for (const Rows& rows : inputs) {
+    const size_t tokens = rows.keys.size() / rows.floats_per_pos;
+    std::cout << rows.name << ": " << tokens << " tokens" << std::endl;
+    for (KVCodec codec : {KVCodec::kF32, KVCodec::kBF16, KVCodec::kInt8}) {
+      std::vector<uint8_t> encoded;
+      std::vector<float> decoded(rows.keys.size());
+      double err2 = 0, ref2 = 0, max_abs_err = 0, min_cosine = 1, decode_seconds = 0;
+      for (const std::vector<float>* array : {&rows.keys, &rows.values}) {
+        encoded.resize(kv_encoded_bytes(codec, array->size()));
+        kv_encode(codec, array->data(), array->size(), encoded.data());
+        const auto start = std::chrono::steady_clock::now();
+        kv_decode(codec, encoded.data(), array->size(), decoded.data());
+        decode_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (size_t row = 0; row < tokens; row += 1) {
+          double dot = 0, a2 = 0, b2 = 0;
+          for (size_t i = row * rows.floats_per_pos; i < (row + 1) * rows.floats_per_pos; i += 1) {
+            const double a = (*array)[i];
+            const double b = decoded[i];
+            err2 += (a - b) * (a - b);
+            ref2 += a * a;
+            max_abs_err = std::max(max_abs_err, std::abs(a - b));
+            dot += a * b;
+            a2 += a * a;
+            b2 += b * b;
+          }
+          if (a2 > 0 && b2 > 0) {
+            min_cosine = std::min(min_cosine, dot / std::sqrt(a2 * b2));
+          }
+        }
+      }
+      const size_t bytes_per_token = 2 * kv_encoded_bytes(codec, rows.floats_per_pos);
+      const double gb = 2.0 * rows.keys.size() * sizeof(float) / 1e9;
+      std::cout << "  " << std::setw(4) << kv_codec_name(codec) << ": "
+                << std::setw(7) << bytes_per_token << " bytes/token, decode "
+                << std::setw(6) << std::fixed << std::setprecision(2) << gb / decode_seconds
+                << " GB/s, rms rel err " << std::scientific << std::setprecision(2)
+                << std::sqrt(err2 / std::max(ref2, 1e-30)) << ", max abs err " << max_abs_err
+                << ", min cosine " << std::fixed << std::setprecision(6) << min_cosine
+                << std::defaultfloat << std::endl;
+    }
+  }
+
+  // Memory of a full-length cache against what a conversation actually touches.
+  const KVCacheLayout layout = kv_cache_layout(gcpp::Model::GEMMA_2B);
+  gcpp::KVCache kv_cache = CreateReleasableKVCache(gcpp::Model::GEMMA_2B);
+  const size_t full_mib = 2 * layout.seq_len * layout.floats_per_pos * sizeof(float) / (1024 * 1024);
+  std::cout << "2b KV cache, " << full_mib << " MiB allocated for " << layout.seq_len
+            << " positions" << std::endl;
+  KVRowTracker kv_rows(layout);
+  for (size_t rows : {size_t{0}, size_t{256}, size_t{2048}, size_t{8192}, size_t{512}}) {
+    const size_t floats = rows * layout.floats_per_pos;
+    std::fill(kv_cache.key_cache.get(), kv_cache.key_cache.get() + floats, 1.0f);
+    std::fill(kv_cache.value_cache.get(), kv_cache.value_cache.get() + floats, 1.0f);
+    kv_rows.Touch(rows);
+    if (rows == 512) {
+      kv_rows.Restart(kv_cache, rows); // a short conversation after a long one
+    }
+    std::cout << "  " << std::setw(5) << rows << " rows written: "
+              << kv_cache_resident_bytes(kv_cache, layout, layout.seq_len) / (1024 * 1024)
+              << " MiB resident" << std::endl;
+  }
+  return 0;
+}
+
+#if defined(__linux__)
+
+struct E2EFlow {
+  const char* name;
+  int (*main)(int, char**);
+  std::vector<const char*> argv;
+  std::vector<std::string> user_inputs;
+};
+
+std::vector<E2EFlow> e2e_flows() {
+  return {
+    {"tasker", main_tasker, {"mirror-gaze", "tasker", "I want to learn to bake sourdough bread"}, {}},
+    {"therapist", main_therapist_twoway, {"mirror-gaze", "therapist"}, {
+      "I can't sleep because I keep thinking about work.",
+      "It started when I got promoted to team lead last spring.",
+      "I answer emails in bed until about one in the morning.",
+      "I guess I'm afraid the team will think I'm not good enough.",
+    }},
+  };
+}
+
+struct E2EFlowResult {
+  std::string json;         // FlowMetrics::ToJson
+  double total_wall_ms = 0; // summed over the prompts, so model loading isn't in it
+};
+
+// Runs flow with scripted user input and deterministic sampling in a forked child with
+// a fresh cache dir, so nothing is restored from an earlier run. False if it failed.
+bool run_e2e_flow(const E2EFlow& flow, E2EFlowResult& result) {
+  char cache_dir[] = "/tmp/mirror-gaze-e2e-XXXXXX";
+  int fds[2];
+  if (mkdtemp(cache_dir) == nullptr || pipe(fds) != 0) {
+    std::cout << "Cannot create temp dir / pipe" << std::endl;
+    return false;
+  }
+  const pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    // The flow's own output isn't part of the result.
+    const int devnull = ::open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+      dup2(devnull, STDOUT_FILENO);
+    }
+    setenv("MIRROR_GAZE_CACHE_DIR", cache_dir, 1);
+    unsetenv("MIRROR_GAZE_SOCKET"); // always load the model in-process
+    setenv("USER", "Sam", 1);       // the user name is part of the prompts
+    unsetenv("username");
+    unsetenv("USERNAME");
+    unsetenv("user");
+    FlowMetrics metrics;
+    flow_metrics = &metrics;
+    flows_scripted = true;
+    scripted_user_inputs.assign(flow.user_inputs.begin(), flow.user_inputs.end());
+    std::vector<char*> argv(flow.argv.size());
+    for (size_t i = 0; i < argv.size(); i += 1) {
+      argv[i] = const_cast<char*>(flow.argv[i]);
+    }
+    const int rc = flow.main(argv.size(), argv.data());
+    // The total on the first line, then the JSON.
+    const std::string out = std::to_string(metrics.TotalWallMs()) + "\n" + metrics.ToJson(flow.name);
+    const bool ok = write(fds[1], out.data(), out.size()) == static_cast<ssize_t>(out.size());
+    _exit(rc == 0 && ok ? 0 : 1);
+  }
+  close(fds[1]);
+  std::string out;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+    out.append(buffer, n);
+  }
+  close(fds[0]);
+  int status = 0;
+  if (pid > 0) {
+    waitpid(pid, &status, 0);
+  }
+  std::error_code ec;
+  std::filesystem::remove_all(cache_dir, ec);
+  const size_t newline = out.find('\n');
+  if (pid <= 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || newline == std::string::npos ||
+      newline + 1 == out.size()) {
+    std::cout << flow.name << " failed" << std::endl;
+    return false;
+  }
+  result.total_wall_ms = std::strtod(out.c_str(), nullptr);
+  result.json = out.substr(newline + 1);
+  return true;
+}
+
+#endif // Linux
+
+// Runs the tasker and therapist flows end to end with scripted user input and
+// deterministic sampling, and writes per-prompt timings as JSON (to json_file, or
+// stdout after the progress lines). Each flow runs in a forked child with a fresh
+// cache dir, so nothing is restored from an earlier run and the results compare
+// across gemma.cpp versions.
+int bench_e2e(const char* json_file) {
+#if !defined(__linux__)
+  (void)json_file;
+  std::cout << "'bench e2e' needs fork()" << std::endl;
+  return 1;
+#else
+  if (std::getenv("GEMMA_MODEL_SBS_FILE") == nullptr || std::getenv("GEMMA_TOKENIZER_SPM_FILE") == nullptr) {
+    std::cout << "Set GEMMA_MODEL_SBS_FILE and GEMMA_TOKENIZER_SPM_FILE" << std::endl;
+    return 1;
+  }
+  std::string flows_json;
+  for (const E2EFlow& flow : e2e_flows()) {
+    std::cout << "Running " << flow.name << "..." << std::endl;
+    E2EFlowResult result;
+    if (!run_e2e_flow(flow, result)) {
+      return 1;
+    }
+    flows_json += (flows_json.size() > 0 ? ",\n  " : "\n  ") + result.json;
+  }
+
+  const std::string weights = std::filesystem::path(std::getenv("GEMMA_MODEL_SBS_FILE")).filename().string();
+  std::stringstream ss;
+  const char* small_weights = cascade_small_model_file();
+  ss << "{\"benchmark\": \"e2e\", \"weights\": " << FlowMetrics::JsonString(weights)
+     << ", \"small_weights\": "
+     << (small_weights != nullptr
+             ? FlowMetrics::JsonString(std::filesystem::path(small_weights).filename().string())
+             : "null")
+     << ", \"target\": " << FlowMetrics::JsonString(hwy::TargetName(hwy::DispatchedTarget()))
+     << ", \"threads\": " << std::thread::hardware_concurrency()
+     << ", \"flows\": [" << flows_json << "\n]}\n";
+  if (json_file != nullptr) {
+    std::ofstream out(json_file);
+    out << ss.str();
+    if (!out) {
+      std::cout << "Cannot write " << json_file << std::endl;
+      return 1;
+    }
+    std::cout << "Wrote " << json_file << std::endl;
+  } else {
+    std::cout << ss.str() << std::flush;
+  }
+  return 0;
+#endif // Linux
+}
+
+// Session wall time of the scripted flows (summed over their prompts) with the large
+// model alone and as a cascade with the small one (see model_cascade.hpp).
+int bench_cascade() {
+#if !defined(__linux__)
+  std::cout << "'bench cascade' needs fork()" << std::endl;
+  return 1;
+#else
+  const char* small_weights = cascade_small_model_file();
+  if (std::getenv("GEMMA_MODEL_SBS_FILE") == nullptr || std::getenv("GEMMA_TOKENIZER_SPM_FILE") == nullptr ||
+      small_weights == nullptr) {
+    std::cout << "Set GEMMA_MODEL_SBS_FILE, GEMMA_SMALL_MODEL_SBS_FILE and GEMMA_TOKENIZER_SPM_FILE" << std::endl;
+    return 1;
+  }
+  const std::string small_weights_path = small_weights;
+  double large_total_ms = 0;
+  double cascade_total_ms = 0;
+  for (const E2EFlow& flow : e2e_flows()) {
+    E2EFlowResult large_only;
+    E2EFlowResult cascade;
+    unsetenv("GEMMA_SMALL_MODEL_SBS_FILE");
+    const bool large_ok = run_e2e_flow(flow, large_only);
+    setenv("GEMMA_SMALL_MODEL_SBS_FILE", small_weights_path.c_str(), 1);
+    if (!large_ok || !run_e2e_flow(flow, cascade)) {
+      return 1;
+    }
+    std::cout << "  " << std::setw(10) << std::left << flow.name << std::right << std::fixed
+              << std::setprecision(0) << " large only " << std::setw(7) << large_only.total_wall_ms
+              << " ms, cascade " << std::setw(7) << cascade.total_wall_ms << " ms ("
+              << std::setprecision(2) << large_only.total_wall_ms / std::max(cascade.total_wall_ms, 1.0)
+              << "x)" << std::defaultfloat << std::endl;
+    large_total_ms += large_only.total_wall_ms;
+    cascade_total_ms += cascade.total_wall_ms;
+  }
+  std::cout << "  " << std::setw(10) << std::left << "all" << std::right << std::fixed << std::setprecision(0)
+            << " large only " << std::setw(7) << large_total_ms << " ms, cascade " << std::setw(7)
+            << cascade_total_ms << " ms (" << std::setprecision(2)
+            << large_total_ms / std::max(cascade_total_ms, 1.0) << "x)" << std::defaultfloat << std::endl;
+  return 0;
+#endif // Linux
+}
+
+int main_bench(int argc, char** argv) {
+  // argv[1] is "bench", argv[2] picks the benchmark
+  std::string which = argc > 2 ? argv[2] : "handoff";
+
+  if (which == "handoff") {
+    size_t num_tokens = argc > 3 ? std::stoul(argv[3]) : 200;
+    int token_interval_us = argc > 4 ? std::stoi(argv[4]) : 20000;
+    std::cout << "Token handoff latency, " << num_tokens << " tokens every "
+              << token_interval_us << " us" << std::endl;
+    return bench_token_handoff(num_tokens, token_interval_us);
+  }
+  else if (which == "detokenize") {
+    size_t num_tokens = argc > 3 ? std::stoul(argv[3]) : 1000000;
+    std::cout << "Detokenize + handoff, " << num_tokens << " tokens" << std::endl;
+    return bench_detokenize(num_tokens);
+  }
+  else if (which == "grammar") {
+    size_t decode_steps = argc > 3 ? std::stoul(argv[3]) : 20000;
+    std::cout << "Constrained decoding, " << decode_steps << " decode steps" << std::endl;
+    return bench_grammar(decode_steps);
+  }
+  else if (which == "sampler") {
+    size_t num_tokens = argc > 3 ? std::stoul(argv[3]) : 2000;
+    std::cout << "Token sampling, " << num_tokens << " tokens per setting" << std::endl;
+    return bench_sampler(num_tokens);
+  }
+  else if (which == "filter") {
+    size_t num_responses = argc > 3 ? std::stoul(argv[3]) : 20000;
+    std::cout << "Response filtering, " << num_responses << " replayed responses" << std::endl;
+    return bench_filter(num_responses);
+  }
+  else if (which == "daemon") {
+    size_t max_sessions = argc > 3 ? std::stoul(argv[3]) : 8;
+    size_t prompts_per_session = argc > 4 ? std::stoul(argv[4]) : 4;
+    std::cout << "Daemon load test, up to " << max_sessions << " sessions, "
+              << prompts_per_session << " prompts each" << std::endl;
+    return bench_daemon(max_sessions, prompts_per_session);
+  }
+  else if (which == "threads") {
+    size_t decode_tokens = argc > 3 ? std::stoul(argv[3]) : 32;
+    std::cout << "Decode speed by num_threads, " << decode_tokens << " tokens per run" << std::endl;
+    return bench_threads(decode_tokens);
+  }
+  else if (which == "render") {
+    size_t num_responses = argc > 3 ? std::stoul(argv[3]) : 8;
+    int token_interval_us = argc > 4 ? std::stoi(argv[4]) : 5000;
+    std::cout << "Terminal rendering, " << num_responses << " replayed responses, one token every "
+              << token_interval_us << " us" << std::endl;
+    return bench_render(num_responses, token_interval_us);
+  }
+  else if (which == "e2e") {
+    std::cout << "End-to-end tasker and therapist flows, scripted and deterministic" << std::endl;
+    return bench_e2e(argc > 3 ? argv[3] : nullptr);
+  }
+  else if (which == "isolation") {
+    size_t decode_tokens = argc > 3 ? std::stoul(argv[3]) : 64;
+    std::cout << "Sampling isolation from other generations on the session's thread, " << decode_tokens
+              << " tokens per prompt" << std::endl;
+    return bench_isolation(decode_tokens);
+  }
+  else if (which == "cascade") {
+    std::cout << "Scripted flows on the large model alone and as a cascade with the small one" << std::endl;
+    return bench_cascade();
+  }
+  else if (which == "replay") {
+    if (argc < 4) {
+      std::cout << "Usage: mirror-gaze bench replay <recording> [passes]" << std::endl;
+      return 1;
+    }
+    size_t passes = argc > 4 ? std::stoul(argv[4]) : 100;
+    std::cout << "Replay of " << argv[3] << ", " << passes << " passes at full speed" << std::endl;
+    return bench_replay(argv[3], passes);
+  }
+  else if (which == "kvcodec") {
+    std::vector<std::filesystem::path> files;
+    for (int i = 3; i < argc; i += 1) {
+      files.push_back(argv[i]);
+    }
+    if (files.size() < 1) {
+      std::error_code ec;
+      for (const auto& entry : std::filesystem::directory_iterator(mirror_gaze_cache_dir(), ec)) {
+        const auto extension = entry.path().extension();
+        if (extension == ".snap" || extension == ".session") {
+          files.push_back(entry.path());
+        }
+      }
+    }
+    std::cout << "KV cache codecs, " << files.size() << " snapshot files" << std::endl;
+    return bench_kvcodec(files);
+  }
+
+  std::cout << "Unknown benchmark '" << which << "'! Expected one of: handoff, detokenize, grammar, sampler, filter, render, kvcodec, replay, daemon, threads, e2e, cascade, isolation" << std::endl;
+  return 1;
+}
@@ -0,0 +1,504 @@
+#ifdef MAIN_DAEMON
+#error "Only include main_daemon.hpp ONCE!"
+#endif
+#define MAIN_DAEMON
+
+// 'mirror-gaze daemon' loads the model once and serves any number of therapist/tasker
+// sessions over a local Unix socket, so launching a session no longer means loading
+// (and paying the RAM for) the weights again.
+//
+// Each session gets its own KV cache and its own ReplGemma loop on its own thread, fed
+// by the same LlmPrompt / LlmToken channels the in-process LLM thread uses. The loops
+// share the model through a SliceScheduler, which interleaves their prefill batches
+// and decode steps round-robin. A session whose client stops reading lets go of the
+// model while its full output channel blocks it (push_to_output), so it only stalls itself.
+//
+// The therapist and tasker sub-programs check for the socket before loading anything;
+// if a daemon is listening they become thin clients that relay their channels over it.
+
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+// Every message is [u8 type][u32 payload size][payload].
+constexpr uint8_t kDaemonHello = 'H';   // client: its argv (one field each); daemon: accepted
+constexpr uint8_t kDaemonRefuse = 'X';  // daemon: session refused, payload is the reason
+constexpr uint8_t kDaemonPrompt = 'P';  // client: an LlmPrompt
+constexpr uint8_t kDaemonText = 'T';    // daemon: streamed response text
+constexpr uint8_t kDaemonEnd = 'E';     // daemon: end of response
+constexpr uint8_t kDaemonInterrupt = 'I'; // client: end the response being generated
+constexpr uint32_t kDaemonMaxPayload = 64 * 1024 * 1024;
+
+std::filesystem::path daemon_socket_path() {
+  if (const char* env_var = std::getenv("MIRROR_GAZE_SOCKET")) {
+    return std::filesystem::path(env_var);
+  }
+  return mirror_gaze_cache_dir() / "daemon.sock";
+}
+
+void daemon_append_field(std::string& out, std::string_view field) {
+  const uint32_t size = static_cast<uint32_t>(field.size());
+  out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  out.append(field.data(), field.size());
+}
+
+bool daemon_read_field(std::string_view& in, std::string& field) {
+  uint32_t size = 0;
+  if (in.size() < sizeof(size)) {
+    return false;
+  }
+  memcpy(&size, in.data(), sizeof(size));
+  in.remove_prefix(sizeof(size));
+  if (in.size() < size) {
+    return false;
+  }
+  field.assign(in.data(), size);
+  in.remove_prefix(size);
+  return true;
+}
+
+std::string daemon_encode_prompt(const LlmPrompt& prompt) {
+  std::string out;
+  out += prompt.cache_opening_state ? '1' : '0';
+  out += prompt.draft ? '1' : '0';
+  daemon_append_field(out, prompt.text);
+  daemon_append_field(out, prompt.shared_prefix);
+  daemon_append_field(out, prompt.session_file);
+  daemon_append_field(out, prompt.grammar);
+  daemon_append_field(out, std::to_string(prompt.stop.max_sentences) + " " +
+                           std::to_string(prompt.stop.max_questions) + " " +
+                           std::to_string(prompt.stop.max_tokens));
+  for (const std::string& stop_string : prompt.stop.stop_strings) {
+    daemon_append_field(out, stop_string);
+  }
+  return out;
+}
+
+bool daemon_decode_prompt(std::string_view in, LlmPrompt& prompt) {
+  if (in.size() < 2) {
+    return false;
+  }
+  prompt.cache_opening_state = in[0] == '1';
+  prompt.draft = in[1] == '1';
+  in.remove_prefix(2);
+  std::string limits;
+  if (!daemon_read_field(in, prompt.text) || !daemon_read_field(in, prompt.shared_prefix) ||
+      !daemon_read_field(in, prompt.session_file) || !daemon_read_field(in, prompt.grammar) ||
+      !daemon_read_field(in, limits)) {
+    return false;
+  }
+  std::stringstream(limits) >> prompt.stop.max_sentences >> prompt.stop.max_questions >>
+      prompt.stop.max_tokens;
+  prompt.stop.stop_strings.clear();
+  std::string stop_string;
+  while (daemon_read_field(in, stop_string)) {
+    prompt.stop.stop_strings.push_back(stop_string);
+  }
+  return true;
+}
+
+#if !defined(_WIN32)
+
+bool daemon_write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool daemon_read_all(int fd, char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// One write() per message. Streamed text is at most LlmToken::kMaxBytes, so the
+// per-token messages are built on the stack.
+bool daemon_send(int fd, uint8_t type, std::string_view payload) {
+  char small[5 + LlmToken::kMaxBytes];
+  std::string large;
+  char* frame = small;
+  if (payload.size() > LlmToken::kMaxBytes) {
+    large.resize(5 + payload.size());
+    frame = large.data();
+  }
+  const uint32_t size = static_cast<uint32_t>(payload.size());
+  frame[0] = static_cast<char>(type);
+  memcpy(frame + 1, &size, sizeof(size));
+  memcpy(frame + 5, payload.data(), payload.size());
+  return daemon_write_all(fd, frame, 5 + payload.size());
+}
+
+bool daemon_recv(int fd, uint8_t& type, std::string& payload) {
+  char header[5];
+  if (!daemon_read_all(fd, header, sizeof(header))) {
+    return false;
+  }
+  type = static_cast<uint8_t>(header[0]);
+  uint32_t size = 0;
+  memcpy(&size, header + 1, sizeof(size));
+  if (size > kDaemonMaxPayload) {
+    return false;
+  }
+  payload.resize(size);
+  return daemon_read_all(fd, payload.data(), size);
+}
+
+int daemon_connect(const std::filesystem::path& socket_path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  const std::string path = socket_path.string();
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Opens a session on a running daemon; returns the socket, or -1 to run the model
+// in-process. args are the ones that would have been given to run_llm_thread.
+int daemon_open_session(const std::vector<char*>& args) {
+  const std::filesystem::path socket_path = daemon_socket_path();
+  std::error_code ec;
+  if (!std::filesystem::exists(socket_path, ec)) {
+    return -1;
+  }
+  const int fd = daemon_connect(socket_path);
+  if (fd < 0) {
+    return -1; // stale socket file from a daemon that is gone
+  }
+  signal(SIGPIPE, SIG_IGN); // a daemon going away shows up as a failed write instead
+  std::string hello;
+  for (const char* arg : args) {
+    daemon_append_field(hello, arg);
+  }
+  uint8_t type = 0;
+  std::string reply;
+  if (!daemon_send(fd, kDaemonHello, hello) || !daemon_recv(fd, type, reply) ||
+      type != kDaemonHello) {
+    if (type == kDaemonRefuse) {
+      std::cerr << "mirror-gaze daemon refused the session: " << reply << "\n";
+    }
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Stands in for run_llm_thread: relays input to the daemon and its responses into output.
+void run_daemon_client_thread(int fd, LlmPromptChannel& input, LlmTokenChannel& output) {
+  // Both threads write to the socket: prompts from this one, interrupts from the reader.
+  std::mutex send_mutex;
+  std::atomic<bool> interrupt_sent{false};
+  std::thread reader([fd, &input, &output, &send_mutex, &interrupt_sent]() {
+    uint8_t type = 0;
+    std::string payload;
+    while (daemon_recv(fd, type, payload)) {
+      // Relayed with the next piece of text, which is as soon as the daemon could act on it.
+      if (output.stop_requested() && !interrupt_sent.exchange(true)) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        daemon_send(fd, kDaemonInterrupt, "");
+      }
+      if (type == kDaemonText) {
+        push_text_to_output(output, payload);
+      } else if (type == kDaemonEnd) {
+        push_end_of_response(output);
+      }
+    }
+    request_exit(input, output); // the daemon ended the session (after "%q") or went away
+  });
+  LlmPrompt prompt;
+  while (input.pop(prompt)) {
+    if (!prompt.draft) { // drafts come between responses and don't start one
+      output.clear_stop();
+      interrupt_sent = false;
+    }
+    std::lock_guard<std::mutex> lock(send_mutex);
+    if (!daemon_send(fd, kDaemonPrompt, daemon_encode_prompt(prompt))) {
+      break;
+    }
+  }
+  shutdown(fd, SHUT_RDWR);
+  reader.join();
+  close(fd);
+  request_exit(input, output);
+}
+
+// Everything the sessions of one daemon share.
+struct DaemonContext {
+  gcpp::LoaderArgs& loader;
+  gcpp::Gemma& model;
+  hwy::ThreadPool& pool;
+  const TokenByteTable& token_bytes;
+  uint64_t model_key;
+  int verbosity;
+  SliceScheduler scheduler;
+  MemoryPlan memory_plan; // context limits for sessions that don't set their own
+  KVTokenAllowance kv_allowance; // the plan's KV rows, shared out between the sessions
+  std::vector<int> model_cpus; // empty: unpinned
+  std::atomic<size_t> sessions{0};
+};
+
+void daemon_session(int fd, DaemonContext& ctx) {
+  trace_thread_name("session");
+  uint8_t type = 0;
+  std::string payload;
+  if (!daemon_recv(fd, type, payload) || type != kDaemonHello) {
+    close(fd);
+    return;
+  }
+
+  // The client's argv picks the inference settings of this session (multiturn,
+  // temperature, ...); the model is whatever the daemon has loaded.
+  std::vector<std::string> client_args;
+  std::string_view fields = payload;
+  std::string field;
+  while (daemon_read_field(fields, field)) {
+    client_args.push_back(field);
+  }
+  std::vector<char*> argv;
+  for (std::string& arg : client_args) {
+    argv.push_back(arg.data());
+  }
+  gcpp::LoaderArgs client_loader(argv.size(), argv.data());
+  gcpp::InferenceArgs inference(argv.size(), argv.data());
+  const SamplerArgs sampling(argv.size(), argv.data());
+  apply_memory_plan(ctx.memory_plan, inference, argv.size(), argv.data(), /*verbosity=*/0);
+  const char* refusal = inference.Validate();
+  if (refusal == nullptr) {
+    refusal = sampling.Validate();
+  }
+  if (refusal == nullptr && client_loader.weights.path.size() > 0 &&
+      client_loader.weights.path != ctx.loader.weights.path) {
+    refusal = "the daemon serves a different model file";
+  }
+  // The session may grow its conversation to max_tokens, so that many KV rows of the
+  // budget are set aside for it; later sessions get less context, or none once the
+  // rows are all taken.
+  size_t kv_tokens = 0;
+  if (refusal == nullptr) {
+    kv_tokens = ctx.kv_allowance.Reserve(inference.max_tokens, kMemoryPlanMinTokens);
+    if (kv_tokens == 0) {
+      refusal = "the daemon's memory budget is taken up by its other sessions";
+    }
+  }
+  if (refusal != nullptr) {
+    daemon_send(fd, kDaemonRefuse, refusal);
+    close(fd);
+    return;
+  }
+  inference.max_tokens = kv_tokens;
+  inference.max_generated_tokens = std::min(inference.max_generated_tokens, kv_tokens * 3 / 8);
+  if (!daemon_send(fd, kDaemonHello, "")) {
+    ctx.kv_allowance.Release(kv_tokens);
+    close(fd);
+    return;
+  }
+
+  const size_t session_id = ctx.sessions.fetch_add(1) + 1;
+  if (ctx.verbosity >= 1) {
+    std::cout << "Session " << session_id << " started" << std::endl;
+  }
+
+  auto input = std::make_unique<LlmPromptChannel>();
+  auto output = std::make_unique<LlmTokenChannel>();
+  std::thread reader([fd, &input, &output]() {
+    uint8_t type = 0;
+    std::string payload;
+    LlmPrompt prompt;
+    while (daemon_recv(fd, type, payload)) {
+      if (type == kDaemonPrompt && daemon_decode_prompt(payload, prompt)) {
+        input->push(std::move(prompt));
+      } else if (type == kDaemonInterrupt) {
+        output->request_stop();
+      }
+    }
+    input->close(); // client hung up: ReplGemma returns once it is done with the current prompt
+  });
+  std::thread writer([fd, &output]() {
+    LlmToken token;
+    while (output->pop(token)) {
+      const bool sent = token.end_of_response ? daemon_send(fd, kDaemonEnd, "")
+                                              : daemon_send(fd, kDaemonText, token.text());
+      if (!sent) {
+        output->close(); // stops generation at the next step
+        break;
+      }
+    }
+  });
+
+  pin_thread_to_cpus(0, ctx.model_cpus); // drives the pool while it holds the model
+  gcpp::KVCache kv_cache = CreateReleasableKVCache(ctx.loader.ModelType());
+  std::string eot_line;
+  gcpp::ReplGemma(ctx.model, ctx.loader.ModelTraining(), ctx.loader.ModelType(), ctx.model_key,
+                  kv_cache, ctx.pool, inference, sampling, ctx.verbosity,
+                  /*accept_token=*/[](int) { return true; }, eot_line, ctx.token_bytes,
+                  *input, *output, &ctx.scheduler);
+
+  input->close();
+  output->close();
+  writer.join();
+  shutdown(fd, SHUT_RDWR);
+  reader.join();
+  close(fd);
+  ctx.kv_allowance.Release(kv_tokens);
+  if (ctx.verbosity >= 1) {
+    std::cout << "Session " << session_id << " ended" << std::endl;
+  }
+}
+
+int main_daemon(int argc, char** argv) {
+  // Only the model is picked here; inference settings come from each session.
+  std::vector<char*> args;
+  if (argc > 0) {
+    args.push_back(argv[0]);
+  }
+  if (const char* gemma_tokenizer_spm_file = std::getenv("GEMMA_TOKENIZER_SPM_FILE")) {
+    args.push_back((char*)"--tokenizer");
+    args.push_back((char*)gemma_tokenizer_spm_file);
+  }
+  if (const char* gemma_model_sbs_file = std::getenv("GEMMA_MODEL_SBS_FILE")) {
+    args.push_back((char*)"--weights");
+    args.push_back((char*)gemma_model_sbs_file);
+    // Infer model type from file name
+    auto file_name = std::filesystem::path(gemma_model_sbs_file).filename().string();
+    args.push_back((char*)"--model");
+    auto model_name = model_from_file_name(file_name);
+    args.push_back((char*) model_name );
+  }
+
+  gcpp::LoaderArgs loader(args.size(), args.data());
+  gcpp::AppArgs app(args.size(), args.data());
+  if (const char* error = loader.Validate()) {
+    std::cerr << "Invalid args: " << error << "\n"
+              << "Set GEMMA_MODEL_SBS_FILE and GEMMA_TOKENIZER_SPM_FILE" << std::endl;
+    return 1;
+  }
+
+  const std::filesystem::path socket_path = daemon_socket_path();
+  {
+    const int existing = daemon_connect(socket_path);
+    if (existing >= 0) {
+      close(existing);
+      std::cerr << "A mirror-gaze daemon is already listening on " << socket_path << std::endl;
+      return 1;
+    }
+  }
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  const std::string path = socket_path.string();
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long, set MIRROR_GAZE_SOCKET: " << path << std::endl;
+    return 1;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Sessions and their socket threads are started from this thread and inherit its
+  // CPUs, the control CPUs; each session moves its own model thread onto the workers'.
+  const CpuTopology topology = read_cpu_topology();
+  app.num_threads = tuned_num_threads(topology, loader.weights.path, app.num_threads);
+  hwy::ThreadPool pool(app.num_threads);
+  control_thread_tid = current_thread_tid();
+  place_threads(pool, topology, app.verbosity);
+  // Each session gets the context one would have alone, for as long as the KV rows the
+  // budget has room for last; see daemon_session.
+  const MemoryPlan memory_plan = plan_memory_for_model(loader.weights.path, loader.ModelType(),
+                                                       /*companion_weights_paths=*/{});
+  print_memory_plan(memory_plan);
+  if (memory_plan.kv_room_tokens > 0) {
+    std::cout << memory_plan.kv_room_tokens << " tokens of context for all sessions together" << std::endl;
+  }
+  gcpp::Gemma model(loader.tokenizer, loader.weights, loader.ModelType(), pool);
+  TokenByteTable token_bytes;
+  gcpp::load_token_byte_table(loader, model, token_bytes);
+
+  // Bound only once the model is loaded, so clients never wait on a daemon that is starting.
+  const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path.c_str()); // stale socket from a daemon that was killed
+  if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      chmod(path.c_str(), 0600) != 0 || listen(listen_fd, 16) != 0) {
+    std::cerr << "Cannot listen on " << socket_path << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  // A decode step takes tens of ms, so a 10 ms slice hands the model over after every
+  // step (and every prefill batch) whenever another session is waiting.
+  DaemonContext ctx = {
+    .loader = loader,
+    .model = model,
+    .pool = pool,
+    .token_bytes = token_bytes,
+    .model_key = model_files_key(loader.weights.path, loader.tokenizer.path),
+    .verbosity = app.verbosity,
+    .scheduler = SliceScheduler(std::chrono::milliseconds(10)),
+    .memory_plan = memory_plan,
+    .kv_allowance = KVTokenAllowance(memory_plan),
+    .model_cpus = thread_placement_enabled()
+                      ? plan_thread_placement(topology, pool.NumThreads()).worker_cpus
+                      : std::vector<int>(),
+  };
+  std::cout << "Listening on " << socket_path << std::endl;
+
+  // Runs until killed. Session threads are detached; they only touch ctx, which lives
+  // as long as the process does.
+  while (true) {
+    const int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      std::cerr << "accept: " << strerror(errno) << std::endl;
+      return 1;
+    }
+    std::thread(daemon_session, fd, std::ref(ctx)).detach();
+  }
+}
+
+#else // Windows
+
+int daemon_open_session(const std::vector<char*>& args) {
+  (void)args;
+  return -1;
+}
+
+void run_daemon_client_thread(int fd, LlmPromptChannel& input, LlmTokenChannel& output) {
+  (void)fd;
+  request_exit(input, output);
+}
+
+int main_daemon(int argc, char** argv) {
+  std::cerr << "'daemon' needs Unix sockets, which this build does not support" << std::endl;
+  return 1;
+}
+
+#endif // Windows
@@ -8,6 +8,38 @@
 // bad long-term design philosophy, but amazing proof-of-concept organization when we want to focus
 // on controlling the model's high-level logic!
 
+// The subgoals prompt asks for a numbered list of three one-line steps, and the grammar
+// holds the response to exactly that shape.
+const char* kThreeStepsGrammar = "1\\. [^\\n]+\\n2\\. [^\\n]+\\n3\\. [^\\n]+";
+
+// The items of a numbered list "1. ...\n2. ...", without their numbers. Empty unless
+// there are exactly count non-empty items.
+std::vector<std::string> parse_numbered_list(const std::string& text, size_t count) {
+  std::vector<std::string> items;
+  std::stringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    const size_t start = line.find_first_not_of(" \t");
+    if (start == std::string::npos) {
+      continue;
+    }
+    const std::string number = std::to_string(items.size() + 1) + ".";
+    if (line.compare(start, number.size(), number) != 0) {
+      return {};
+    }
+    const size_t item_start = line.find_first_not_of(" \t", start + number.size());
+    const size_t item_end = line.find_last_not_of(" \t\r");
+    if (item_start == std::string::npos) {
+      return {};
+    }
+    items.push_back(line.substr(item_start, item_end + 1 - item_start));
+  }
+  if (items.size() != count) {
+    return {};
+  }
+  return items;
+}
+
 int main_tasker(int argc, char** argv) {
 
   // We parse our own (more opinionated for task-at-hand) args
@@ -30,15 +62,9 @@ int main_tasker(int argc, char** argv) {
     args.push_back((char*) model_name );
   }
 
-  // Hard-coded b/c build.py ensures these numbers are available in our modified copy of the llm
-  // max_tokens is everything in-memory, both prompt tokens plus max generated tokens
-  args.push_back((char*)"--max_tokens");
-  args.push_back((char*)"32768");
-
-  // TODO worth tuning / making a per-prompt parameter?
-  // This gives us 12k tokens for prompt and 4096 for responses (original ~1024 for responses)
-  args.push_back((char*)"--max_generated_tokens");
-  args.push_back((char*)"12288");
+  // max_tokens (prompt plus generated tokens, everything in memory) and
+  // max_generated_tokens are picked from the memory budget, up to the 32768 build.py
+  // compiles in (see memory_budget.hpp).
 
   // Default is 0, but 1 means the LLM will keep state data between prompts.
   args.push_back((char*)"--multiturn");
@@ -49,16 +75,26 @@ int main_tasker(int argc, char** argv) {
   args.push_back((char*)"--temperature");
   args.push_back((char*)"2");
 
+  // Fixed seed (42) for reproducible benchmark runs.
+  if (flows_scripted) {
+    args.push_back((char*)"--deterministic");
+    args.push_back((char*)"1");
+  }
+
 
-  std::thread llm_t(run_llm_thread, args.size(), args.data());
-  std::thread term_size_update_t(update_term_size_globals_thread);
+  std::thread llm_t = start_llm_thread(args);
 
   auto username = get_username_from_env();
   std::string llm_resp;
 
-  llm_resp = prompt_llm_and_return_value_interactive(
-    "My name is "+username+". Your name is Mirror. Briefly greet me and ask what I want to accomplish."
-  );
+  // The greeting is the same on every launch, so its result is restored from disk when possible.
+  // It and the goodbye are light work for the small model, if one is loaded next to the main
+  // one; planning and the how-tos get the large one (see model_cascade.hpp).
+  llm_resp = prompt_llm_and_return_value({
+    .text = "My name is "+username+". Your name is Mirror. Briefly greet me and ask what I want to accomplish.",
+    .cache_opening_state = true,
+    .tier = ModelTier::kSmall,
+  }, true);
 
   std::string user_goal_description;
 
@@ -74,9 +110,15 @@ int main_tasker(int argc, char** argv) {
   }
 
   // Now we internally use the LLM to imagine 3 sub-steps to that.
-  std::string llm_idea_subgoals = prompt_llm_and_return_value_silent(
-    user_goal_description+"\nIdentify three steps to accomplish this."
-  );
+  // Every prompt has a token budget, so a rambling response at temperature 2 can't
+  // decode for minutes.
+  std::string llm_idea_subgoals = prompt_llm_and_return_value({
+    .text = user_goal_description+"\nIdentify three steps to accomplish this, as a numbered list with one short line per step.",
+    .stop = {.stop_strings = {"\n4."}, .max_tokens = 384},
+    .grammar = kThreeStepsGrammar,
+    .tier = ModelTier::kLarge,
+  }, false);
+  const std::vector<std::string> subgoals = parse_numbered_list(llm_idea_subgoals, 3);
 
   if (const char* env_p = std::getenv("PRINT_LLM_SUBGOALS")) {
     std::cout << "[ DEBUG ] llm_idea_subgoals = " << llm_idea_subgoals << std::endl;
@@ -84,36 +126,50 @@ int main_tasker(int argc, char** argv) {
   }
 
   // Interactively imagine more!
+  // Each step is asked about on its own, after the goal they share (prefilled once and
+  // forked). If the list didn't come back in shape (no grammar support, or a replayed
+  // response), every step gets the whole list instead, as before.
+  auto step_prompt = [&](size_t index, const std::string& name) -> LlmPrompt {
+    if (subgoals.size() == 3) {
+      return {
+        .text = "\nTell me where and how I can accomplish this step: "+subgoals[index],
+        .shared_prefix = user_goal_description,
+        .stop = {.max_tokens = 512},
+        .tier = ModelTier::kLarge,
+      };
+    }
+    return {
+      .text = "\nTell me where and how I can accomplish step "+name+".",
+      .shared_prefix = llm_idea_subgoals,
+      .stop = {.max_tokens = 512},
+      .tier = ModelTier::kLarge,
+    };
+  };
+
   std::cout << "============= Step 1 =============" << std::endl;
-  std::string howto_step1 = prompt_llm_and_return_value_interactive(
-    llm_idea_subgoals+"\nTell me where and how I can accomplish step one."
-  );
+  std::string howto_step1 = prompt_llm_and_return_value(step_prompt(0, "one"), true);
 
   std::cout << "============= Step 2 =============" << std::endl;
-  std::string howto_step2 = prompt_llm_and_return_value_interactive(
-    llm_idea_subgoals+"\nTell me where and how I can accomplish step two."
-  );
+  std::string howto_step2 = prompt_llm_and_return_value(step_prompt(1, "two"), true);
 
   std::cout << "============= Step 3 =============" << std::endl;
-  std::string howto_step3 = prompt_llm_and_return_value_interactive(
-    llm_idea_subgoals+"\nTell me where and how I can accomplish step three."
-  );
+  std::string howto_step3 = prompt_llm_and_return_value(step_prompt(2, "three"), true);
 
   std::cout << "============= Fin =============" << std::endl;
-  llm_resp = prompt_llm_and_return_value_interactive(
-    username+" will be doing the following. "+llm_idea_subgoals+"\n"+
-    "Energetically say goodbye to "+username+", briefly identify the first task to be done, and wish them success with their first task!"
-  );
-
-  exit_requested = true;
-  llm_input_queue.push(
+  llm_resp = prompt_llm_and_return_value({
+    .text = username+" will be doing the following. "+llm_idea_subgoals+"\n"+
+      "Energetically say goodbye to "+username+", briefly identify the first task to be done, and wish them success with their first task!",
+    .stop = {.max_tokens = 256},
+    .tier = ModelTier::kSmall,
+  }, true);
+
+  llm_input_queue.push({
     "%q" // quit token
-  );
+  });
 
   std::cout << "Goodbye!" << std::endl;
 
   llm_t.join();
-  term_size_update_t.join();
 
   return 0;
 }
@@ -30,15 +30,9 @@ int main_therapist_twoway(int argc, char** argv) {
     args.push_back((char*) model_name );
   }
 
-  // Hard-coded b/c build.py ensures these numbers are available in our modified copy of the llm
-  // max_tokens is everything in-memory, both prompt tokens plus max generated tokens
-  args.push_back((char*)"--max_tokens");
-  args.push_back((char*)"32768");
-
-  // TODO worth tuning / making a per-prompt parameter?
-  // This gives us 12k tokens for prompt and 4096 for responses (original ~1024 for responses)
-  args.push_back((char*)"--max_generated_tokens");
-  args.push_back((char*)"12288");
+  // max_tokens (prompt plus generated tokens, everything in memory) and
+  // max_generated_tokens are picked from the memory budget, up to the 32768 build.py
+  // compiles in (see memory_budget.hpp).
 
   // Default is 0, but 1 means the LLM will keep state data between prompts.
   args.push_back((char*)"--multiturn");
@@ -48,47 +42,111 @@ int main_therapist_twoway(int argc, char** argv) {
   args.push_back((char*)"--temperature");
   args.push_back((char*)"2");
 
+  // Fixed seed (42) for reproducible benchmark runs.
+  if (flows_scripted) {
+    args.push_back((char*)"--deterministic");
+    args.push_back((char*)"1");
+  }
+
 
-  std::thread llm_t(run_llm_thread, args.size(), args.data());
-  std::thread term_size_update_t(update_term_size_globals_thread);
+  // What the user said in earlier sessions (see recall_index.hpp). A new session is
+  // reminded of the few past turns closest to the user's first answer, a few hundred
+  // tokens at most, instead of resuming whole transcripts. Scripted benchmark runs
+  // neither read nor grow it, and MIRROR_GAZE_THERAPIST_MEMORY=off turns it off.
+  const char* memory_mode = std::getenv("MIRROR_GAZE_THERAPIST_MEMORY");
+  const bool use_memory = !flows_scripted && (memory_mode == nullptr || strcmp(memory_mode, "off") != 0);
+  recall_wants_model_rows.store(use_memory);
+  std::thread llm_t = start_llm_thread(args);
 
   auto username = get_username_from_env();
   std::string llm_resp;
 
-  llm_resp = prompt_llm_and_return_value_interactive(
-    "My name is "+username+". Your name is Mirror. Introduce yourself as a therapist interested in learning about my life's struggles."
-  );
+  // The conversation is saved here when we quit (including typing %q), and picked back up
+  // by launching with 'therapist resume'.
+  std::string session_file = (mirror_gaze_cache_dir() / ("therapist-" + username + ".session")).string();
+  bool resumed = false;
+  if (argv_contains(argc, argv, "resume")) {
+    llm_resp = prompt_llm_and_return_value({
+      .text = "%r", // resume token
+      .session_file = session_file,
+    }, true);
+    resumed = llm_resp.find_first_not_of(" \t\n") != std::string::npos;
+  }
+
+  if (!resumed) {
+    // The introduction is the same on every launch, so its result is restored from disk when possible.
+    llm_resp = prompt_llm_and_return_value({
+      .text = "My name is "+username+". Your name is Mirror. Introduce yourself as a therapist interested in learning about my life's struggles.",
+      .cache_opening_state = true,
+    }, true);
+  }
+
+  auto is_quit = [](const std::string& s) { return s == "%q" || s == "%Q"; };
+
+  // At temperature 2 a response can ramble on for thousands of tokens. Mirror's turns
+  // end after the first question it asks (that is the user's cue to answer), and every
+  // turn has a token budget.
+  auto therapist_turn = [](const std::string& text, StopConditions stop) {
+    return prompt_llm_and_return_value({.text = text, .stop = stop}, true);
+  };
+  const StopConditions conversation_turn = {.max_questions = 1, .max_tokens = 384};
+
+  RecallIndex memory(mirror_gaze_cache_dir() / ("therapist-" + username));
+  auto remember = [&memory, use_memory](const std::string& text) {
+    if (use_memory) {
+      memory.Add(text);
+    }
+  };
 
   std::string user_problem_description = prompt_user();
-  llm_resp = prompt_llm_and_return_value_interactive(
-    user_problem_description
-  );
+  bool user_quit = is_quit(user_problem_description);
+  if (!user_quit) {
+    std::string turn = user_problem_description;
+    if (use_memory && !resumed) {
+      const std::vector<std::string> recalled =
+          memory.Recall(user_problem_description, /*k=*/5, /*max_bytes=*/1200);
+      if (!recalled.empty()) {
+        std::string reminder = "In earlier sessions, " + username + " told you:\n";
+        for (const std::string& snippet : recalled) {
+          reminder += "- " + snippet + "\n";
+        }
+        turn = reminder + "\nToday " + username + " says: " + user_problem_description;
+      }
+    }
+    remember(user_problem_description);
+    llm_resp = therapist_turn(turn, conversation_turn);
+  }
 
   // Continue for as long as our llm-agent is asking the user questions.
-  while (str_contains(llm_resp, '?')) {
+  while (!user_quit && str_contains(llm_resp, '?')) {
     user_problem_description = prompt_user();
-    llm_resp = prompt_llm_and_return_value_interactive(
-      user_problem_description
-    );
+    user_quit = is_quit(user_problem_description);
+    if (!user_quit) {
+      remember(user_problem_description);
+      llm_resp = therapist_turn(user_problem_description, conversation_turn);
+    }
   }
 
-  llm_resp = prompt_llm_and_return_value_interactive(
-    "Tell "+username+" the best thing to do. Make sure they are called to take action that fixes their problem."
-  );
+  if (!user_quit) {
+    llm_resp = therapist_turn(
+      "Tell "+username+" the best thing to do. Make sure they are called to take action that fixes their problem.",
+      {.max_tokens = 768}
+    );
 
-  llm_resp = prompt_llm_and_return_value_interactive(
-    "Energetically say goodbye to "+username+" and wish them success!"
-  );
+    llm_resp = therapist_turn(
+      "Energetically say goodbye to "+username+" and wish them success!",
+      {.max_sentences = 4, .max_tokens = 192}
+    );
+  }
 
-  exit_requested = true;
-  llm_input_queue.push(
-    "%q" // quit token
-  );
+  llm_input_queue.push({
+    .text = "%q", // quit token
+    .session_file = session_file,
+  });
 
   std::cout << "Goodbye!" << std::endl;
 
   llm_t.join();
-  term_size_update_t.join();
 
   return 0;
 }
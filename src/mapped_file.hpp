@@ -0,0 +1,84 @@
+
+#ifdef MAPPED_FILE
+#error "Only include mapped_file.hpp ONCE!"
+#endif
+#define MAPPED_FILE
+
+#include <fstream>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // Linux
+
+// Read-only view of a whole file. mmap'd on linux, read into memory elsewhere.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { close(); }
+
+  bool open(const std::filesystem::path& path) {
+    close();
+#if defined(__linux__)
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+      ::close(fd);
+      return false;
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file alive
+    if (mapping == MAP_FAILED) {
+      return false;
+    }
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    data_ = static_cast<const uint8_t*>(mapping);
+    size_ = st.st_size;
+    return true;
+#else
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+      return false;
+    }
+    buffer_.resize(static_cast<size_t>(in.tellg()));
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char*>(buffer_.data()), buffer_.size())) {
+      buffer_.clear();
+      return false;
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+    return size_ > 0;
+#endif // Linux
+  }
+
+  void close() {
+#if defined(__linux__)
+    if (data_ != nullptr) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+#else
+    buffer_.clear();
+#endif // Linux
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+#if !defined(__linux__)
+  std::vector<uint8_t> buffer_;
+#endif // Linux
+};
+
@@ -0,0 +1,318 @@
+
+#ifdef MEMORY_BUDGET
+#error "Only include memory_budget.hpp ONCE!"
+#endif
+#define MEMORY_BUDGET
+
+// Sizes the process to the memory it can use without swapping.
+//
+// The budget is the smallest of what the memory cgroups we run in still allow
+// (memory.high / memory.max minus what they already hold, cgroup v2 and v1) and
+// MemAvailable, less a margin; MIRROR_GAZE_MEMORY_BUDGET (e.g. "12G", "800M") sets it
+// outright. It is read once, at startup.
+//
+// From the budget, plan_memory() picks:
+// - max_tokens: the KV rows that fit next to the weights, capped at the compiled
+//   kSeqLen. KV memory is only taken as rows are written (kv_cache.hpp), so this bounds
+//   how far a conversation can grow rather than what is allocated; ContextWindow
+//   compacts against it, so a small budget means earlier summaries instead of swapping.
+// - max_generated_tokens: the same 3/8 of max_tokens the flows used to hard-code.
+//
+// That is all the plan chooses: context length. The weights are always read into
+// gemma.cpp's private allocation in full, and the KV cache's precision is gemma.cpp's
+// (float), so neither weight residency nor KV precision is traded for rows here.
+// Flags given on the command line always win over the plan, except in the daemon, whose
+// sessions share one budget (KVTokenAllowance).
+
+// Reads "Key:   123 kB" style fields out of a /proc file.
+size_t read_proc_kb(const char* file, const char* key) {
+  std::ifstream in(file);
+  std::string line;
+  const size_t key_len = strlen(key);
+  while (std::getline(in, line)) {
+    if (line.compare(0, key_len, key) == 0 && line.size() > key_len && line[key_len] == ':') {
+      return std::strtoull(line.c_str() + key_len + 1, nullptr, 10);
+    }
+  }
+  return 0;
+}
+
+// Bytes in "12G", "800M", "64K" or plain "123456"; 0 if unparseable.
+size_t parse_byte_size(const char* text) {
+  char* end = nullptr;
+  const double value = std::strtod(text, &end);
+  if (end == text || value <= 0) {
+    return 0;
+  }
+  double scale = 1;
+  switch (*end) {
+    case 'k': case 'K': scale = 1024.0; break;
+    case 'm': case 'M': scale = 1024.0 * 1024; break;
+    case 'g': case 'G': scale = 1024.0 * 1024 * 1024; break;
+    case 't': case 'T': scale = 1024.0 * 1024 * 1024 * 1024; break;
+  }
+  return static_cast<size_t>(value * scale);
+}
+
+struct MemoryBudget {
+  size_t bytes = 0; // 0: unknown, don't plan
+  const char* source = "none";
+  size_t mem_total_bytes = 0;
+  size_t mem_available_bytes = 0;
+  size_t cgroup_headroom_bytes = 0; // 0: no cgroup limit
+};
+
+// One number out of a cgroup file; 0 for "max", missing files and v1's "unlimited".
+size_t read_cgroup_bytes(const std::filesystem::path& file) {
+  std::ifstream in(file);
+  std::string value;
+  if (!(in >> value) || value == "max") {
+    return 0;
+  }
+  const unsigned long long bytes = std::strtoull(value.c_str(), nullptr, 10);
+  return bytes >= (1ull << 60) ? 0 : static_cast<size_t>(bytes);
+}
+
+// The least room left under any memory limit of the cgroups this process is in and their
+// ancestors, or 0 if none is limited.
+size_t read_cgroup_headroom() {
+#if defined(__linux__)
+  std::ifstream in("/proc/self/cgroup");
+  std::string line;
+  size_t headroom = 0;
+  auto consider = [&headroom](size_t limit, size_t usage) {
+    if (limit > 0) {
+      const size_t room = limit > usage ? limit - usage : 0;
+      headroom = headroom == 0 ? room : std::min(headroom, room);
+    }
+  };
+  while (std::getline(in, line)) {
+    // "hierarchy-ID:controllers:path"; v2 is "0::path", v1 lists "memory" among the controllers.
+    const size_t first = line.find(':');
+    const size_t second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+      continue;
+    }
+    const std::string controllers = line.substr(first + 1, second - first - 1);
+    std::filesystem::path path = line.substr(second + 1);
+    const bool v2 = line.compare(0, first, "0") == 0 && controllers.empty();
+    const bool v1 = ("," + controllers + ",").find(",memory,") != std::string::npos;
+    if (!v1 && !v2) {
+      continue;
+    }
+    const std::filesystem::path root = v2 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/memory";
+    while (true) {
+      const std::filesystem::path dir = root / path.relative_path();
+      if (v2) {
+        const size_t usage = read_cgroup_bytes(dir / "memory.current");
+        consider(read_cgroup_bytes(dir / "memory.high"), usage);
+        consider(read_cgroup_bytes(dir / "memory.max"), usage);
+      } else {
+        consider(read_cgroup_bytes(dir / "memory.limit_in_bytes"),
+                 read_cgroup_bytes(dir / "memory.usage_in_bytes"));
+      }
+      if (path.relative_path().empty()) {
+        break;
+      }
+      path = path.parent_path();
+    }
+  }
+  return headroom;
+#else
+  return 0;
+#endif // Linux
+}
+
+MemoryBudget read_memory_budget() {
+  MemoryBudget budget;
+  budget.mem_total_bytes = read_proc_kb("/proc/meminfo", "MemTotal") * 1024;
+  budget.mem_available_bytes = read_proc_kb("/proc/meminfo", "MemAvailable") * 1024;
+  budget.cgroup_headroom_bytes = read_cgroup_headroom();
+  const char* env_var = std::getenv("MIRROR_GAZE_MEMORY_BUDGET");
+  if (env_var != nullptr && env_var[0] != '\0') {
+    budget.bytes = parse_byte_size(env_var);
+    budget.source = "MIRROR_GAZE_MEMORY_BUDGET";
+    if (budget.bytes > 0) {
+      return budget;
+    }
+    std::cerr << "Ignoring MIRROR_GAZE_MEMORY_BUDGET=" << env_var << "\n";
+  }
+  // What we already hold counts as ours; the margin is for the rest of the system
+  // (the terminal, the page cache of everything else) not to be squeezed to zero.
+  const size_t own_bytes = read_proc_kb("/proc/self/status", "VmRSS") * 1024;
+  if (budget.mem_available_bytes > 0) {
+    budget.bytes = budget.mem_available_bytes + own_bytes;
+    budget.source = "MemAvailable";
+  }
+  if (budget.cgroup_headroom_bytes > 0 &&
+      (budget.bytes == 0 || budget.cgroup_headroom_bytes + own_bytes < budget.bytes)) {
+    budget.bytes = budget.cgroup_headroom_bytes + own_bytes;
+    budget.source = "cgroup";
+  }
+  budget.bytes = budget.bytes / 10 * 9;
+  return budget;
+}
+
+// Read on first use, which is at startup.
+const MemoryBudget& process_memory_budget() {
+  static const MemoryBudget budget = read_memory_budget();
+  return budget;
+}
+
+struct MemoryPlan {
+  size_t budget_bytes = 0; // 0: nothing known, the plan is the compiled maximum
+  size_t weight_bytes = 0;
+  size_t kv_bytes_per_token = 0;
+  size_t max_tokens = 0;
+  size_t max_generated_tokens = 0;
+  size_t kv_room_tokens = 0; // KV rows the budget has room for in all; 0: unknown
+  bool over_budget = false; // not even kMemoryPlanMinTokens fit
+};
+
+constexpr size_t kMemoryPlanMinTokens = 2048;
+constexpr size_t kMemoryPlanTokenStep = 256;
+
+// Memory besides weights and KV rows: activations, the tokenizer, allocator slack.
+size_t memory_plan_reserve(size_t weight_bytes) {
+  return (size_t{512} << 20) + weight_bytes / 16;
+}
+
+MemoryPlan plan_memory(const MemoryBudget& budget, size_t weight_bytes, size_t kv_bytes_per_token,
+                       size_t max_seq_len) {
+  MemoryPlan plan;
+  plan.budget_bytes = budget.bytes;
+  plan.weight_bytes = weight_bytes;
+  plan.kv_bytes_per_token = kv_bytes_per_token;
+  plan.max_tokens = max_seq_len;
+  if (budget.bytes > 0 && kv_bytes_per_token > 0) {
+    const size_t fixed = weight_bytes + memory_plan_reserve(weight_bytes);
+    const size_t kv_room = budget.bytes > fixed ? budget.bytes - fixed : 0;
+    const size_t tokens = kv_room / kv_bytes_per_token / kMemoryPlanTokenStep * kMemoryPlanTokenStep;
+    plan.kv_room_tokens = std::max(tokens, kMemoryPlanMinTokens);
+    plan.over_budget = tokens < kMemoryPlanMinTokens;
+    plan.max_tokens = std::min(max_seq_len, std::max(tokens, kMemoryPlanMinTokens));
+  }
+  plan.max_generated_tokens = plan.max_tokens * 3 / 8;
+  return plan;
+}
+
+// The plan for one model's weights file and KV cache, plus the optional 2b models that
+// run next to it, each with its own KV cache (the small model of a cascade; nullptr if
+// not loaded).
+MemoryPlan plan_memory_for_model(const std::string& weights_path, gcpp::Model model_type,
+                                 std::initializer_list<const char*> companion_weights_paths) {
+  std::error_code ec;
+  size_t weight_bytes = std::filesystem::file_size(weights_path, ec);
+  if (ec) {
+    weight_bytes = 0;
+  }
+  const KVCacheLayout layout = kv_cache_layout(model_type);
+  size_t kv_bytes_per_token = 2 * layout.floats_per_pos * sizeof(float);
+  for (const char* companion_weights_path : companion_weights_paths) {
+    if (companion_weights_path == nullptr) {
+      continue;
+    }
+    const size_t companion_bytes = std::filesystem::file_size(companion_weights_path, ec);
+    if (!ec) {
+      weight_bytes += companion_bytes;
+      kv_bytes_per_token += 2 * kv_cache_layout(gcpp::Model::GEMMA_2B).floats_per_pos * sizeof(float);
+    }
+  }
+  return plan_memory(process_memory_budget(), weight_bytes, kv_bytes_per_token,
+                     layout.seq_len - gcpp::kPrefillBatchSize);
+}
+
+// Sets max_tokens / max_generated_tokens from the plan where argv doesn't.
+void apply_memory_plan(const MemoryPlan& plan, gcpp::InferenceArgs& inference, int argc, char** argv,
+                       int verbosity) {
+  auto given = [argc, argv](const char* flag) {
+    return std::any_of(argv, argv + argc, [flag](const char* arg) { return strcmp(arg, flag) == 0; });
+  };
+  if (!given("--max_tokens")) {
+    inference.max_tokens = plan.max_tokens;
+  } else if (inference.max_tokens > plan.max_tokens && verbosity >= 1) {
+    std::cerr << "--max_tokens " << inference.max_tokens << " is past the " << plan.max_tokens
+              << " tokens the memory budget covers\n";
+  }
+  if (!given("--max_generated_tokens")) {
+    inference.max_generated_tokens = std::min<size_t>(plan.max_generated_tokens, inference.max_tokens * 3 / 8);
+  } else if (inference.max_generated_tokens > inference.max_tokens) {
+    inference.max_generated_tokens = inference.max_tokens * 3 / 8;
+  }
+}
+
+// The KV rows of a plan shared out between the sessions of a daemon, each of which may
+// grow its conversation to max_tokens: sessions reserve their max_tokens up front, so
+// however many there are, their KV caches together stay inside the one budget.
+class KVTokenAllowance {
+ public:
+  explicit KVTokenAllowance(const MemoryPlan& plan) : free_(plan.kv_room_tokens), limited_(plan.kv_room_tokens > 0) {}
+
+  // Takes wanted tokens, or as many as are left if that is at least min_tokens. Returns
+  // what was taken, 0 (taking nothing) when not even min_tokens are left.
+  size_t Reserve(size_t wanted, size_t min_tokens) {
+    if (!limited_) {
+      return wanted;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t tokens = std::min(wanted, free_ / kMemoryPlanTokenStep * kMemoryPlanTokenStep);
+    if (tokens < std::min(wanted, min_tokens)) {
+      return 0;
+    }
+    free_ -= tokens;
+    return tokens;
+  }
+
+  void Release(size_t tokens) {
+    if (limited_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_ += tokens;
+    }
+  }
+
+  bool limited() const { return limited_; }
+
+ private:
+  std::mutex mutex_;
+  size_t free_;
+  const bool limited_;
+};
+
+void print_memory_plan(const MemoryPlan& plan) {
+  const MemoryBudget& budget = process_memory_budget();
+  if (plan.budget_bytes == 0) {
+    std::cout << "Memory budget unknown, " << plan.max_tokens << " tokens of context\n";
+    return;
+  }
+  std::cout << "Memory budget " << plan.budget_bytes / (1024 * 1024) << " MiB (" << budget.source
+            << "): " << plan.weight_bytes / (1024 * 1024) << " MiB of weights, "
+            << plan.max_tokens << " tokens of context at "
+            << plan.kv_bytes_per_token / 1024 << " KiB each\n";
+}
+
+// Live RSS against the budget, for the per-response stats.
+void print_memory_use() {
+  const size_t budget_mib = process_memory_budget().bytes / (1024 * 1024);
+  std::cout << read_proc_kb("/proc/self/status", "VmRSS") / 1024 << " MiB resident";
+  if (budget_mib > 0) {
+    std::cout << " of a " << budget_mib << " MiB budget";
+  }
+  std::cout << "\n";
+}
+
+// Once per crossing: resident memory went over the budget, so the system is likely to
+// start swapping.
+void warn_if_over_memory_budget() {
+  static std::atomic<bool> over{false};
+  const size_t budget = process_memory_budget().bytes;
+  const size_t rss = read_proc_kb("/proc/self/status", "VmRSS") * 1024;
+  if (budget == 0 || rss == 0) {
+    return;
+  }
+  if (rss > budget && !over.exchange(true)) {
+    std::cerr << "Resident memory " << rss / (1024 * 1024) << " MiB is over the "
+              << budget / (1024 * 1024) << " MiB memory budget\n";
+  } else if (rss <= budget) {
+    over = false;
+  }
+}
@@ -0,0 +1,68 @@
+
+#ifdef MODEL_CASCADE
+#error "Only include model_cascade.hpp ONCE!"
+#endif
+#define MODEL_CASCADE
+
+// A small model resident next to the main one, for the prompts that don't need the
+// large model (GEMMA_SMALL_MODEL_SBS_FILE, e.g. a 2b next to a 7b).
+//
+// A tasker session mixes one-line greetings and goodbyes with planning and how-to
+// prompts, and used to answer all of them with the large model. With a small model
+// loaded, each prompt goes to one of the two: the LlmPrompt says which with its tier,
+// or leaves it to route_to_small_model(). Each model gets its own ReplGemma loop and KV
+// cache (see run_model_cascade in main.cpp); they share the thread pool and take turns
+// on it through a SliceScheduler, the way daemon sessions share a model.
+//
+// Multiturn conversations always stay on the large model, whatever the tier: their
+// history lives in its KV cache and the small model has never seen it.
+//
+// MIRROR_GAZE_CASCADE=off ignores GEMMA_SMALL_MODEL_SBS_FILE. 'mirror-gaze bench cascade'
+// times the scripted flows with and without it.
+
+enum class ModelTier : uint8_t {
+  kAuto,  // route_to_small_model() decides
+  kSmall, // latency over quality
+  kLarge, // quality over latency
+};
+
+// Prompts whose response budget is at most this many tokens count as light work.
+constexpr size_t kCascadeSmallMaxTokens = 256;
+
+// The small model's weights, or nullptr if the cascade is off.
+const char* cascade_small_model_file() {
+  const char* mode = std::getenv("MIRROR_GAZE_CASCADE");
+  if (mode != nullptr && strcmp(mode, "off") == 0) {
+    return nullptr;
+  }
+  const char* file = std::getenv("GEMMA_SMALL_MODEL_SBS_FILE");
+  return file != nullptr && file[0] != '\0' ? file : nullptr;
+}
+
+// The policy for kAuto: short responses without a grammar go to the small model.
+// Grammars are left to the large model because a small model more often walks into a
+// dead end of one and ends up with a forced, poor answer.
+bool route_to_small_model(ModelTier tier, const StopConditions& stop, const std::string& grammar,
+                          bool multiturn) {
+  if (multiturn) {
+    return false;
+  }
+  switch (tier) {
+    case ModelTier::kSmall: return true;
+    case ModelTier::kLarge: return false;
+    case ModelTier::kAuto: break;
+  }
+  return stop.max_tokens > 0 && stop.max_tokens <= kCascadeSmallMaxTokens && grammar.empty();
+}
+
+struct CascadeStats {
+  size_t small_prompts = 0;
+  size_t large_prompts = 0;
+  double small_seconds = 0; // prompt handed over -> end of response
+  double large_seconds = 0;
+};
+
+void print_cascade_stats(const CascadeStats& stats) {
+  std::cout << stats.small_prompts << " prompts answered by the small model in " << stats.small_seconds
+            << " s, " << stats.large_prompts << " by the large model in " << stats.large_seconds << " s\n";
+}
@@ -0,0 +1,220 @@
+
+#ifdef OUTPUT_FILTER
+#error "Only include output_filter.hpp ONCE!"
+#endif
+#define OUTPUT_FILTER
+
+// Single-pass clean-up of model responses while they stream in.
+//
+// Each stage is a small state machine that looks at every byte exactly once, and
+// copies runs of bytes it has no interest in straight through. A stage
+// may hold a few bytes back until it knows what they are (a '*' that might be the start
+// of "**", a '"' that might close the response), but never more than a bounded amount,
+// so text reaches the screen as soon as it is unambiguous. Whatever the pipeline emits
+// is exactly what is both printed and returned to the caller.
+
+class OutputFilterStage {
+ public:
+  virtual ~OutputFilterStage() = default;
+  // Appends the filtered form of `in` to `out`.
+  virtual void Push(std::string_view in, std::string& out) = 0;
+  // End of response: appends anything still held back and resets for the next response.
+  virtual void Finish(std::string& out) = 0;
+};
+
+// Removes markdown emphasis: any run of two or more '*', and a single '*' that touches
+// a word ("*word*"). A lone '*' with whitespace on both sides (a "* " bullet, "2 * 3")
+// is kept.
+class MarkdownStripStage : public OutputFilterStage {
+ public:
+  void Push(std::string_view in, std::string& out) override {
+    while (in.size() > 0) {
+      if (in[0] == '*') {
+        stars_ += 1;
+        in.remove_prefix(1);
+        continue;
+      }
+      const bool space = in[0] == ' ' || in[0] == '\t' || in[0] == '\n';
+      if (stars_ == 1 && after_space_ && space) {
+        out += '*';
+      }
+      stars_ = 0;
+      const size_t run = std::min(in.size(), in.find('*'));
+      out.append(in.data(), run);
+      const char last = in[run - 1];
+      after_space_ = last == ' ' || last == '\t' || last == '\n';
+      in.remove_prefix(run);
+    }
+  }
+
+  void Finish(std::string& out) override {
+    (void)out; // trailing stars are emphasis closers
+    stars_ = 0;
+    after_space_ = true;
+  }
+
+ private:
+  size_t stars_ = 0;
+  bool after_space_ = true; // the byte before the current run of '*' was whitespace
+};
+
+// Removes a '"' wrapped around the whole response: the first non-whitespace byte, and -
+// only if that one was removed - a '"' that turns out to be the last non-whitespace byte.
+class QuoteTrimStage : public OutputFilterStage {
+ public:
+  void Push(std::string_view in, std::string& out) override {
+    if (seen_text_ && !opened_with_quote_) {
+      out.append(in.data(), in.size()); // nothing left to trim in this response
+      return;
+    }
+    for (char c : in) {
+      const bool space = c == ' ' || c == '\t' || c == '\n';
+      if (!seen_text_) {
+        if (space) {
+          out += c;
+          continue;
+        }
+        seen_text_ = true;
+        if (c == '"') {
+          opened_with_quote_ = true;
+          continue;
+        }
+      }
+      if (held_.size() > 0) {
+        if (space && held_.size() < kMaxHeld) {
+          held_ += c;
+          continue;
+        }
+        out += held_; // the quote wasn't the last thing after all
+        held_.clear();
+      }
+      if (opened_with_quote_ && c == '"') {
+        held_ += c;
+        continue;
+      }
+      out += c;
+    }
+  }
+
+  void Finish(std::string& out) override {
+    (void)out; // a held quote (plus whitespace after it) closes the response: drop it
+    held_.clear();
+    seen_text_ = false;
+    opened_with_quote_ = false;
+  }
+
+ private:
+  static constexpr size_t kMaxHeld = 64;
+  bool seen_text_ = false;
+  bool opened_with_quote_ = false;
+  std::string held_;
+};
+
+// Drops whitespace at the start and end of the response and spaces at the end of lines,
+// and limits blank lines to one in a row.
+class WhitespaceStage : public OutputFilterStage {
+ public:
+  void Push(std::string_view in, std::string& out) override {
+    while (in.size() > 0) {
+      const char c = in[0];
+      if (c == ' ' || c == '\t') {
+        if (seen_text_) {
+          spaces_ += c;
+          if (spaces_.size() >= kMaxHeld) {
+            FlushHeld(out);
+          }
+        }
+        in.remove_prefix(1);
+        continue;
+      }
+      if (c == '\n') {
+        spaces_.clear(); // trailing spaces on a line
+        newlines_ += seen_text_ ? 1 : 0;
+        in.remove_prefix(1);
+        continue;
+      }
+      FlushHeld(out);
+      seen_text_ = true;
+      const size_t run = std::min(in.size(), in.find_first_of(" \t\n"));
+      out.append(in.data(), run);
+      in.remove_prefix(run);
+    }
+  }
+
+  void Finish(std::string& out) override {
+    (void)out; // held whitespace is trailing whitespace
+    spaces_.clear();
+    newlines_ = 0;
+    seen_text_ = false;
+  }
+
+ private:
+  void FlushHeld(std::string& out) {
+    out.append(std::min<size_t>(newlines_, 2), '\n');
+    out += spaces_;
+    newlines_ = 0;
+    spaces_.clear();
+  }
+
+  static constexpr size_t kMaxHeld = 256;
+  bool seen_text_ = false;
+  size_t newlines_ = 0;
+  std::string spaces_;
+};
+
+class OutputFilter {
+ public:
+  OutputFilter() = default;
+  OutputFilter(OutputFilter&&) = default;
+
+  // The clean-up applied to every response shown to the user.
+  static OutputFilter Default() {
+    OutputFilter filter;
+    filter.Add(std::make_unique<MarkdownStripStage>());
+    filter.Add(std::make_unique<QuoteTrimStage>());
+    filter.Add(std::make_unique<WhitespaceStage>());
+    return filter;
+  }
+
+  void Add(std::unique_ptr<OutputFilterStage> stage) {
+    stages_.push_back(std::move(stage));
+  }
+
+  // Returns the filtered bytes that are final so far. Valid until the next call.
+  std::string_view Push(std::string_view text) {
+    return Run([text](OutputFilterStage& stage, std::string& out) { stage.Push(text, out); },
+               /*finish=*/false);
+  }
+
+  // Returns whatever the stages were still holding, and resets them for the next response.
+  std::string_view Finish() {
+    return Run([](OutputFilterStage& stage, std::string& out) { stage.Finish(out); },
+               /*finish=*/true);
+  }
+
+ private:
+  // Feeds the first stage with `first`, then each stage's output into the next one.
+  template <typename First>
+  std::string_view Run(const First& first, bool finish) {
+    if (stages_.size() < 1) {
+      return std::string_view();
+    }
+    scratch_[0].clear();
+    first(*stages_[0], scratch_[0]);
+    size_t current = 0;
+    for (size_t i = 1; i < stages_.size(); i += 1) {
+      std::string& next = scratch_[1 - current];
+      next.clear();
+      stages_[i]->Push(scratch_[current], next);
+      if (finish) {
+        stages_[i]->Finish(next);
+      }
+      current = 1 - current;
+    }
+    return scratch_[current];
+  }
+
+  std::vector<std::unique_ptr<OutputFilterStage>> stages_;
+  std::string scratch_[2];
+};
+
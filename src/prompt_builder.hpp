@@ -0,0 +1,129 @@
+
+#ifdef PROMPT_BUILDER
+#error "Only include prompt_builder.hpp ONCE!"
+#endif
+#define PROMPT_BUILDER
+
+#include <unordered_map>
+
+// Builds prompts as token vectors instead of strings, so SentencePiece only ever sees
+// text it hasn't seen before.
+//
+// - The chat template's control segments are tokenized once, when the builder is made.
+// - Text is tokenized a line at a time (a line ends after its run of newlines) and
+//   each line is cached by content hash. A response that comes back inside a later
+//   prompt, or a shared prefix sent with every step of the tasker, costs a hash lookup
+//   per line after the first time.
+//
+// Lines are tokenized independently, so a token spanning a line break can't form; the
+// same holds at the template boundaries and at the split KVPrefixCache already makes
+// between a shared prefix and the rest of the prompt. The model sees the same text
+// either way.
+
+constexpr int kGemmaBosId = 2; // "<bos>"
+
+class PromptBuilder {
+ public:
+  static constexpr size_t kMaxCachedTokens = 1 << 16;
+
+  struct Stats {
+    size_t lines_encoded = 0;
+    size_t lines_reused = 0;
+    size_t bytes_encoded = 0;
+    size_t bytes_reused = 0;
+  };
+
+  explicit PromptBuilder(const gcpp::GemmaTokenizer* tokenizer) : tokenizer_(tokenizer) {
+    HWY_ASSERT(tokenizer_->Encode("<start_of_turn>user\n", &user_turn_));
+    HWY_ASSERT(tokenizer_->Encode("<end_of_turn>\n", &end_of_turn_));
+    HWY_ASSERT(tokenizer_->Encode("<end_of_turn>\n<start_of_turn>model\n", &model_turn_));
+  }
+
+  // "<start_of_turn>user\n", closing the previous model turn first if continuation.
+  void AppendUserTurn(std::vector<int>& out, bool continuation) const {
+    if (continuation) {
+      out.insert(out.end(), end_of_turn_.begin(), end_of_turn_.end());
+    }
+    out.insert(out.end(), user_turn_.begin(), user_turn_.end());
+  }
+
+  // Closes the user turn and opens the model's.
+  void AppendModelTurn(std::vector<int>& out) const {
+    out.insert(out.end(), model_turn_.begin(), model_turn_.end());
+  }
+
+  void AppendText(std::vector<int>& out, std::string_view text) {
+    while (text.size() > 0) {
+      size_t end = text.find('\n');
+      end = end == std::string_view::npos ? text.size() : text.find_first_not_of('\n', end);
+      end = end == std::string_view::npos ? text.size() : end;
+      AppendLine(out, text.substr(0, end));
+      text.remove_prefix(end);
+    }
+  }
+
+  // The token a model turn ends with, "<end_of_turn>".
+  int end_of_turn_id() const { return end_of_turn_.front(); }
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct CachedLine {
+    std::string text;
+    std::vector<int> tokens;
+    uint64_t last_use = 0;
+  };
+
+  void AppendLine(std::vector<int>& out, std::string_view line) {
+    use_ += 1;
+    const uint64_t key = fnv1a64(line.data(), line.size());
+    auto it = lines_.find(key);
+    if (it != lines_.end() && it->second.text == line) {
+      it->second.last_use = use_;
+      out.insert(out.end(), it->second.tokens.begin(), it->second.tokens.end());
+      stats_.lines_reused += 1;
+      stats_.bytes_reused += line.size();
+      return;
+    }
+
+    CachedLine entry = {.text = std::string(line), .last_use = use_};
+    HWY_ASSERT(tokenizer_->Encode(entry.text, &entry.tokens));
+    out.insert(out.end(), entry.tokens.begin(), entry.tokens.end());
+    stats_.lines_encoded += 1;
+    stats_.bytes_encoded += line.size();
+    if (it != lines_.end()) {
+      cached_tokens_ -= it->second.tokens.size(); // hash collision: the newer line wins
+    }
+    cached_tokens_ += entry.tokens.size();
+    lines_[key] = std::move(entry);
+    while (cached_tokens_ > kMaxCachedTokens && lines_.size() > 1) {
+      EvictLeastRecentlyUsed();
+    }
+  }
+
+  void EvictLeastRecentlyUsed() {
+    auto oldest = lines_.begin();
+    for (auto it = lines_.begin(); it != lines_.end(); ++it) {
+      if (it->second.last_use < oldest->second.last_use) {
+        oldest = it;
+      }
+    }
+    cached_tokens_ -= oldest->second.tokens.size();
+    lines_.erase(oldest);
+  }
+
+  const gcpp::GemmaTokenizer* tokenizer_;
+  std::vector<int> user_turn_;
+  std::vector<int> end_of_turn_;
+  std::vector<int> model_turn_;
+  std::unordered_map<uint64_t, CachedLine> lines_;
+  size_t cached_tokens_ = 0;
+  uint64_t use_ = 0;
+  Stats stats_;
+};
+
+void print_prompt_builder_stats(const PromptBuilder::Stats& stats) {
+  std::cout << stats.lines_reused << " of " << stats.lines_reused + stats.lines_encoded
+            << " prompt lines reused already tokenized (" << stats.bytes_reused << " bytes; "
+            << stats.bytes_encoded << " bytes sent to the tokenizer)\n";
+}
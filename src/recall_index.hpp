@@ -0,0 +1,424 @@
+
+#ifdef RECALL_INDEX
+#error "Only include recall_index.hpp ONCE!"
+#endif
+#define RECALL_INDEX
+
+// Long-term memory: past user turns, kept on disk and searched by similarity, so a new
+// session can be reminded of the few that matter instead of replaying whole transcripts.
+// What gets injected is capped in bytes, so the prefill it costs stays the same however
+// many turns the index holds.
+//
+// Turns are embedded with the model's own input embedding table when build.py could patch
+// an accessor for its rows into gemma.cpp (GEMMA_EMBEDDING_ROWS): the turn's content
+// words are tokenized and their rows mean-pooled, so turns that say the same thing in
+// other words can still find each other.
+// The accessor only appears with the model's first forward pass; until then, and in
+// builds without it, a turn is embedded as a hashed bag of words (unigrams and bigrams,
+// signed feature hashing into kRecallDims dimensions), which only finds shared words.
+// Either way the embedding is normalized, so a dot product is the cosine similarity.
+//
+// Two files per index, both readable by this user only: <name>.recall holds a header
+// (which embedding, how many dims) and fixed-size records (the embedding as bf16, plus
+// where the text is), and is mmap'd and scanned with Highway; <name>.recall-text holds the
+// turns' text, read back for the hits. Both are append-only; a record torn by a crash is
+// ignored. The text is all the index needs, so when the embedding in use differs from the
+// one in the header, every turn is embedded again and <name>.recall rewritten.
+
+constexpr uint32_t kRecallVersion = 2;
+constexpr size_t kRecallDims = 1024; // of the hashed bag of words
+
+constexpr uint32_t kRecallHashedWords = 0;
+constexpr uint32_t kRecallModelRows = 1;
+
+struct RecallEmbedding {
+  uint32_t kind;
+  uint32_t dims;
+
+  bool operator==(const RecallEmbedding& other) const {
+    return kind == other.kind && dims == other.dims;
+  }
+};
+
+// Followed by the embedding, dims bf16.
+struct RecallRecord {
+  uint64_t text_offset;
+  uint32_t text_bytes;
+  uint32_t unix_seconds;
+};
+
+// The tokenizer of the model the LLM thread has loaded (see Run), nullptr before and after.
+std::atomic<const gcpp::GemmaTokenizer*> recall_tokenizer{nullptr};
+
+// The embedding turns get right now.
+RecallEmbedding recall_embedding_in_use() {
+#if defined(GEMMA_EMBEDDING_ROWS)
+  if (recall_tokenizer.load(std::memory_order_acquire) != nullptr &&
+      gcpp::embedding_row_ready.load(std::memory_order_acquire)) {
+    return {kRecallModelRows, static_cast<uint32_t>(gcpp::embedding_row_dim)};
+  }
+#endif
+  return {kRecallHashedWords, kRecallDims};
+}
+
+// Calls visit(word) for every lowercased word of text worth matching on.
+template <typename Visit>
+void for_each_recall_word(const std::string& text, const Visit& visit) {
+  static const char* const kStopWords[] = {
+      "the", "and", "you", "that", "with", "for", "was", "have", "but", "this", "are", "not",
+      "what", "just", "about", "they", "there", "from", "been", "would", "could", "its", "it's",
+      "i'm", "really", "very", "like", "how", "can", "all", "when", "your", "has", "had"};
+  std::string word;
+  for (size_t i = 0; i <= text.size(); i += 1) {
+    const unsigned char c = i < text.size() ? text[i] : ' ';
+    if (std::isalnum(c) || c == '\'' || c >= 0x80) {
+      word += static_cast<char>(std::tolower(c));
+      continue;
+    }
+    if (word.size() >= 3 &&
+        std::none_of(std::begin(kStopWords), std::end(kStopWords), [&word](const char* s) { return word == s; })) {
+      visit(word);
+    }
+    word.clear();
+  }
+}
+
+void recall_normalize(float* v, size_t n) {
+  float norm = 0;
+  for (size_t i = 0; i < n; i += 1) {
+    norm += v[i] * v[i];
+  }
+  if (norm > 0) {
+    const float inv_norm = 1.0f / std::sqrt(norm);
+    for (size_t i = 0; i < n; i += 1) {
+      v[i] *= inv_norm;
+    }
+  }
+}
+
+// Writes the unit-length embedding of text to out[embedding.dims]; all zeros if text
+// has no words to match on.
+void recall_embed(const std::string& text, const RecallEmbedding& embedding, float* out) {
+  std::fill(out, out + embedding.dims, 0.0f);
+#if defined(GEMMA_EMBEDDING_ROWS)
+  if (embedding.kind == kRecallModelRows) {
+    std::string words;
+    for_each_recall_word(text, [&words](const std::string& word) {
+      words += words.empty() ? word : " " + word;
+    });
+    std::vector<int> tokens;
+    const gcpp::GemmaTokenizer* tokenizer = recall_tokenizer.load(std::memory_order_acquire);
+    if (words.empty() || tokenizer == nullptr || !tokenizer->Encode(words, &tokens)) {
+      return;
+    }
+    // Mean-pooled, but the mean only differs from the sum in length.
+    std::vector<float> row(embedding.dims);
+    for (int token : tokens) {
+      gcpp::embedding_row(token, row.data());
+      for (size_t i = 0; i < row.size(); i += 1) {
+        out[i] += row[i];
+      }
+    }
+    recall_normalize(out, embedding.dims);
+    return;
+  }
+#endif
+  uint64_t previous_word = 0;
+  auto add_feature = [out](uint64_t hash, float weight) {
+    out[hash % kRecallDims] += (hash >> 63) != 0 ? weight : -weight;
+  };
+  for_each_recall_word(text, [&](const std::string& word) {
+    const uint64_t hash = fnv1a64(word);
+    add_feature(hash, 1.0f);
+    if (previous_word != 0) {
+      add_feature(fnv1a64(&hash, sizeof(hash), previous_word), 0.5f);
+    }
+    previous_word = hash;
+  });
+  recall_normalize(out, embedding.dims);
+}
+
+// Set by a front end that searches a RecallIndex, before it starts the LLM thread.
+std::atomic<bool> recall_wants_model_rows{false};
+
+// The model's rows only appear with its first forward pass, which a session whose opening
+// state comes from disk doesn't run until after its first recall. This runs one: <bos> at
+// position 0, the row every session starts with.
+void recall_install_model_rows(gcpp::Gemma& model, gcpp::KVCache& kv_cache, hwy::ThreadPool& pool) {
+#if defined(GEMMA_EMBEDDING_ROWS)
+  if (gcpp::embedding_row_ready.load(std::memory_order_acquire)) {
+    return;
+  }
+  std::mt19937 throwaway_gen(0);
+  gcpp::StreamFunc stop = [](int, float) { return false; };
+  gcpp::AcceptFunc accept_all = [](int) { return true; };
+  gcpp::RuntimeConfig runtime_config = {
+      .max_tokens = 2,
+      .max_generated_tokens = 1,
+      .temperature = 1.0f,
+      .verbosity = 0,
+      .gen = &throwaway_gen,
+      .stream_token = stop,
+      .accept_token = accept_all,
+  };
+  gcpp::TimingInfo timing_info;
+  GenerateGemma(model, runtime_config, {kGemmaBosId}, /*start_pos=*/0, kv_cache, pool, timing_info);
+#else
+  (void)model, (void)kv_cache, (void)pool;
+#endif
+}
+
+// How similar a past turn has to be to count as a hit. Unrelated texts still share a
+// direction in the model's embedding table, so its cosines run higher.
+float recall_min_score(const RecallEmbedding& embedding) {
+  return embedding.kind == kRecallModelRows ? 0.6f : 0.25f;
+}
+
+// Creates path readable and writable by this user only, or takes everyone else's access
+// away if it exists.
+void recall_create_private_file(const std::filesystem::path& path) {
+#if defined(__linux__)
+  const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (fd >= 0) {
+    fchmod(fd, 0600);
+    ::close(fd);
+  }
+#else
+  std::ofstream(path, std::ios::binary | std::ios::app);
+  std::error_code ec;
+  std::filesystem::permissions(path, std::filesystem::perms::owner_read | std::filesystem::perms::owner_write, ec);
+#endif // Linux
+}
+
+namespace recall_simd {
+namespace hn = hwy::HWY_NAMESPACE;
+
+float Dot(const hwy::bfloat16_t* HWY_RESTRICT row, const float* HWY_RESTRICT query, size_t n) {
+  const hn::ScalableTag<float> df;
+  const hn::Rebind<hwy::bfloat16_t, decltype(df)> dbf;
+  const size_t N = hn::Lanes(df);
+  auto sum = hn::Zero(df);
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    sum = hn::MulAdd(hn::PromoteTo(df, hn::LoadU(dbf, row + i)), hn::LoadU(df, query + i), sum);
+  }
+  float dot = hn::ReduceSum(df, sum);
+  for (; i < n; i += 1) {
+    dot += hwy::F32FromBF16(row[i]) * query[i];
+  }
+  return dot;
+}
+
+}  // namespace recall_simd
+
+class RecallIndex {
+ public:
+  struct Hit {
+    float score;
+    size_t index;
+  };
+
+  // path without extension, e.g. <cache dir>/therapist-<user>
+  explicit RecallIndex(std::filesystem::path path) {
+    index_path_ = path;
+    index_path_ += ".recall";
+    text_path_ = path;
+    text_path_ += ".recall-text";
+    Map();
+  }
+
+  size_t size() const { return count_; }
+
+  void Add(const std::string& text) {
+    if (text.empty() || incompatible_) {
+      return;
+    }
+    const RecallEmbedding embedding = recall_embedding_in_use();
+    if (!Reembed(embedding)) {
+      return;
+    }
+    std::vector<float> values(embedding.dims);
+    recall_embed(text, embedding, values.data());
+    std::error_code ec;
+    std::filesystem::create_directories(index_path_.parent_path(), ec);
+    recall_create_private_file(text_path_);
+    recall_create_private_file(index_path_);
+    RecallRecord record = {};
+    record.text_offset = std::filesystem::file_size(text_path_, ec);
+    record.text_bytes = static_cast<uint32_t>(text.size());
+    record.unix_seconds = static_cast<uint32_t>(std::time(nullptr));
+    if (ec) {
+      return;
+    }
+    // Text first: a record never points past the end of the text file.
+    std::ofstream(text_path_, std::ios::binary | std::ios::app) << text;
+    const bool new_index = !mapped_;
+    if (!new_index) {
+      // Drop a record torn by a crash, or every record after it would be misaligned.
+      std::filesystem::resize_file(index_path_, header_bytes_ + count_ * record_bytes_, ec);
+    }
+    std::ofstream out(index_path_, std::ios::binary | (new_index ? std::ios::trunc : std::ios::app));
+    if (new_index) {
+      WriteHeader(out, embedding);
+    }
+    WriteRecord(out, record, values.data(), embedding.dims);
+    out.close();
+    Map();
+  }
+
+  // The k most similar past turns scoring at least min_score, best first.
+  std::vector<Hit> Search(const std::string& query, size_t k, float min_score) {
+    std::vector<Hit> hits;
+    if (count_ == 0 || incompatible_) {
+      return hits;
+    }
+    Reembed(recall_embedding_in_use());
+    std::vector<float> values(embedding_.dims);
+    recall_embed(query, embedding_, values.data());
+    hits.reserve(count_);
+    for (size_t i = 0; i < count_; i += 1) {
+      const float score = recall_simd::Dot(embedding_values(i), values.data(), embedding_.dims);
+      if (score >= min_score) {
+        hits.push_back({score, i});
+      }
+    }
+    const size_t keep = std::min(k, hits.size());
+    std::partial_sort(hits.begin(), hits.begin() + keep, hits.end(),
+                      [](const Hit& a, const Hit& b) { return a.score > b.score; });
+    hits.resize(keep);
+    return hits;
+  }
+
+  std::string Text(size_t index) const {
+    return ReadText(record(index));
+  }
+
+  // The most similar past turns to query, best first, within max_bytes of text in total.
+  std::vector<std::string> Recall(const std::string& query, size_t k, size_t max_bytes) {
+    std::vector<std::string> snippets;
+    size_t bytes = 0;
+    Reembed(recall_embedding_in_use());
+    for (const Hit& hit : Search(query, k, recall_min_score(embedding_))) {
+      std::string text = Text(hit.index);
+      if (text.empty() || bytes + text.size() > max_bytes) {
+        continue;
+      }
+      bytes += text.size();
+      snippets.push_back(std::move(text));
+    }
+    return snippets;
+  }
+
+ private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dims;
+    uint32_t kind;
+    uint32_t reserved;
+  };
+  // Version 1 had no kind (always the hashed bag of words), so a 16 byte header.
+  static constexpr size_t kVersion1HeaderBytes = 16;
+
+  const RecallRecord& record(size_t index) const {
+    return *reinterpret_cast<const RecallRecord*>(file_.data() + header_bytes_ + index * record_bytes_);
+  }
+
+  const hwy::bfloat16_t* embedding_values(size_t index) const {
+    return reinterpret_cast<const hwy::bfloat16_t*>(&record(index) + 1);
+  }
+
+  std::string ReadText(const RecallRecord& r) const {
+    std::string text(r.text_bytes, '\0');
+    std::ifstream in(text_path_, std::ios::binary);
+    if (!in.seekg(r.text_offset) || !in.read(text.data(), text.size())) {
+      return "";
+    }
+    return text;
+  }
+
+  static void WriteHeader(std::ofstream& out, const RecallEmbedding& embedding) {
+    const Header header = {{'M', 'G', 'R', 'E', 'C', 'A', 'L', 'L'}, kRecallVersion, embedding.dims,
+                           embedding.kind, 0};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+
+  static void WriteRecord(std::ofstream& out, const RecallRecord& record, const float* values, size_t dims) {
+    std::vector<hwy::bfloat16_t> bf16(dims);
+    for (size_t i = 0; i < dims; i += 1) {
+      bf16[i] = hwy::BF16FromF32(values[i]);
+    }
+    out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    out.write(reinterpret_cast<const char*>(bf16.data()), bf16.size() * sizeof(hwy::bfloat16_t));
+  }
+
+  // Rewrites the index with every turn embedded as embedding, if it isn't already. False
+  // if that failed, leaving the index as it was.
+  bool Reembed(const RecallEmbedding& embedding) {
+    if (!mapped_ || (header_bytes_ == sizeof(Header) && embedding_ == embedding)) {
+      return true;
+    }
+    std::vector<RecallRecord> records(count_);
+    for (size_t i = 0; i < count_; i += 1) {
+      records[i] = record(i);
+    }
+    const std::filesystem::path tmp_path = unique_temp_path(index_path_);
+    recall_create_private_file(tmp_path);
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    WriteHeader(out, embedding);
+    std::vector<float> values(embedding.dims);
+    for (const RecallRecord& r : records) {
+      const std::string text = ReadText(r);
+      if (text.empty()) {
+        continue;
+      }
+      recall_embed(text, embedding, values.data());
+      WriteRecord(out, r, values.data(), embedding.dims);
+    }
+    out.close();
+    std::error_code ec;
+    if (out.fail()) {
+      std::filesystem::remove(tmp_path, ec);
+      return false;
+    }
+    std::filesystem::rename(tmp_path, index_path_, ec);
+    if (ec) {
+      std::filesystem::remove(tmp_path, ec);
+      return false;
+    }
+    Map();
+    return true;
+  }
+
+  void Map() {
+    count_ = 0;
+    mapped_ = false;
+    if (!file_.open(index_path_) || file_.size() < kVersion1HeaderBytes) {
+      file_.close();
+      return;
+    }
+    const Header& header = *reinterpret_cast<const Header*>(file_.data());
+    const bool known_version = header.version == 1 || (header.version == kRecallVersion && file_.size() >= sizeof(Header));
+    if (memcmp(header.magic, "MGRECALL", sizeof(header.magic)) != 0 || !known_version) {
+      std::cerr << "Ignoring " << index_path_.string() << ", it is from another version\n";
+      incompatible_ = true; // and left alone rather than appended to
+      file_.close();
+      return;
+    }
+    header_bytes_ = header.version == 1 ? kVersion1HeaderBytes : sizeof(Header);
+    embedding_ = {header.version == 1 ? kRecallHashedWords : header.kind, header.dims};
+    record_bytes_ = sizeof(RecallRecord) + embedding_.dims * sizeof(hwy::bfloat16_t);
+    count_ = (file_.size() - header_bytes_) / record_bytes_;
+    mapped_ = true;
+  }
+
+  std::filesystem::path index_path_;
+  std::filesystem::path text_path_;
+  MappedFile file_;
+  bool mapped_ = false;
+  size_t header_bytes_ = sizeof(Header);
+  size_t record_bytes_ = 0;
+  RecallEmbedding embedding_ = {kRecallHashedWords, kRecallDims}; // of the mapped records
+  size_t count_ = 0;
+  bool incompatible_ = false;
+};
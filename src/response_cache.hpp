@@ -0,0 +1,246 @@
+
+#ifdef RESPONSE_CACHE
+#error "Only include response_cache.hpp ONCE!"
+#endif
+#define RESPONSE_CACHE
+
+// Responses to deterministic prompts, kept on disk and replayed instead of regenerated.
+//
+// With --deterministic, what the model streams for a prompt is a pure function of the
+// model files, the tokens already in the KV cache, the prompt tokens, the RNG state and
+// the sampling and stop settings. response_cache_key() hashes all of them; the entry
+// holds every token streamed after the prompt and the RNG state afterwards.
+//
+// On a hit ReplGemma feeds the prompt and the cached tokens through its own stream_token,
+// so detokenizing, stop conditions, filtering and rendering run exactly as they would
+// for the model, just without waiting on it. In multiturn conversations the KV rows the
+// response would have written are prefilled afterwards (prefill_kv_rows), once the
+// response is already on its way to the screen, so the next turn continues from the
+// same state. Prefilling a response costs a fraction of decoding it.
+//
+// Entries are files in <cache dir>/responses, evicted least recently used first once
+// they pass MIRROR_GAZE_RESPONSE_CACHE_MB (default 64; 0 turns the cache off).
+
+constexpr uint32_t kResponseCacheVersion = 1;
+
+struct ResponseCacheKeyInputs {
+  uint64_t model_key;
+  // The tokens in the KV cache before the prompt, then the prompt. Only their
+  // concatenation counts, since typing prefill moves the split around.
+  const std::vector<int>& history;
+  const std::vector<int>& prompt;
+  const std::mt19937& gen;
+  const gcpp::InferenceArgs& args;
+  const SamplerArgs& sampler_args;
+  const StopConditions& stop;
+  const std::string& grammar;
+};
+
+// Everything besides the context that decides what a response comes out as: the
+// sampling settings, the stop conditions and the grammar. Also keys the opening-state
+// snapshots.
+uint64_t generation_settings_hash(const gcpp::InferenceArgs& args, const SamplerArgs& sampler_args,
+                                  const StopConditions& stop, const std::string& grammar,
+                                  uint64_t hash) {
+  const uint64_t limits[] = {args.max_tokens, args.max_generated_tokens, sampler_args.top_k,
+                             sampler_args.repetition_window, stop.max_sentences,
+                             stop.max_questions, stop.max_tokens, args.multiturn ? 1u : 0u};
+  hash = fnv1a64(limits, sizeof(limits), hash);
+  const float settings[] = {args.temperature, sampler_args.top_p, sampler_args.min_p,
+                            sampler_args.repetition_penalty};
+  hash = fnv1a64(settings, sizeof(settings), hash);
+  for (const std::string& stop_string : stop.stop_strings) {
+    hash = fnv1a64(stop_string + '\0', hash);
+  }
+  return fnv1a64(grammar, hash);
+}
+
+uint64_t response_cache_key(const ResponseCacheKeyInputs& in) {
+  uint64_t hash = fnv1a64(&kResponseCacheVersion, sizeof(kResponseCacheVersion), in.model_key);
+  const uint64_t num_tokens = in.history.size() + in.prompt.size();
+  hash = fnv1a64(&num_tokens, sizeof(num_tokens), hash);
+  hash = fnv1a64(in.history.data(), in.history.size() * sizeof(int), hash);
+  hash = fnv1a64(in.prompt.data(), in.prompt.size() * sizeof(int), hash);
+  std::stringstream rng_ss;
+  rng_ss << in.gen;
+  hash = fnv1a64(rng_ss.str(), hash);
+  return generation_settings_hash(in.args, in.sampler_args, in.stop, in.grammar, hash);
+}
+
+class ResponseCache {
+ public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t stores = 0;
+    size_t evictions = 0;
+    size_t tokens_replayed = 0;
+  };
+
+  ResponseCache(std::filesystem::path dir, size_t max_bytes) : dir_(std::move(dir)), max_bytes_(max_bytes) {}
+
+  // Size limit from MIRROR_GAZE_RESPONSE_CACHE_MB.
+  static size_t ConfiguredMaxBytes() {
+    size_t mb = 64;
+    if (const char* env_var = std::getenv("MIRROR_GAZE_RESPONSE_CACHE_MB")) {
+      mb = std::strtoull(env_var, nullptr, 10);
+    }
+    return mb << 20;
+  }
+
+  bool enabled() const { return max_bytes_ > 0; }
+
+  // The streamed tokens and the RNG state after them, if key is cached.
+  bool Lookup(uint64_t key, std::vector<int>& tokens, std::string& rng_state) {
+    if (!enabled()) {
+      return false;
+    }
+    const std::filesystem::path path = PathFor(key);
+    std::ifstream in(path, std::ios::binary);
+    Header header = {};
+    bool ok = in && in.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+              memcmp(header.magic, "MGRESP\0\0", sizeof(header.magic)) == 0 &&
+              header.version == kResponseCacheVersion && header.key == key;
+    if (ok) {
+      tokens.resize(header.num_tokens);
+      rng_state.resize(header.rng_state_bytes);
+      ok = in.read(reinterpret_cast<char*>(tokens.data()), tokens.size() * sizeof(int)) &&
+           in.read(rng_state.data(), rng_state.size());
+    }
+    if (!ok) {
+      stats_.misses += 1;
+      return false;
+    }
+    stats_.hits += 1;
+    stats_.tokens_replayed += tokens.size();
+    std::error_code ec;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec); // LRU
+    return true;
+  }
+
+  void Store(uint64_t key, const std::vector<int>& tokens, const std::string& rng_state) {
+    if (!enabled()) {
+      return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    Header header = {};
+    memcpy(header.magic, "MGRESP\0\0", sizeof(header.magic));
+    header.version = kResponseCacheVersion;
+    header.key = key;
+    header.num_tokens = tokens.size();
+    header.rng_state_bytes = rng_state.size();
+    // Temp file and rename, so concurrent sessions never read a torn entry; the temp name
+    // is this thread's own, so two sessions storing the same entry never share one.
+    const std::filesystem::path path = PathFor(key);
+    const std::filesystem::path tmp_path = unique_temp_path(path);
+    {
+      std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char*>(tokens.data()), tokens.size() * sizeof(int));
+      out.write(rng_state.data(), rng_state.size());
+      if (!out) {
+        std::filesystem::remove(tmp_path, ec);
+        return;
+      }
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+      std::filesystem::remove(tmp_path, ec);
+      return;
+    }
+    stats_.stores += 1;
+    Evict();
+  }
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t rng_state_bytes;
+    uint64_t key;
+    uint64_t num_tokens;
+  };
+
+  std::filesystem::path PathFor(uint64_t key) const {
+    std::stringstream file_name;
+    file_name << std::hex << key << ".resp";
+    return dir_ / file_name.str();
+  }
+
+  // Removes the least recently used entries until the rest fit in max_bytes_.
+  void Evict() {
+    struct Entry {
+      std::filesystem::file_time_type used;
+      std::filesystem::path path;
+      size_t bytes;
+    };
+    std::vector<Entry> entries;
+    size_t total = 0;
+    std::error_code ec;
+    for (const auto& file : std::filesystem::directory_iterator(dir_, ec)) {
+      if (file.path().extension() != ".resp") {
+        continue;
+      }
+      Entry entry = {file.last_write_time(ec), file.path(), static_cast<size_t>(file.file_size(ec))};
+      if (!ec) {
+        total += entry.bytes;
+        entries.push_back(std::move(entry));
+      }
+    }
+    if (total <= max_bytes_) {
+      return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    for (const Entry& entry : entries) {
+      if (total <= max_bytes_) {
+        break;
+      }
+      if (std::filesystem::remove(entry.path, ec)) {
+        total -= entry.bytes;
+        stats_.evictions += 1;
+      }
+    }
+  }
+
+  std::filesystem::path dir_;
+  size_t max_bytes_;
+  Stats stats_;
+};
+
+// Writes tokens into KV rows [start_pos, start_pos + tokens.size()) the way generating
+// them would have: run them as a prompt and stop at the first sample, with a throwaway
+// RNG (same trick as KVPrefixCache::Fork).
+void prefill_kv_rows(gcpp::Gemma& model, const std::vector<int>& tokens, size_t start_pos,
+                     gcpp::KVCache& kv_cache, hwy::ThreadPool& pool, const gcpp::InferenceArgs& args) {
+  if (tokens.size() < 1) {
+    return;
+  }
+  std::mt19937 throwaway_gen(0);
+  size_t streamed = 0;
+  const size_t size = tokens.size();
+  gcpp::StreamFunc stop_after_tokens = [&streamed, size](int, float) {
+    streamed += 1;
+    return streamed <= size;
+  };
+  gcpp::AcceptFunc accept_all = [](int) { return true; };
+  gcpp::RuntimeConfig runtime_config = {
+      .max_tokens = args.max_tokens,
+      .max_generated_tokens = 1,
+      .temperature = args.temperature,
+      .verbosity = 0,
+      .gen = &throwaway_gen,
+      .stream_token = stop_after_tokens,
+      .accept_token = accept_all,
+  };
+  gcpp::TimingInfo timing_info;
+  GenerateGemma(model, runtime_config, tokens, start_pos, kv_cache, pool, timing_info);
+}
+
+void print_response_cache_stats(const ResponseCache::Stats& stats) {
+  std::cout << stats.hits << " responses replayed from the response cache ("
+            << stats.tokens_replayed << " tokens), " << stats.misses << " misses, "
+            << stats.stores << " stored, " << stats.evictions << " evicted\n";
+}
@@ -0,0 +1,309 @@
+
+#ifdef SAMPLER
+#error "Only include sampler.hpp ONCE!"
+#endif
+#define SAMPLER
+
+// Next-token sampling with top-k, top-p, min-p and a repetition penalty, replacing
+// gemma.cpp's Softmax + SampleTopK<kTopK> through the sample_token_hook that build.py
+// patches into gemma.h and gemma.cc (GEMMA_SAMPLE_TOKEN_HOOK).
+//
+// Instead of a softmax over the whole vocabulary, one vector pass finds the largest
+// logit and a second one compresses the indices of the tokens within reach of it into
+// a candidate list: everything less likely than kNegligible (or min_p) of the most
+// likely token is never looked at again. Only the candidates, at most kMaxCandidates
+// of them, are ranked, filtered by accept_token, exponentiated and drawn from.
+//
+// Draws come from Philox4x32-10, a counter-based generator: the n-th draw of a response
+// is a pure function of (key, n). ReplGemma keys each response with one value from its
+// std::mt19937, so --deterministic and session snapshots, which both work on that
+// generator, reproduce the sampled responses too.
+
+class SamplerArgs : public gcpp::ArgsBase<SamplerArgs> {
+ public:
+  SamplerArgs(int argc, char* argv[]) { InitAndParse(argc, argv); }
+
+  size_t top_k;
+  float top_p;
+  float min_p;
+  float repetition_penalty;
+  size_t repetition_window;
+
+  const char* Validate() const {
+    if (top_p <= 0.0f || top_p > 1.0f) {
+      return "top_p must be in (0, 1]";
+    }
+    if (min_p < 0.0f || min_p >= 1.0f) {
+      return "min_p must be in [0, 1)";
+    }
+    if (repetition_penalty <= 0.0f) {
+      return "repetition_penalty must be positive";
+    }
+    return nullptr;
+  }
+
+  template <class Visitor>
+  void ForEach(const Visitor& visitor) {
+    visitor(top_k, "top_k", size_t{0}, "Sample from the k most likely tokens only; 0 = no limit", 2);
+    visitor(top_p, "top_p", 1.0f,
+            "Sample from the most likely tokens that make up this much probability; 1 = all", 2);
+    visitor(min_p, "min_p", 0.0f,
+            "Skip tokens less likely than this fraction of the most likely one; 0 = none", 2);
+    visitor(repetition_penalty, "repetition_penalty", 1.0f,
+            "Divide the logits of recently generated tokens by this; 1 = off", 2);
+    visitor(repetition_window, "repetition_window", size_t{64},
+            "How many of the last generated tokens the repetition penalty covers", 2);
+  }
+};
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+class PhiloxRng {
+ public:
+  void Seed(uint64_t key) {
+    key_ = key;
+    counter_ = 0;
+  }
+
+  // Uniform in [0, 1).
+  double Uniform() {
+    const uint64_t bits = Block(counter_, key_);
+    counter_ += 1;
+    return static_cast<double>(bits >> 11) * (1.0 / 9007199254740992.0); // 2^-53
+  }
+
+  uint64_t counter() const { return counter_; }
+
+  // 64 of the 128 bits of block counter under key.
+  static uint64_t Block(uint64_t counter, uint64_t key) {
+    uint32_t c[4] = {static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), 0, 0};
+    uint32_t k[2] = {static_cast<uint32_t>(key), static_cast<uint32_t>(key >> 32)};
+    for (int round = 0; round < 10; round += 1) {
+      const uint64_t p0 = uint64_t{0xD2511F53} * c[0];
+      const uint64_t p1 = uint64_t{0xCD9E8D57} * c[2];
+      const uint32_t next[4] = {
+          static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0], static_cast<uint32_t>(p1),
+          static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1], static_cast<uint32_t>(p0)};
+      memcpy(c, next, sizeof(c));
+      k[0] += 0x9E3779B9;
+      k[1] += 0xBB67AE85;
+    }
+    return (static_cast<uint64_t>(c[1]) << 32) | c[0];
+  }
+
+ private:
+  uint64_t key_ = 0;
+  uint64_t counter_ = 0;
+};
+
+namespace sampler_simd {
+namespace hn = hwy::HWY_NAMESPACE;
+
+float MaxLogit(const float* HWY_RESTRICT logits, size_t n) {
+  const hn::ScalableTag<float> df;
+  const size_t N = hn::Lanes(df);
+  auto vmax = hn::Set(df, -std::numeric_limits<float>::infinity());
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    vmax = hn::Max(vmax, hn::LoadU(df, logits + i));
+  }
+  float max_logit = hn::GetLane(hn::MaxOfLanes(df, vmax));
+  for (; i < n; i += 1) {
+    max_logit = std::max(max_logit, logits[i]);
+  }
+  return max_logit;
+}
+
+// Writes the indices of the logits >= cutoff to out (room for n + the vector size) and
+// returns how many there are.
+size_t SelectAtLeast(const float* HWY_RESTRICT logits, size_t n, float cutoff,
+                     int32_t* HWY_RESTRICT out) {
+  const hn::ScalableTag<float> df;
+  const hn::RebindToSigned<decltype(df)> di;
+  const size_t N = hn::Lanes(df);
+  const auto vcutoff = hn::Set(df, cutoff);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    const auto keep = hn::Ge(hn::LoadU(df, logits + i), vcutoff);
+    if (!hn::AllFalse(df, keep)) {
+      count += hn::CompressStore(hn::Iota(di, static_cast<int32_t>(i)), hn::RebindMask(di, keep),
+                                 di, out + count);
+    }
+  }
+  for (; i < n; i += 1) {
+    if (logits[i] >= cutoff) {
+      out[count] = static_cast<int32_t>(i);
+      count += 1;
+    }
+  }
+  return count;
+}
+
+}  // namespace sampler_simd
+
+class Sampler {
+ public:
+  // Tokens less likely than this fraction of the most likely one are never sampled.
+  static constexpr float kNegligible = 1e-4f;
+  static constexpr size_t kMaxCandidates = 1024;
+
+  explicit Sampler(const SamplerArgs& args) : args_(args) {}
+
+  // Starts a response: draws restart from counter 0 under key, and the repetition
+  // penalty forgets the previous response.
+  void BeginResponse(uint64_t key) {
+    rng_.Seed(key);
+    recent_.clear();
+  }
+
+  // Picks the next token from logits (modified in place) among those accept_token allows.
+  int Sample(float* logits, size_t vocab_size, float temperature, const gcpp::AcceptFunc& accept_token) {
+    PenalizeRecent(logits, vocab_size);
+    const int token = temperature > 0 ? Draw(logits, vocab_size, temperature, accept_token)
+                                      : Greedy(logits, vocab_size, accept_token);
+    if (args_.repetition_window > 0) {
+      if (recent_.size() >= args_.repetition_window) {
+        recent_.erase(recent_.begin());
+      }
+      recent_.push_back(token);
+    }
+    return token;
+  }
+
+ private:
+  void PenalizeRecent(float* logits, size_t vocab_size) {
+    if (args_.repetition_penalty == 1.0f || recent_.size() < 1) {
+      return;
+    }
+    penalized_ = recent_;
+    std::sort(penalized_.begin(), penalized_.end());
+    penalized_.erase(std::unique(penalized_.begin(), penalized_.end()), penalized_.end());
+    for (int token : penalized_) {
+      if (token >= 0 && static_cast<size_t>(token) < vocab_size) {
+        float& logit = logits[token];
+        logit = logit > 0 ? logit / args_.repetition_penalty : logit * args_.repetition_penalty;
+      }
+    }
+  }
+
+  // Like SampleTopK when nothing in reach of the top is accepted: the most likely token
+  // that is.
+  int Greedy(const float* logits, size_t vocab_size, const gcpp::AcceptFunc& accept_token) const {
+    int best = -1;
+    for (size_t i = 0; i < vocab_size; i += 1) {
+      if ((best < 0 || logits[i] > logits[best]) && accept_token(static_cast<int>(i))) {
+        best = static_cast<int>(i);
+      }
+    }
+    return best < 0 ? gcpp::EOS_ID : best;
+  }
+
+  int Draw(float* logits, size_t vocab_size, float temperature, const gcpp::AcceptFunc& accept_token) {
+    // p_i / p_max = exp((logit_i - max) / temperature), so the relative cutoffs are
+    // cutoffs on the logits.
+    const float max_logit = sampler_simd::MaxLogit(logits, vocab_size);
+    const float relative = std::max(kNegligible, args_.min_p);
+    const float cutoff = max_logit + temperature * std::log(relative);
+    candidates_.resize(vocab_size + HWY_MAX_BYTES / sizeof(float)); // CompressStore writes whole vectors
+    size_t count = sampler_simd::SelectAtLeast(logits, vocab_size, cutoff, candidates_.data());
+
+    auto more_likely = [logits](int32_t a, int32_t b) { return logits[a] > logits[b]; };
+    const size_t keep = std::min(args_.top_k > 0 ? args_.top_k : kMaxCandidates, kMaxCandidates);
+    if (count > keep) {
+      std::nth_element(candidates_.begin(), candidates_.begin() + keep, candidates_.begin() + count,
+                       more_likely);
+      count = keep;
+    }
+    if (args_.top_p < 1.0f) {
+      std::sort(candidates_.begin(), candidates_.begin() + count, more_likely);
+    }
+
+    // What accept_token refuses is out before the probabilities are normalized.
+    size_t accepted = 0;
+    for (size_t i = 0; i < count; i += 1) {
+      if (accept_token(candidates_[i])) {
+        candidates_[accepted] = candidates_[i];
+        accepted += 1;
+      }
+    }
+    if (accepted < 1) {
+      return Greedy(logits, vocab_size, accept_token);
+    }
+
+    float top = logits[candidates_[0]];
+    for (size_t i = 1; i < accepted; i += 1) {
+      top = std::max(top, logits[candidates_[i]]);
+    }
+    weights_.resize(accepted);
+    double total = 0;
+    for (size_t i = 0; i < accepted; i += 1) {
+      const float weight = std::exp((logits[candidates_[i]] - top) / temperature);
+      weights_[i] = weight >= args_.min_p ? weight : 0.0f;
+      total += weights_[i];
+    }
+    if (args_.top_p < 1.0f) {
+      // Sorted: the nucleus is the shortest prefix holding top_p of the probability.
+      double cumulative = 0;
+      for (size_t i = 0; i < accepted; i += 1) {
+        cumulative += weights_[i];
+        if (cumulative >= args_.top_p * total) {
+          accepted = i + 1;
+          total = cumulative;
+          break;
+        }
+      }
+    }
+
+    double u = rng_.Uniform() * total;
+    for (size_t i = 0; i < accepted; i += 1) {
+      u -= weights_[i];
+      if (u < 0) {
+        return candidates_[i];
+      }
+    }
+    return candidates_[0]; // rounding
+  }
+
+  const SamplerArgs& args_;
+  PhiloxRng rng_;
+  std::vector<int> recent_;
+  std::vector<int> penalized_;
+  std::vector<int32_t> candidates_;
+  std::vector<float> weights_;
+};
+
+// The sampler of the ReplGemma running on this thread, and the generator of the
+// RuntimeConfig it samples for; sample_token_hook has no other way to find them.
+// Keying on the generator keeps every other GenerateGemma on the thread (summaries,
+// prefix and typing prefills, a second model) away from the session's Philox counter and
+// repetition window, so they cannot change what the session samples next.
+struct SessionSampler {
+  Sampler* sampler;
+  const std::mt19937* gen;
+};
+thread_local SessionSampler session_sampler = {nullptr, nullptr};
+
+// Makes sampler this thread's session_sampler for generations driven by gen while in scope.
+class SessionSamplerScope {
+ public:
+  SessionSamplerScope(Sampler& sampler, const std::mt19937& gen) : previous_(session_sampler) {
+    session_sampler = {&sampler, &gen};
+  }
+  ~SessionSamplerScope() { session_sampler = previous_; }
+
+ private:
+  SessionSampler previous_;
+};
+
+// For sample_token_hook. Generations with any other generator (benchmarks, helpers of a
+// ReplGemma) sample with default settings, keyed from their own gen on every call.
+int sample_with_session_sampler(float* logits, size_t vocab_size, std::mt19937& gen,
+                                float temperature, const gcpp::AcceptFunc& accept_token) {
+  if (session_sampler.sampler == nullptr || session_sampler.gen != &gen) {
+    static const SamplerArgs default_args(0, nullptr);
+    thread_local Sampler fallback(default_args);
+    fallback.BeginResponse((static_cast<uint64_t>(gen()) << 32) | gen());
+    return fallback.Sample(logits, vocab_size, temperature, accept_token);
+  }
+  return session_sampler.sampler->Sample(logits, vocab_size, temperature, accept_token);
+}
@@ -0,0 +1,328 @@
+
+#ifdef SESSION_SNAPSHOT
+#error "Only include session_snapshot.hpp ONCE!"
+#endif
+#define SESSION_SNAPSHOT
+
+#if defined(_WIN32)
+#include <process.h> // _getpid
+#else
+#include <unistd.h> // getpid
+#endif
+
+// On-disk snapshots of the LLM thread's state: the used KV cache rows, abs_pos, the
+// sampling RNG and the last model response. Used to skip the opening prompt on
+// startup and to resume a therapist session after %q. ReplGemma keeps the restored
+// RNG only under --deterministic and reseeds it otherwise.
+//
+// File layout (all sections 64-byte aligned so the rows can be used straight out of
+// an mmap):
+//
+//   SnapshotHeader
+//   rng state (text form of std::mt19937)
+//   last response text
+//   key_cache rows [0, abs_pos), encoded with header.kv_codec
+//   value_cache rows [0, abs_pos), likewise
+//   conv1d_cache, rglru_cache (Griffin only, always f32)
+//
+// Rows are f32 unless MIRROR_GAZE_KV_CODEC picks a smaller codec (kv_codec.hpp); the
+// key and value rows are most of a snapshot, so bf16 halves it and int8 roughly
+// quarters it, at some loss of precision in the restored conversation.
+//
+// Snapshots are keyed by model_files_key(), so replacing the weights or tokenizer
+// file silently invalidates every snapshot taken with the old ones.
+
+constexpr uint32_t kSnapshotVersion = 2;
+constexpr size_t kSnapshotAlign = 64;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_bytes;
+  uint64_t model_key;
+  uint64_t prompt_key;
+  uint64_t abs_pos;
+  uint64_t floats_per_pos;
+  uint64_t conv1d_floats;
+  uint64_t rglru_floats;
+  uint64_t rng_state_bytes;
+  uint64_t response_bytes;
+  uint32_t kv_codec; // KVCodec of the key and value rows
+  uint32_t reserved;
+};
+
+uint64_t fnv1a64(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; i += 1) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+uint64_t fnv1a64(const std::string& s, uint64_t hash = 14695981039346656037ull) {
+  return fnv1a64(s.data(), s.size(), hash);
+}
+
+// Identity of a model file on disk: where it is, how big it is and when it was written.
+// Cheap enough to compute on every launch, unlike hashing gigabytes of weights.
+uint64_t file_identity_key(const std::string& file_path, uint64_t hash) {
+  std::error_code ec;
+  auto path = std::filesystem::weakly_canonical(file_path, ec);
+  hash = fnv1a64(path.string(), hash);
+  const uint64_t size = std::filesystem::file_size(path, ec);
+  hash = fnv1a64(&size, sizeof(size), hash);
+  const int64_t mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+  return fnv1a64(&mtime, sizeof(mtime), hash);
+}
+
+uint64_t model_files_key(const std::string& weights_path, const std::string& tokenizer_path) {
+  uint64_t hash = fnv1a64(&kSnapshotVersion, sizeof(kSnapshotVersion));
+  hash = file_identity_key(weights_path, hash);
+  return file_identity_key(tokenizer_path, hash);
+}
+
+// $MIRROR_GAZE_CACHE_DIR, else the platform's per-user cache directory. Created on demand.
+std::filesystem::path mirror_gaze_cache_dir() {
+  std::filesystem::path dir;
+  if (const char* env_var = std::getenv("MIRROR_GAZE_CACHE_DIR")) {
+    dir = env_var;
+  }
+  else if (const char* env_var = std::getenv("XDG_CACHE_HOME")) {
+    dir = std::filesystem::path(env_var) / "mirror-gaze";
+  }
+  else if (const char* env_var = std::getenv("LOCALAPPDATA")) { // Windows
+    dir = std::filesystem::path(env_var) / "mirror-gaze";
+  }
+  else if (const char* env_var = std::getenv("HOME")) {
+    dir = std::filesystem::path(env_var) / ".cache" / "mirror-gaze";
+  }
+  else {
+    dir = std::filesystem::temp_directory_path() / "mirror-gaze";
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  return dir;
+}
+
+// path + ".tmp-<pid>-<thread>", a name nobody else writing the same file at the same
+// time can pick: the daemon's sessions and separate processes share the cache directory,
+// and two writers of one shared temp file would rename a mix of both into place.
+std::filesystem::path unique_temp_path(const std::filesystem::path& path) {
+  std::stringstream suffix;
+#if defined(_WIN32)
+  suffix << ".tmp-" << _getpid();
+#else
+  suffix << ".tmp-" << getpid();
+#endif
+  suffix << "-" << std::hex << std::hash<std::thread::id>{}(std::this_thread::get_id());
+  std::filesystem::path tmp_path = path;
+  tmp_path += suffix.str();
+  return tmp_path;
+}
+
+size_t snapshot_align_up(size_t n) {
+  return (n + kSnapshotAlign - 1) & ~(kSnapshotAlign - 1);
+}
+
+// Where each section of a snapshot with the given header starts.
+struct SnapshotOffsets {
+  size_t rng, response, key, value, conv1d, rglru, end;
+};
+
+// False if the sections the header describes don't fit in file_size bytes. The sizes come
+// from the file, so each one is checked against what is left before it is added: a
+// corrupt or hostile header must not wrap an offset around to something that looks in
+// bounds.
+bool snapshot_offsets(const SnapshotHeader& header, size_t file_size, SnapshotOffsets& offsets) {
+  size_t offset = snapshot_align_up(sizeof(header));
+  // Starts a section at offset (aligned) and moves offset past its bytes.
+  auto section = [&offset, file_size](size_t& start, uint64_t bytes) {
+    start = offset;
+    if (offset > file_size || bytes > file_size - offset) {
+      return false;
+    }
+    offset = snapshot_align_up(offset + bytes);
+    return true;
+  };
+  // Every codec takes at least a byte per float, so more floats than file bytes can't fit
+  // (and can't overflow the multiplications below).
+  auto floats_fit = [file_size](uint64_t count, uint64_t floats_per) {
+    return floats_per == 0 || count <= file_size / floats_per;
+  };
+  if (!floats_fit(header.abs_pos, header.floats_per_pos) ||
+      !floats_fit(header.conv1d_floats, sizeof(float)) ||
+      !floats_fit(header.rglru_floats, sizeof(float))) {
+    return false;
+  }
+  const size_t row_bytes = kv_encoded_bytes(static_cast<KVCodec>(header.kv_codec),
+                                            header.abs_pos * header.floats_per_pos);
+  return section(offsets.rng, header.rng_state_bytes) &&
+         section(offsets.response, header.response_bytes) &&
+         section(offsets.key, row_bytes) &&
+         section(offsets.value, row_bytes) &&
+         section(offsets.conv1d, header.conv1d_floats * sizeof(float)) &&
+         section(offsets.rglru, header.rglru_floats * sizeof(float)) &&
+         section(offsets.end, 0);
+}
+
+bool save_session_snapshot(const std::filesystem::path& path, uint64_t model_key,
+                           uint64_t prompt_key, const KVCacheLayout& layout,
+                           const gcpp::KVCache& kv_cache, size_t abs_pos,
+                           const std::mt19937& gen, const std::string& response) {
+  std::stringstream rng_ss;
+  rng_ss << gen;
+  const std::string rng_state = rng_ss.str();
+
+  SnapshotHeader header = {};
+  memcpy(header.magic, "MGSNAP\0\0", sizeof(header.magic));
+  header.version = kSnapshotVersion;
+  header.header_bytes = sizeof(SnapshotHeader);
+  header.model_key = model_key;
+  header.prompt_key = prompt_key;
+  header.abs_pos = abs_pos;
+  header.floats_per_pos = layout.floats_per_pos;
+  header.conv1d_floats = layout.conv1d_floats;
+  header.rglru_floats = layout.rglru_floats;
+  header.rng_state_bytes = rng_state.size();
+  header.response_bytes = response.size();
+  const KVCodec codec = kv_snapshot_codec();
+  header.kv_codec = static_cast<uint32_t>(codec);
+
+  // Write to a temp file and rename, so a crash never leaves a torn snapshot behind.
+  const std::filesystem::path tmp_path = unique_temp_path(path);
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    return false;
+  }
+  size_t written = 0;
+  auto write_section = [&](const void* data, size_t bytes) {
+    static const char zeros[kSnapshotAlign] = {};
+    out.write(zeros, snapshot_align_up(written) - written);
+    written = snapshot_align_up(written);
+    out.write(static_cast<const char*>(data), bytes);
+    written += bytes;
+  };
+  // Encodes a few rows at a time, so saving never needs a second copy of the cache.
+  // floats_per_pos is a multiple of kKVInt8Group, so chunks never split a group.
+  std::vector<uint8_t> encoded;
+  auto write_rows = [&](const float* rows) {
+    const size_t chunk_rows = 64;
+    write_section(nullptr, 0);
+    for (size_t row = 0; row < abs_pos; row += chunk_rows) {
+      const size_t floats = std::min(chunk_rows, abs_pos - row) * layout.floats_per_pos;
+      encoded.resize(kv_encoded_bytes(codec, floats));
+      kv_encode(codec, rows + row * layout.floats_per_pos, floats, encoded.data());
+      out.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+      written += encoded.size();
+    }
+  };
+  write_section(&header, sizeof(header));
+  write_section(rng_state.data(), rng_state.size());
+  write_section(response.data(), response.size());
+  if (abs_pos > 0) {
+    write_rows(kv_cache.key_cache.get());
+    write_rows(kv_cache.value_cache.get());
+  }
+  if (layout.conv1d_floats > 0) {
+    write_section(kv_cache.conv1d_cache.get(), layout.conv1d_floats * sizeof(float));
+  }
+  if (layout.rglru_floats > 0) {
+    write_section(kv_cache.rglru_cache.get(), layout.rglru_floats * sizeof(float));
+  }
+  write_section(nullptr, 0); // pad the tail so empty trailing sections stay in bounds
+  out.close();
+  std::error_code ec;
+  if (!out) {
+    std::filesystem::remove(tmp_path, ec);
+    return false;
+  }
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    std::filesystem::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+// Restores a snapshot written by save_session_snapshot. Leaves every output untouched
+// and returns false if the file is missing, truncated, or for other model files / prompt.
+bool load_session_snapshot(const std::filesystem::path& path, uint64_t model_key,
+                           uint64_t prompt_key, const KVCacheLayout& layout,
+                           gcpp::KVCache& kv_cache, size_t& abs_pos,
+                           std::mt19937& gen, std::string& response) {
+  MappedFile file;
+  if (!file.open(path) || file.size() < sizeof(SnapshotHeader)) {
+    return false;
+  }
+  SnapshotHeader header;
+  memcpy(&header, file.data(), sizeof(header));
+  if (memcmp(header.magic, "MGSNAP", 6) != 0 || header.version != kSnapshotVersion ||
+      header.header_bytes != sizeof(SnapshotHeader) || header.model_key != model_key ||
+      header.prompt_key != prompt_key || header.floats_per_pos != layout.floats_per_pos ||
+      header.conv1d_floats != layout.conv1d_floats || header.rglru_floats != layout.rglru_floats ||
+      header.abs_pos >= layout.seq_len || header.kv_codec > static_cast<uint32_t>(KVCodec::kInt8)) {
+    return false;
+  }
+
+  const KVCodec codec = static_cast<KVCodec>(header.kv_codec);
+  const size_t row_floats = header.abs_pos * layout.floats_per_pos;
+  SnapshotOffsets offsets;
+  if (!snapshot_offsets(header, file.size(), offsets)) {
+    return false;
+  }
+
+  std::mt19937 restored_gen;
+  std::stringstream rng_ss(std::string(
+      reinterpret_cast<const char*>(file.data() + offsets.rng), header.rng_state_bytes));
+  if (!(rng_ss >> restored_gen)) {
+    return false;
+  }
+
+  if (row_floats > 0) {
+    kv_decode(codec, file.data() + offsets.key, row_floats, kv_cache.key_cache.get());
+    kv_decode(codec, file.data() + offsets.value, row_floats, kv_cache.value_cache.get());
+  }
+  if (layout.conv1d_floats > 0) {
+    memcpy(kv_cache.conv1d_cache.get(), file.data() + offsets.conv1d,
+           layout.conv1d_floats * sizeof(float));
+  }
+  if (layout.rglru_floats > 0) {
+    memcpy(kv_cache.rglru_cache.get(), file.data() + offsets.rglru,
+           layout.rglru_floats * sizeof(float));
+  }
+  abs_pos = header.abs_pos;
+  gen = restored_gen;
+  response.assign(reinterpret_cast<const char*>(file.data() + offsets.response),
+                  header.response_bytes);
+  return true;
+}
+
+// Decodes the key and value rows of any snapshot, whatever model it was taken with.
+// For bench kvcodec, which looks at recorded sessions without loading a model.
+bool read_snapshot_kv_rows(const std::filesystem::path& path, std::vector<float>& keys,
+                           std::vector<float>& values, size_t& floats_per_pos) {
+  MappedFile file;
+  if (!file.open(path) || file.size() < sizeof(SnapshotHeader)) {
+    return false;
+  }
+  SnapshotHeader header;
+  memcpy(&header, file.data(), sizeof(header));
+  if (memcmp(header.magic, "MGSNAP", 6) != 0 || header.version != kSnapshotVersion ||
+      header.header_bytes != sizeof(SnapshotHeader) ||
+      header.kv_codec > static_cast<uint32_t>(KVCodec::kInt8)) {
+    return false;
+  }
+  SnapshotOffsets offsets;
+  if (!snapshot_offsets(header, file.size(), offsets)) {
+    return false;
+  }
+  const KVCodec codec = static_cast<KVCodec>(header.kv_codec);
+  const size_t row_floats = header.abs_pos * header.floats_per_pos;
+  keys.resize(row_floats);
+  values.resize(row_floats);
+  kv_decode(codec, file.data() + offsets.key, row_floats, keys.data());
+  kv_decode(codec, file.data() + offsets.value, row_floats, values.data());
+  floats_per_pos = header.floats_per_pos;
+  return true;
+}
@@ -0,0 +1,89 @@
+
+#ifdef SLICE_SCHEDULER
+#error "Only include slice_scheduler.hpp ONCE!"
+#endif
+#define SLICE_SCHEDULER
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Shares one model (and its thread pool) between the sessions of the daemon.
+//
+// Every session runs its own generation loop on its own thread, and holds the scheduler
+// while it uses the model. GenerateGemma calls stream_token after every prefill batch
+// and every decode step; those call Yield(), which - once the holder has had the model
+// for a whole slice and another session is waiting - passes the model on and queues up
+// again behind everyone else. Prefill chunks and decode steps of all sessions are
+// interleaved round-robin that way, without GenerateGemma knowing about it.
+//
+// Switching mid-generation is safe because every step recomputes the model activations
+// from the token and the session's own KV cache; nothing carries over in the shared
+// activations from one stream_token call to the next.
+class SliceScheduler {
+ public:
+  explicit SliceScheduler(std::chrono::microseconds slice) : slice_(slice) {}
+
+  // Blocks until this thread holds the model. Waiters are served in arrival order.
+  void Acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const uint64_t ticket = next_ticket_;
+    next_ticket_ += 1;
+    cv_.wait(lock, [&] { return serving_ == ticket; });
+    slice_start_ = std::chrono::steady_clock::now();
+  }
+
+  void Release() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    serving_ += 1;
+    cv_.notify_all();
+  }
+
+  // Called by the holder between steps.
+  void Yield() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const bool others_waiting = next_ticket_ - serving_ > 1;
+      if (!others_waiting || std::chrono::steady_clock::now() - slice_start_ < slice_) {
+        return;
+      }
+      yields_ += 1;
+    }
+    Release();
+    Acquire();
+  }
+
+  uint64_t yields() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return yields_;
+  }
+
+ private:
+  const std::chrono::microseconds slice_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  uint64_t next_ticket_ = 0; // ticket lock: FIFO hand-over between sessions
+  uint64_t serving_ = 0;
+  uint64_t yields_ = 0;
+  std::chrono::steady_clock::time_point slice_start_;
+};
+
+// Holds the scheduler for a scope; a no-op without one (the single-session app).
+class SliceLease {
+ public:
+  explicit SliceLease(SliceScheduler* scheduler) : scheduler_(scheduler) {
+    if (scheduler_ != nullptr) {
+      scheduler_->Acquire();
+    }
+  }
+  ~SliceLease() {
+    if (scheduler_ != nullptr) {
+      scheduler_->Release();
+    }
+  }
+  SliceLease(const SliceLease&) = delete;
+  SliceLease& operator=(const SliceLease&) = delete;
+
+ private:
+  SliceScheduler* scheduler_;
+};
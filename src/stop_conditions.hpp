@@ -0,0 +1,135 @@
+
+#ifdef STOP_CONDITIONS
+#error "Only include stop_conditions.hpp ONCE!"
+#endif
+#define STOP_CONDITIONS
+
+#include <cctype>
+
+// When a response should end, checked on every generated token instead of after the
+// whole response is back. ReplGemma ends a response that meets any of these the same
+// way it ends one at EOS, so the KV cache holds exactly what the model generated up to
+// there and a multiturn conversation continues from it normally.
+struct StopConditions {
+  // Ends at the first occurrence of any of these; the stop string itself is not shown.
+  // Empty ones are ignored.
+  std::vector<std::string> stop_strings;
+  // A sentence ends at a run of '.', '!' or '?' followed by whitespace; the whitespace
+  // is not shown. A question is a sentence whose run contains '?'. 0: no limit.
+  size_t max_sentences = 0;
+  size_t max_questions = 0;
+  // Generated tokens for this prompt, on top of --max_generated_tokens. 0: no limit.
+  size_t max_tokens = 0;
+};
+
+// Applies the text conditions of a StopConditions to a streamed response. Text that
+// could be the start of a stop string is held back until the next chunk shows whether
+// it is, so a stop string never reaches the screen even when it spans tokens.
+class StopMatcher {
+ public:
+  void Begin(const StopConditions& conditions) {
+    conditions_ = &conditions;
+    // An empty stop string would match everywhere, and Push() relies on every one
+    // having at least a byte.
+    stop_strings_.clear();
+    for (const std::string& s : conditions.stop_strings) {
+      if (s.size() > 0) {
+        stop_strings_.push_back(s);
+      }
+    }
+    held_.clear();
+    sentences_ = 0;
+    questions_ = 0;
+    in_terminator_ = false;
+    question_ = false;
+    stopped_ = false;
+  }
+
+  // Returns the part of the response that can be shown now; valid until the next call.
+  // Once a condition is met, stopped() is set and everything after it is dropped.
+  std::string_view Push(std::string_view text) {
+    if (stopped_ || conditions_ == nullptr) {
+      return stopped_ ? std::string_view() : text;
+    }
+    text = text.substr(0, SentenceEnd(text));
+    if (stop_strings_.size() < 1) {
+      return text;
+    }
+
+    out_.assign(held_);
+    out_.append(text.data(), text.size());
+    held_.clear();
+    size_t found = std::string::npos;
+    for (const std::string& s : stop_strings_) {
+      found = std::min(found, out_.find(s));
+    }
+    if (found != std::string::npos) {
+      out_.resize(found);
+      stopped_ = true;
+      return out_;
+    }
+    if (!stopped_) {
+      // Hold back the longest tail that a stop string starts with.
+      size_t hold = 0;
+      for (const std::string& s : stop_strings_) {
+        for (size_t n = std::min(s.size() - 1, out_.size()); n > hold; n -= 1) {
+          if (out_.compare(out_.size() - n, n, s, 0, n) == 0) {
+            hold = n;
+            break;
+          }
+        }
+      }
+      held_.assign(out_, out_.size() - hold, hold);
+      out_.resize(out_.size() - hold);
+    }
+    return out_;
+  }
+
+  // Text still held back when the response ends without a stop string completing.
+  std::string_view Finish() {
+    out_.swap(held_);
+    held_.clear();
+    return stopped_ ? std::string_view() : std::string_view(out_);
+  }
+
+  bool stopped() const { return stopped_; }
+
+ private:
+  // Bytes of text before the sentence or question limit is reached (all of it if it
+  // isn't); sets stopped_ when it is.
+  size_t SentenceEnd(std::string_view text) {
+    if (conditions_->max_sentences < 1 && conditions_->max_questions < 1) {
+      return text.size();
+    }
+    for (size_t i = 0; i < text.size(); i += 1) {
+      const char c = text[i];
+      if (c == '.' || c == '!' || c == '?') {
+        in_terminator_ = true;
+        question_ = question_ || c == '?';
+        continue;
+      }
+      if (in_terminator_ && std::isspace(static_cast<unsigned char>(c))) {
+        sentences_ += 1;
+        questions_ += question_ ? 1 : 0;
+        if ((conditions_->max_sentences > 0 && sentences_ >= conditions_->max_sentences) ||
+            (conditions_->max_questions > 0 && questions_ >= conditions_->max_questions)) {
+          stopped_ = true;
+          return i;
+        }
+      }
+      in_terminator_ = false;
+      question_ = false;
+    }
+    return text.size();
+  }
+
+  const StopConditions* conditions_ = nullptr;
+  std::vector<std::string> stop_strings_; // the non-empty ones of conditions_
+  std::string held_;
+  std::string out_;
+  size_t sentences_ = 0;
+  size_t questions_ = 0;
+  bool in_terminator_ = false;
+  bool question_ = false;
+  bool stopped_ = false;
+};
@@ -0,0 +1,293 @@
+
+#ifdef TERMINAL_RENDERER
+#error "Only include terminal_renderer.hpp ONCE!"
+#endif
+#define TERMINAL_RENDERER
+
+#include <cerrno>
+#include <csignal>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define VC_EXTRALEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <io.h>
+#else
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif // Windows/Linux
+
+// Word-wrapping renderer for streamed responses.
+//
+// Text is laid out into a frame buffer as it arrives and the frame goes to the terminal
+// in a single write(), at most once every kFrameInterval, so a fast model costs a
+// handful of syscalls per second instead of a flush per token. Lines are wrapped on
+// display width (CJK and emoji take two columns, combining marks none) rather than on
+// byte count.
+//
+// The terminal size is read once and then only again after SIGWINCH; the handler just
+// sets a flag, which the next frame picks up to re-read the size and redraw the
+// current paragraph at the new width.
+
+// Columns a code point occupies on a terminal; a trimmed-down wcwidth().
+int codepoint_display_width(uint32_t cp) {
+  if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0)) {
+    return 0;
+  }
+  if ((cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x1AB0 && cp <= 0x1AFF) ||
+      (cp >= 0x1DC0 && cp <= 0x1DFF) || (cp >= 0x200B && cp <= 0x200F) ||
+      (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE00 && cp <= 0xFE0F) ||
+      (cp >= 0xFE20 && cp <= 0xFE2F)) {
+    return 0; // combining marks, zero-width spaces/joiners, variation selectors
+  }
+  if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0x303E) ||
+      (cp >= 0x3041 && cp <= 0x33FF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
+      (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xA000 && cp <= 0xA4CF) ||
+      (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+      (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+      (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+      (cp >= 0x1F680 && cp <= 0x1F6FF) || (cp >= 0x1F900 && cp <= 0x1F9FF) ||
+      (cp >= 0x20000 && cp <= 0x3FFFD)) {
+    return 2; // East Asian wide and emoji
+  }
+  return 1;
+}
+
+// Decodes the UTF-8 sequence at the start of text into cp and returns its length.
+// Invalid bytes decode as themselves, one at a time.
+size_t utf8_decode(std::string_view text, uint32_t& cp) {
+  const uint8_t c = static_cast<uint8_t>(text[0]);
+  const size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+  if (len == 1 || len > text.size()) {
+    cp = c;
+    return 1;
+  }
+  cp = c & (0x7F >> len);
+  for (size_t i = 1; i < len; i += 1) {
+    cp = (cp << 6) | (static_cast<uint8_t>(text[i]) & 0x3F);
+  }
+  return len;
+}
+
+void get_terminal_size(int& width, int& height) {
+#if defined(_WIN32)
+  CONSOLE_SCREEN_BUFFER_INFO csbi;
+  if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi)) {
+    width = (int)(csbi.srWindow.Right-csbi.srWindow.Left+1);
+    height = (int)(csbi.srWindow.Bottom-csbi.srWindow.Top+1);
+  }
+#else
+  struct winsize w;
+  if (ioctl(fileno(stdout), TIOCGWINSZ, &w) == 0 && w.ws_col > 0) {
+    width = (int)(w.ws_col);
+    height = (int)(w.ws_row);
+  }
+#endif // Windows/Linux
+}
+
+std::atomic<bool> terminal_resized{false};
+static_assert(std::atomic<bool>::is_always_lock_free, "set from a signal handler");
+
+#if !defined(_WIN32)
+void on_sigwinch(int) {
+  terminal_resized.store(true, std::memory_order_relaxed);
+}
+#endif
+
+class TerminalRenderer {
+ public:
+  static constexpr std::chrono::milliseconds kFrameInterval{33};
+
+  // fd is where frames are written. Wrapping (and the escape sequences used to redraw
+  // on resize) is only done when fd is a terminal, or at a fixed width if one is given.
+  explicit TerminalRenderer(int fd, int fixed_width = 0) : fd_(fd) {
+    if (fixed_width > 0) {
+      wrap_ = true;
+      width_ = fixed_width;
+      frame_.reserve(4096);
+      return;
+    }
+#if defined(_WIN32)
+    wrap_ = _isatty(fd) != 0;
+#else
+    wrap_ = isatty(fd) != 0;
+    if (wrap_) {
+      struct sigaction action = {};
+      action.sa_handler = on_sigwinch;
+      action.sa_flags = SA_RESTART; // don't break a getline() in progress
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGWINCH, &action, nullptr);
+    }
+#endif
+    get_terminal_size(width_, height_);
+    frame_.reserve(4096);
+  }
+
+  // Call when the cursor is at the start of a line, before the first Write of a response.
+  void Begin() {
+    column_ = 0;
+    row_ = 0;
+    flushed_row_ = 0;
+    word_width_ = 0;
+    word_.clear();
+    paragraph_.clear();
+  }
+
+  // Lays out text into the current frame; nothing reaches the terminal until Flush().
+  void Write(std::string_view text) {
+    if (!wrap_) {
+      frame_.append(text.data(), text.size());
+      return;
+    }
+    // Hold back the start of a character split across calls.
+    held_.append(text.data(), text.size());
+    const size_t complete = utf8_complete_prefix(held_);
+    Layout(std::string_view(held_.data(), complete), /*remember=*/true);
+    held_.erase(0, complete);
+  }
+
+  bool HasPendingFrame() const {
+    return frame_.size() > 0;
+  }
+
+  std::chrono::steady_clock::time_point NextFrameTime() const {
+    return last_frame_ + kFrameInterval;
+  }
+
+  // Writes the pending frame, and redraws the current paragraph if the terminal was resized.
+  void Flush() {
+    std::cout.flush(); // anything printed through cout goes first
+    WriteFrame();
+    if (wrap_ && terminal_resized.exchange(false, std::memory_order_relaxed)) {
+      get_terminal_size(width_, height_);
+      Reflow();
+      WriteFrame();
+    }
+    last_frame_ = std::chrono::steady_clock::now();
+  }
+
+  // Flushes if a frame is due.
+  void MaybeFlush() {
+    if (HasPendingFrame() && std::chrono::steady_clock::now() >= NextFrameTime()) {
+      Flush();
+    }
+  }
+
+  size_t writes() const {
+    return writes_;
+  }
+
+ private:
+  void Layout(std::string_view text, bool remember) {
+    // Leave the last column free; some terminals wrap as soon as it is written.
+    const int width = std::max(width_ - 1, 8);
+    while (text.size() > 0) {
+      uint32_t cp = 0;
+      const size_t len = utf8_decode(text, cp);
+      const std::string_view bytes = text.substr(0, len);
+      text.remove_prefix(len);
+      if (remember) {
+        paragraph_.append(bytes.data(), bytes.size());
+      }
+
+      if (cp == '\n') {
+        frame_ += '\n';
+        column_ = 0;
+        row_ = 0;
+        flushed_row_ = 0;
+        word_width_ = 0;
+        word_.clear();
+        paragraph_.clear();
+        continue;
+      }
+      if (cp == ' ' || cp == '\t') {
+        word_width_ = 0;
+        word_.clear();
+        if (column_ + 1 > width) {
+          NewLine(); // the space becomes the line break
+        } else {
+          frame_ += ' ';
+          column_ += 1;
+        }
+        continue;
+      }
+
+      const int cw = codepoint_display_width(cp);
+      if (column_ + cw > width) {
+        if (word_width_ > 0 && word_width_ + cw <= width) {
+          // Move the word printed so far down to the next line.
+          frame_ += "\033[" + std::to_string(word_width_) + "D\033[K";
+          NewLine();
+          frame_ += word_;
+          column_ = word_width_;
+        } else {
+          NewLine(); // a word wider than the terminal gets broken where it hits the edge
+          word_width_ = 0;
+          word_.clear();
+        }
+      }
+      frame_.append(bytes.data(), bytes.size());
+      column_ += cw;
+      word_.append(bytes.data(), bytes.size());
+      word_width_ += cw;
+    }
+  }
+
+  void NewLine() {
+    frame_ += '\n';
+    column_ = 0;
+    row_ += 1;
+  }
+
+  // Moves the cursor back to the start of the current paragraph, clears everything below
+  // it, and lays the paragraph out again at the current width.
+  void Reflow() {
+    frame_ += '\r';
+    if (flushed_row_ > 0) {
+      frame_ += "\033[" + std::to_string(flushed_row_) + "A";
+    }
+    frame_ += "\033[J";
+    column_ = 0;
+    row_ = 0;
+    word_width_ = 0;
+    word_.clear();
+    Layout(paragraph_, /*remember=*/false);
+  }
+
+  void WriteFrame() {
+    size_t written = 0;
+    while (written < frame_.size()) {
+#if defined(_WIN32)
+      const int n = _write(fd_, frame_.data() + written, static_cast<unsigned>(frame_.size() - written));
+#else
+      const ssize_t n = write(fd_, frame_.data() + written, frame_.size() - written);
+#endif
+      writes_ += 1;
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break; // terminal went away; nothing useful left to do with the frame
+      }
+      written += n;
+    }
+    frame_.clear();
+    flushed_row_ = row_;
+  }
+
+  int fd_;
+  bool wrap_ = false;
+  int width_ = 120;
+  int height_ = 40;
+  std::chrono::steady_clock::time_point last_frame_;
+  std::string frame_;     // laid-out bytes not yet written
+  std::string held_;      // unfinished UTF-8 sequence from the last Write
+  std::string paragraph_; // raw text since the last '\n', for reflowing on resize
+  std::string word_;      // bytes of the word the cursor is in
+  int word_width_ = 0;
+  int column_ = 0;
+  int row_ = 0;           // rows since the start of the paragraph
+  int flushed_row_ = 0;   // row_ as of the last frame written
+  size_t writes_ = 0;
+};
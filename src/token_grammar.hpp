@@ -0,0 +1,687 @@
+
+#ifdef TOKEN_GRAMMAR
+#error "Only include token_grammar.hpp ONCE!"
+#endif
+#define TOKEN_GRAMMAR
+
+#include <bitset>
+#include <map>
+
+// Constrained decoding: responses that have to match a regular expression.
+//
+// The pattern is compiled to a DFA over bytes. For every DFA state a response reaches,
+// a bitmask over the vocabulary says which tokens may come next: those whose bytes
+// keep the DFA alive. accept_token is then a bit test, and EOS is only accepted where
+// the pattern may end. States from which no match can be completed are folded into the
+// dead state while compiling, so the model can't walk into a corner it can't finish.
+//
+// A state's mask is built the first time a response reaches it, by walking the bytes
+// of a vector of tokens through the DFA at once (token_grammar_simd::WalkTokens).
+// Grammars for structured answers only ever visit a few dozen states.
+//
+// Syntax, on bytes: literals, '.' (anything but '\n'), [classes] with ranges and '^',
+// \d \s \w \D \S \W, \n \t \r \f \v, escaped punctuation, ( ) and (?: ), |, and the
+// quantifiers * + ? {m} {m,} {m,n}. The whole response has to match; there are no
+// anchors.
+
+// The vocabulary laid out for WalkTokens: byte p of every token in plane p, so one
+// vector load gets the same byte of consecutive tokens.
+class GrammarVocabulary {
+ public:
+  static constexpr size_t kPlanes = 16; // longer tokens are walked one at a time
+  static constexpr size_t kPad = 64;    // tokens per mask word, and more than any vector
+
+  // end_of_turn: the token instruction-tuned models end their turn with, allowed wherever
+  // EOS is; gcpp::EOS_ID if there is no such token.
+  GrammarVocabulary(const TokenByteTable& table, int end_of_turn)
+      : table_(table), end_of_turn_(end_of_turn) {
+    vocab_size_ = table.vocab_size();
+    stride_ = (vocab_size_ + kPad - 1) / kPad * kPad;
+    planes_.assign(kPlanes * stride_, 0);
+    lengths_.assign(stride_, 0);
+    for (size_t token = 0; token < vocab_size_; token += 1) {
+      const std::string_view piece = table.Piece(static_cast<int>(token));
+      if (piece.size() > kPlanes) {
+        long_tokens_.push_back(static_cast<int>(token)); // length stays 0 for WalkTokens
+        continue;
+      }
+      lengths_[token] = static_cast<uint8_t>(piece.size());
+      for (size_t p = 0; p < piece.size(); p += 1) {
+        planes_[p * stride_ + token] = static_cast<uint8_t>(piece[p]);
+      }
+    }
+  }
+
+  size_t vocab_size() const { return vocab_size_; }
+  size_t stride() const { return stride_; } // vocab_size rounded up to kPad
+  size_t words() const { return stride_ / 64; }
+  const uint8_t* planes() const { return planes_.data(); }
+  const uint8_t* lengths() const { return lengths_.data(); }
+  const std::vector<int>& long_tokens() const { return long_tokens_; }
+  std::string_view Piece(int token) const { return table_.Piece(token); }
+  int end_of_turn() const { return end_of_turn_; }
+
+ private:
+  const TokenByteTable& table_;
+  int end_of_turn_;
+  size_t vocab_size_ = 0;
+  size_t stride_ = 0;
+  std::vector<uint8_t> planes_;
+  std::vector<uint8_t> lengths_;
+  std::vector<int> long_tokens_;
+};
+
+namespace token_grammar_simd {
+namespace hn = hwy::HWY_NAMESPACE;
+
+// Walks tokens [0, count) from DFA state start, a vector of tokens per step, and stores
+// the state each one ends in: 0 if it died on the way. count must be a multiple of
+// the vector size. Tokens of length 0 end where they started.
+void WalkTokens(const int32_t* HWY_RESTRICT transitions, int32_t start,
+                const uint8_t* HWY_RESTRICT planes, size_t stride,
+                const uint8_t* HWY_RESTRICT lengths, size_t count, int32_t* HWY_RESTRICT end_states) {
+  const hn::ScalableTag<int32_t> d32;
+  const hn::Rebind<uint8_t, decltype(d32)> d8;
+  const size_t N = hn::Lanes(d32);
+  const auto dead = hn::Zero(d32);
+  for (size_t i = 0; i < count; i += N) {
+    const auto length = hn::PromoteTo(d32, hn::LoadU(d8, lengths + i));
+    auto state = hn::Set(d32, start);
+    for (size_t p = 0; p < GrammarVocabulary::kPlanes; p += 1) {
+      const auto walking = hn::And(hn::Gt(length, hn::Set(d32, static_cast<int32_t>(p))),
+                                   hn::Ne(state, dead));
+      if (hn::AllFalse(d32, walking)) {
+        break;
+      }
+      const auto byte = hn::PromoteTo(d32, hn::LoadU(d8, planes + p * stride + i));
+      const auto next = hn::GatherIndex(d32, transitions, hn::Add(hn::ShiftLeft<8>(state), byte));
+      state = hn::IfThenElse(walking, next, state);
+    }
+    hn::StoreU(state, d32, end_states + i);
+  }
+}
+
+}  // namespace token_grammar_simd
+
+class TokenGrammar {
+ public:
+  static constexpr size_t kMaxStates = 4096;
+  static constexpr size_t kMaxNfaStates = 1 << 16;
+  static constexpr int kMaxRepeat = 1000;
+
+  explicit TokenGrammar(const GrammarVocabulary& vocab) : vocab_(vocab) {}
+
+  // Returns false and sets error if pattern doesn't parse, can't match anything, or
+  // needs more than kMaxStates DFA states.
+  bool Compile(std::string_view pattern, std::string& error) {
+    pattern_ = pattern;
+    pos_ = 0;
+    error_.clear();
+    Node root;
+    if (!ParseAlternation(root, 0)) {
+      error = error_;
+      return false;
+    }
+    if (pos_ < pattern_.size()) {
+      error = "unmatched ')' at " + std::to_string(pos_);
+      return false;
+    }
+    nfa_.assign(1, NfaState());
+    nfa_accept_ = Emit(root, 0);
+    if (nfa_.size() > kMaxNfaStates) {
+      error = "pattern too large";
+      return false;
+    }
+    if (!BuildDfa(error)) {
+      return false;
+    }
+    nfa_.clear();
+    return true;
+  }
+
+  int start() const { return start_; }
+  size_t states() const { return accepting_.size(); }
+  size_t masks_built() const { return masks_built_; }
+  bool accepting(int state) const { return accepting_[state]; }
+  // The match is complete: nothing but EOS can follow.
+  bool finished(int state) const { return finished_[state]; }
+
+  // State after bytes, 0 if they can't be part of a match.
+  int Next(int state, std::string_view bytes) const {
+    for (size_t i = 0; i < bytes.size() && state != 0; i += 1) {
+      state = transitions_[static_cast<size_t>(state) * 256 + static_cast<uint8_t>(bytes[i])];
+    }
+    return state;
+  }
+
+  // One bit per token of the vocabulary: the tokens allowed in state.
+  const uint64_t* Mask(int state) {
+    std::vector<uint64_t>& mask = masks_[state];
+    if (mask.size() > 0) {
+      return mask.data();
+    }
+    masks_built_ += 1;
+    mask.assign(vocab_.words(), 0);
+    if (state == 0) {
+      return mask.data();
+    }
+    end_states_.resize(vocab_.stride());
+    token_grammar_simd::WalkTokens(transitions_.data(), state, vocab_.planes(), vocab_.stride(),
+                                   vocab_.lengths(), vocab_.stride(), end_states_.data());
+    const uint8_t* lengths = vocab_.lengths();
+    for (size_t token = 0; token < vocab_.vocab_size(); token += 1) {
+      if (lengths[token] > 0 && end_states_[token] != 0) {
+        mask[token >> 6] |= uint64_t{1} << (token & 63);
+      }
+    }
+    for (int token : vocab_.long_tokens()) {
+      if (Next(state, vocab_.Piece(token)) != 0) {
+        mask[token >> 6] |= uint64_t{1} << (token & 63);
+      }
+    }
+    if (accepting_[state]) {
+      // Control tokens have no bytes, so the ends of a response are let through here.
+      for (int token : {gcpp::EOS_ID, vocab_.end_of_turn()}) {
+        mask[token >> 6] |= uint64_t{1} << (token & 63);
+      }
+    }
+    return mask.data();
+  }
+
+  const GrammarVocabulary& vocab() const { return vocab_; }
+
+ private:
+  struct Node {
+    enum Kind { kBytes, kConcat, kAlternation, kRepeat } kind = kConcat;
+    std::bitset<256> bytes;
+    std::vector<Node> children;
+    int min = 0;
+    int max = -1; // -1: unbounded
+  };
+
+  struct NfaState {
+    std::vector<std::pair<std::bitset<256>, int>> edges;
+    std::vector<int> epsilon;
+  };
+
+  bool Fail(const std::string& message) {
+    error_ = message + " at " + std::to_string(pos_);
+    return false;
+  }
+
+  bool ParseAlternation(Node& out, int depth) {
+    if (depth > 64) {
+      return Fail("groups nested too deeply");
+    }
+    Node branch;
+    if (!ParseConcatenation(branch, depth)) {
+      return false;
+    }
+    if (pos_ >= pattern_.size() || pattern_[pos_] != '|') {
+      out = std::move(branch);
+      return true;
+    }
+    out = Node{Node::kAlternation};
+    out.children.push_back(std::move(branch));
+    while (pos_ < pattern_.size() && pattern_[pos_] == '|') {
+      pos_ += 1;
+      if (!ParseConcatenation(branch, depth)) {
+        return false;
+      }
+      out.children.push_back(std::move(branch));
+    }
+    return true;
+  }
+
+  bool ParseConcatenation(Node& out, int depth) {
+    out = Node{Node::kConcat};
+    while (pos_ < pattern_.size() && pattern_[pos_] != '|' && pattern_[pos_] != ')') {
+      Node item;
+      if (!ParseRepeat(item, depth)) {
+        return false;
+      }
+      out.children.push_back(std::move(item));
+    }
+    return true;
+  }
+
+  bool ParseRepeat(Node& out, int depth) {
+    if (!ParseAtom(out, depth)) {
+      return false;
+    }
+    while (pos_ < pattern_.size()) {
+      int min = 0;
+      int max = -1;
+      const char c = pattern_[pos_];
+      if (c == '*') {
+        pos_ += 1;
+      } else if (c == '+') {
+        min = 1;
+        pos_ += 1;
+      } else if (c == '?') {
+        max = 1;
+        pos_ += 1;
+      } else if (c == '{') {
+        pos_ += 1;
+        if (!ParseCount(min)) {
+          return false;
+        }
+        max = min;
+        if (pos_ < pattern_.size() && pattern_[pos_] == ',') {
+          pos_ += 1;
+          max = -1;
+          if (pos_ < pattern_.size() && pattern_[pos_] != '}' && !ParseCount(max)) {
+            return false;
+          }
+        }
+        if (pos_ >= pattern_.size() || pattern_[pos_] != '}') {
+          return Fail("expected '}'");
+        }
+        pos_ += 1;
+        if (max >= 0 && max < min) {
+          return Fail("repeat count out of order");
+        }
+      } else {
+        return true;
+      }
+      Node repeat{Node::kRepeat};
+      repeat.min = min;
+      repeat.max = max;
+      repeat.children.push_back(std::move(out));
+      out = std::move(repeat);
+    }
+    return true;
+  }
+
+  bool ParseCount(int& count) {
+    const size_t begin = pos_;
+    count = 0;
+    while (pos_ < pattern_.size() && std::isdigit(static_cast<unsigned char>(pattern_[pos_]))) {
+      count = count * 10 + (pattern_[pos_] - '0');
+      pos_ += 1;
+      if (count > kMaxRepeat) {
+        return Fail("repeat count above " + std::to_string(kMaxRepeat));
+      }
+    }
+    return pos_ > begin || Fail("expected a repeat count");
+  }
+
+  bool ParseAtom(Node& out, int depth) {
+    const char c = pattern_[pos_];
+    out = Node{Node::kBytes};
+    if (c == '(') {
+      pos_ += 1;
+      if (pattern_.compare(pos_, 2, "?:") == 0) {
+        pos_ += 2;
+      }
+      if (!ParseAlternation(out, depth + 1)) {
+        return false;
+      }
+      if (pos_ >= pattern_.size() || pattern_[pos_] != ')') {
+        return Fail("expected ')'");
+      }
+      pos_ += 1;
+      return true;
+    }
+    if (c == '*' || c == '+' || c == '?' || c == '{') {
+      return Fail("nothing to repeat");
+    }
+    pos_ += 1;
+    if (c == '.') {
+      out.bytes.set();
+      out.bytes.reset('\n');
+    } else if (c == '[') {
+      return ParseClass(out.bytes);
+    } else if (c == '\\') {
+      return ParseEscape(out.bytes);
+    } else {
+      out.bytes.set(static_cast<uint8_t>(c));
+    }
+    return true;
+  }
+
+  // After '\'.
+  bool ParseEscape(std::bitset<256>& bytes) {
+    if (pos_ >= pattern_.size()) {
+      return Fail("pattern ends in '\\'");
+    }
+    const char c = pattern_[pos_];
+    pos_ += 1;
+    switch (c) {
+      case 'd': case 'D': case 's': case 'S': case 'w': case 'W':
+        for (int b = 0; b < 256; b += 1) {
+          const bool in = std::tolower(c) == 'd' ? (b >= '0' && b <= '9')
+                        : std::tolower(c) == 's' ? (b == ' ' || (b >= '\t' && b <= '\r'))
+                        : (std::isalnum(b) || b == '_');
+          bytes.set(b, in != static_cast<bool>(std::isupper(c)));
+        }
+        return true;
+      case 'n': bytes.set('\n'); return true;
+      case 't': bytes.set('\t'); return true;
+      case 'r': bytes.set('\r'); return true;
+      case 'f': bytes.set('\f'); return true;
+      case 'v': bytes.set('\v'); return true;
+    }
+    if (std::isalnum(static_cast<unsigned char>(c))) {
+      return Fail(std::string("unknown escape '\\") + c + "'");
+    }
+    bytes.set(static_cast<uint8_t>(c));
+    return true;
+  }
+
+  // After '['.
+  bool ParseClass(std::bitset<256>& bytes) {
+    const bool negated = pos_ < pattern_.size() && pattern_[pos_] == '^';
+    pos_ += negated ? 1 : 0;
+    bool first = true;
+    while (pos_ < pattern_.size() && (pattern_[pos_] != ']' || first)) {
+      first = false;
+      std::bitset<256> item;
+      int low = static_cast<uint8_t>(pattern_[pos_]);
+      pos_ += 1;
+      if (low == '\\') {
+        if (!ParseEscape(item)) {
+          return false;
+        }
+        low = item.count() == 1 ? static_cast<int>(FirstByte(item)) : -1;
+      } else {
+        item.set(low);
+      }
+      if (low >= 0 && pos_ + 1 < pattern_.size() && pattern_[pos_] == '-' && pattern_[pos_ + 1] != ']') {
+        pos_ += 1;
+        std::bitset<256> high_item;
+        int high = static_cast<uint8_t>(pattern_[pos_]);
+        pos_ += 1;
+        if (high == '\\') {
+          if (!ParseEscape(high_item) || high_item.count() != 1) {
+            return error_.empty() ? Fail("bad range in class") : false;
+          }
+          high = static_cast<int>(FirstByte(high_item));
+        }
+        if (high < low) {
+          return Fail("range out of order in class");
+        }
+        for (int b = low; b <= high; b += 1) {
+          item.set(b);
+        }
+      }
+      bytes |= item;
+    }
+    if (pos_ >= pattern_.size()) {
+      return Fail("expected ']'");
+    }
+    pos_ += 1;
+    if (negated) {
+      bytes.flip();
+    }
+    return true;
+  }
+
+  static size_t FirstByte(const std::bitset<256>& bytes) {
+    size_t b = 0;
+    while (b < 256 && !bytes.test(b)) {
+      b += 1;
+    }
+    return b;
+  }
+
+  int NewNfaState() {
+    nfa_.emplace_back();
+    return static_cast<int>(nfa_.size() - 1);
+  }
+
+  // Thompson construction: adds node's states after from and returns the one it ends in.
+  int Emit(const Node& node, int from) {
+    if (nfa_.size() > kMaxNfaStates) {
+      return from; // Compile() reports it
+    }
+    switch (node.kind) {
+      case Node::kBytes: {
+        const int to = NewNfaState();
+        nfa_[from].edges.push_back({node.bytes, to});
+        return to;
+      }
+      case Node::kConcat:
+        for (const Node& child : node.children) {
+          from = Emit(child, from);
+        }
+        return from;
+      case Node::kAlternation: {
+        const int to = NewNfaState();
+        for (const Node& child : node.children) {
+          const int branch = NewNfaState();
+          nfa_[from].epsilon.push_back(branch);
+          nfa_[Emit(child, branch)].epsilon.push_back(to);
+        }
+        return to;
+      }
+      case Node::kRepeat: {
+        const Node& child = node.children[0];
+        for (int i = 0; i < node.min; i += 1) {
+          from = Emit(child, from);
+        }
+        if (node.max < 0) {
+          const int loop = NewNfaState();
+          nfa_[from].epsilon.push_back(loop);
+          nfa_[Emit(child, loop)].epsilon.push_back(loop);
+          return loop;
+        }
+        for (int i = node.min; i < node.max; i += 1) {
+          const int end = Emit(child, from);
+          const int to = NewNfaState();
+          nfa_[from].epsilon.push_back(to);
+          nfa_[end].epsilon.push_back(to);
+          from = to;
+        }
+        return from;
+      }
+    }
+    return from;
+  }
+
+  void Closure(std::vector<int>& set) const {
+    std::vector<int> stack = set;
+    std::vector<bool> seen(nfa_.size(), false);
+    for (int s : set) {
+      seen[s] = true;
+    }
+    while (stack.size() > 0) {
+      const int s = stack.back();
+      stack.pop_back();
+      for (int next : nfa_[s].epsilon) {
+        if (!seen[next]) {
+          seen[next] = true;
+          set.push_back(next);
+          stack.push_back(next);
+        }
+      }
+    }
+    std::sort(set.begin(), set.end());
+  }
+
+  // Subset construction, then every state that can't reach an accepting one is merged
+  // into the dead state 0.
+  bool BuildDfa(std::string& error) {
+    std::vector<std::vector<int>> sets = {{}}; // state 0: dead
+    std::map<std::vector<int>, int> ids = {{{}, 0}};
+    std::map<std::vector<int>, int> moves = {{{}, 0}}; // before the closure, to skip it
+    std::vector<int> start_set = {0};
+    Closure(start_set);
+    ids[start_set] = 1;
+    sets.push_back(start_set);
+    transitions_.assign(2 * 256, 0);
+    for (size_t state = 1; state < sets.size(); state += 1) {
+      for (int b = 0; b < 256; b += 1) {
+        std::vector<int> move;
+        for (int s : sets[state]) {
+          for (const auto& edge : nfa_[s].edges) {
+            if (edge.first.test(b)) {
+              move.push_back(edge.second);
+            }
+          }
+        }
+        std::sort(move.begin(), move.end());
+        move.erase(std::unique(move.begin(), move.end()), move.end());
+        auto known = moves.find(move);
+        if (known == moves.end()) {
+          std::vector<int> closed = move;
+          Closure(closed);
+          auto id = ids.find(closed);
+          if (id == ids.end()) {
+            if (sets.size() >= kMaxStates) {
+              error = "pattern needs more than " + std::to_string(kMaxStates) + " DFA states";
+              return false;
+            }
+            id = ids.emplace(closed, static_cast<int>(sets.size())).first;
+            sets.push_back(closed);
+            transitions_.resize(sets.size() * 256, 0);
+          }
+          known = moves.emplace(move, id->second).first;
+        }
+        transitions_[state * 256 + b] = known->second;
+      }
+    }
+
+    const size_t n = sets.size();
+    accepting_.assign(n, false);
+    for (size_t state = 1; state < n; state += 1) {
+      accepting_[state] = std::binary_search(sets[state].begin(), sets[state].end(), nfa_accept_);
+    }
+    std::vector<std::vector<int>> reverse(n);
+    for (size_t state = 1; state < n; state += 1) {
+      for (int b = 0; b < 256; b += 1) {
+        reverse[transitions_[state * 256 + b]].push_back(static_cast<int>(state));
+      }
+    }
+    std::vector<bool> alive = accepting_;
+    std::vector<int> stack;
+    for (size_t state = 0; state < n; state += 1) {
+      if (alive[state]) {
+        stack.push_back(static_cast<int>(state));
+      }
+    }
+    while (stack.size() > 0) {
+      const int state = stack.back();
+      stack.pop_back();
+      for (int from : reverse[state]) {
+        if (!alive[from]) {
+          alive[from] = true;
+          stack.push_back(from);
+        }
+      }
+    }
+    if (!alive[1]) {
+      error = "pattern can't match anything";
+      return false;
+    }
+    finished_.assign(n, false);
+    for (size_t state = 0; state < n; state += 1) {
+      bool any = false;
+      for (int b = 0; b < 256; b += 1) {
+        int32_t& next = transitions_[state * 256 + b];
+        next = alive[state] && alive[next] ? next : 0;
+        any = any || next != 0;
+      }
+      finished_[state] = accepting_[state] && !any;
+    }
+    start_ = 1;
+    masks_.assign(n, {});
+    return true;
+  }
+
+  const GrammarVocabulary& vocab_;
+  // Parser and NFA, only while compiling.
+  std::string_view pattern_;
+  size_t pos_ = 0;
+  std::string error_;
+  std::vector<NfaState> nfa_;
+  int nfa_accept_ = 0;
+  // DFA: 256 transitions per state, state 0 is dead.
+  std::vector<int32_t> transitions_;
+  std::vector<bool> accepting_;
+  std::vector<bool> finished_;
+  int start_ = 1;
+  std::vector<std::vector<uint64_t>> masks_;
+  std::vector<int32_t> end_states_;
+  size_t masks_built_ = 0;
+};
+
+// Compiled grammars by pattern, for LlmPrompt::grammar. The vocabulary layout is built
+// with the first one.
+class TokenGrammarCache {
+ public:
+  TokenGrammarCache(const TokenByteTable& table, int end_of_turn)
+      : table_(table), end_of_turn_(end_of_turn) {}
+
+  // nullptr (after saying why, once per pattern) if pattern doesn't compile or there
+  // is no token byte table to build masks from.
+  TokenGrammar* Get(const std::string& pattern) {
+    auto it = grammars_.find(pattern);
+    if (it != grammars_.end()) {
+      return it->second.get();
+    }
+    std::unique_ptr<TokenGrammar>& grammar = grammars_[pattern];
+    if (!table_.ok()) {
+      std::cerr << "No token byte table, responses are not held to their grammar\n";
+      return nullptr;
+    }
+    if (vocab_ == nullptr) {
+      vocab_ = std::make_unique<GrammarVocabulary>(table_, end_of_turn_);
+    }
+    grammar = std::make_unique<TokenGrammar>(*vocab_);
+    std::string error;
+    if (!grammar->Compile(pattern, error)) {
+      std::cerr << "Grammar '" << pattern << "': " << error << ", response is not held to it\n";
+      grammar.reset();
+    }
+    return grammar.get();
+  }
+
+ private:
+  const TokenByteTable& table_;
+  int end_of_turn_;
+  std::unique_ptr<GrammarVocabulary> vocab_;
+  std::map<std::string, std::unique_ptr<TokenGrammar>> grammars_;
+};
+
+// Follows one response through its grammar: accept_token asks Allows(), stream_token
+// calls Advance() with every generated token.
+class GrammarCursor {
+ public:
+  // grammar may be nullptr: everything is allowed.
+  void Begin(TokenGrammar* grammar) {
+    grammar_ = grammar;
+    if (grammar_ != nullptr) {
+      state_ = grammar_->start();
+      mask_ = grammar_->Mask(state_);
+      words_ = grammar_->vocab().words();
+    }
+  }
+
+  bool Allows(int token) const {
+    if (grammar_ == nullptr) {
+      return true;
+    }
+    const size_t word = static_cast<size_t>(token) >> 6;
+    return word < words_ && ((mask_[word] >> (token & 63)) & 1) != 0;
+  }
+
+  void Advance(std::string_view token_bytes) {
+    if (grammar_ != nullptr) {
+      state_ = grammar_->Next(state_, token_bytes);
+      mask_ = grammar_->Mask(state_);
+    }
+  }
+
+  // The response matched and nothing more can follow (or, if the sampler ignored the
+  // mask, it can no longer match).
+  bool finished() const {
+    return grammar_ != nullptr && (state_ == 0 || grammar_->finished(state_));
+  }
+
+ private:
+  TokenGrammar* grammar_ = nullptr;
+  int state_ = 0;
+  const uint64_t* mask_ = nullptr;
+  size_t words_ = 0;
+};
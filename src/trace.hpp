@@ -0,0 +1,187 @@
+
+#ifdef TRACE
+#error "Only include trace.hpp ONCE!"
+#endif
+#define TRACE
+
+// Timeline of what every thread spends its time on, written as Chrome trace JSON (open
+// in ui.perfetto.dev or chrome://tracing).
+//
+//   MIRROR_GAZE_TRACE=trace.json mirror-gaze tasker
+//
+// TRACE_ZONE("name") records the enclosing scope; trace_span() records a span whose
+// start was taken earlier with trace_clock(), for phases that don't map to a scope
+// (prefill and each decode step both happen inside one GenerateGemma call).
+//
+// Each thread appends to its own fixed-size buffer, so recording takes no lock and
+// never allocates; a full buffer drops further events and the count is reported. The
+// file is written at exit. Without MIRROR_GAZE_TRACE, a zone costs one predictable
+// branch on each end; building with -DMIRROR_GAZE_TRACE_ZONES=0 removes them entirely.
+//
+// Zones are also hwy profiler zones, so a build with -DPROFILER_ENABLED=1 gets
+// Highway's aggregated table for them next to gemma.cpp's own.
+
+#include <fstream>
+#include <iomanip>
+
+#ifndef MIRROR_GAZE_TRACE_ZONES
+#define MIRROR_GAZE_TRACE_ZONES 1
+#endif
+
+struct TraceEvent {
+  const char* name; // string literal
+  double start_us;
+  double duration_us;
+  int64_t arg;
+};
+
+class TraceBuffer {
+ public:
+  static constexpr size_t kCapacity = size_t{1} << 17; // 4 MiB per thread
+
+  explicit TraceBuffer(int tid) : tid_(tid), events_(new TraceEvent[kCapacity]) {
+    snprintf(name_, sizeof(name_), "thread %d", tid);
+  }
+
+  // Only called by the thread that owns the buffer.
+  void Add(const TraceEvent& event) {
+    const size_t n = size_.load(std::memory_order_relaxed);
+    if (n >= kCapacity) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    events_[n] = event;
+    size_.store(n + 1, std::memory_order_release);
+  }
+
+  int tid() const { return tid_; }
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+  size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+  const TraceEvent& event(size_t i) const { return events_[i]; }
+  const char* name() const { return name_; }
+  void SetName(const char* name) { snprintf(name_, sizeof(name_), "%s", name); }
+
+ private:
+  int tid_;
+  std::unique_ptr<TraceEvent[]> events_;
+  std::atomic<size_t> size_{0};
+  std::atomic<size_t> dropped_{0};
+  char name_[32];
+};
+
+// Set once, in main(), before other threads start.
+bool trace_enabled = false;
+std::string trace_output_path;
+double trace_start_seconds = 0;
+
+// Buffers are never freed: a thread's events outlive the thread.
+std::mutex trace_buffers_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+thread_local TraceBuffer* trace_thread_buffer = nullptr;
+
+TraceBuffer& trace_buffer() {
+  if (trace_thread_buffer == nullptr) {
+    std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+    trace_buffers.push_back(std::make_unique<TraceBuffer>(static_cast<int>(trace_buffers.size()) + 1));
+    trace_thread_buffer = trace_buffers.back().get();
+  }
+  return *trace_thread_buffer;
+}
+
+// Microseconds since tracing started; 0 when it is off.
+double trace_clock() {
+  return trace_enabled ? (hwy::platform::Now() - trace_start_seconds) * 1e6 : 0.0;
+}
+
+// Records [start_us, now) as name on this thread.
+void trace_span(const char* name, double start_us, int64_t arg = 0) {
+  if (trace_enabled) {
+    trace_buffer().Add({name, start_us, trace_clock() - start_us, arg});
+  }
+}
+
+// Names this thread in the trace.
+void trace_thread_name(const char* name) {
+  if (trace_enabled) {
+    TraceBuffer& buffer = trace_buffer();
+    std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+    buffer.SetName(name);
+  }
+}
+
+class TraceZone {
+ public:
+  explicit TraceZone(const char* name, int64_t arg = 0) : name_(name), arg_(arg) {
+    if (trace_enabled) {
+      start_us_ = trace_clock();
+    }
+  }
+  ~TraceZone() {
+    if (trace_enabled) {
+      trace_span(name_, start_us_, arg_);
+    }
+  }
+  TraceZone(const TraceZone&) = delete;
+  TraceZone& operator=(const TraceZone&) = delete;
+
+ private:
+  const char* name_;
+  int64_t arg_;
+  double start_us_ = 0;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#if MIRROR_GAZE_TRACE_ZONES
+#define TRACE_ZONE(name)  \
+  PROFILER_ZONE(name);    \
+  TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#else
+#define TRACE_ZONE(name) PROFILER_ZONE(name)
+#endif
+
+void write_trace() {
+  std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+  std::ofstream out(trace_output_path);
+  if (!out) {
+    std::cerr << "Could not write trace to " << trace_output_path << "\n";
+    return;
+  }
+  out << std::fixed << std::setprecision(3) << "{\"traceEvents\": [\n";
+  size_t events = 0;
+  size_t dropped = 0;
+  const char* separator = "";
+  for (const auto& buffer : trace_buffers) {
+    out << separator << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->tid()
+        << ", \"args\": {\"name\": \"" << buffer->name() << "\"}}";
+    separator = ",\n";
+    const size_t size = buffer->size();
+    for (size_t i = 0; i < size; i += 1) {
+      const TraceEvent& event = buffer->event(i);
+      out << separator << "{\"name\": \"" << event.name << "\", \"cat\": \"mirror-gaze\", \"ph\": \"X\", \"ts\": "
+          << event.start_us << ", \"dur\": " << event.duration_us << ", \"pid\": 1, \"tid\": " << buffer->tid()
+          << ", \"args\": {\"n\": " << event.arg << "}}";
+    }
+    events += size;
+    dropped += buffer->dropped();
+  }
+  out << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped_events\": " << dropped << "}}\n";
+  std::cerr << "Wrote " << events << " trace events to " << trace_output_path;
+  if (dropped > 0) {
+    std::cerr << " (" << dropped << " dropped, buffers full)";
+  }
+  std::cerr << "\n";
+}
+
+// Turns tracing on if MIRROR_GAZE_TRACE names an output file; it is written at exit.
+void trace_start_from_env() {
+  const char* env_var = std::getenv("MIRROR_GAZE_TRACE");
+  if (env_var == nullptr || env_var[0] == '\0') {
+    return;
+  }
+  trace_output_path = env_var;
+  trace_start_seconds = hwy::platform::Now();
+  trace_enabled = true;
+  trace_thread_name("control");
+  std::atexit(write_trace);
+}
@@ -0,0 +1,121 @@
+
+#ifdef TYPING_PREFILL
+#error "Only include typing_prefill.hpp ONCE!"
+#endif
+#define TYPING_PREFILL
+
+// Prefills the user's next prompt while they are still typing it.
+//
+// The line editor in prompt_user() sends the words typed so far as draft prompts. For
+// each draft the LLM thread builds the tokens the real prompt would start with (BOS or
+// the end of the previous turn, the user turn, the text) and prefills them into the KV
+// rows right after abs_pos, without moving abs_pos. Rows the previous draft already
+// holds are kept up to the longest common prefix, so typing a word costs a few tokens
+// and backspacing past prefilled text just forgets the rows after the divergence;
+// they are overwritten by whatever comes next.
+//
+// When the real prompt arrives, the rows that match its tokens are taken over and only
+// the rest is prefilled, so Enter costs the last word and the template's closing
+// tokens instead of the whole turn.
+//
+// Griffin models keep recurrent state outside the position-indexed rows, which can't be
+// rolled back, so drafts are ignored for them.
+class TypingPrefill {
+ public:
+  struct Stats {
+    size_t drafts = 0;
+    size_t tokens_prefilled = 0;   // by drafts
+    size_t tokens_rolled_back = 0; // prefilled by a draft, then edited away
+    size_t tokens_reused = 0;      // taken over by a real prompt
+  };
+
+  explicit TypingPrefill(bool supported) : supported_(supported) {}
+
+  bool supported() const { return supported_; }
+
+  // Makes rows [start_pos, start_pos + tokens.size()) hold tokens, prefilling only past
+  // the part they already hold.
+  void Prefill(gcpp::Gemma& model, const std::vector<int>& tokens, size_t start_pos,
+               gcpp::KVCache& kv_cache, hwy::ThreadPool& pool, const gcpp::InferenceArgs& args) {
+    if (!supported_) {
+      return;
+    }
+    stats_.drafts += 1;
+    if (start_pos != start_pos_) {
+      tokens_.clear();
+      start_pos_ = start_pos;
+    }
+    const size_t common = CommonPrefix(tokens);
+    stats_.tokens_rolled_back += tokens_.size() - common;
+    tokens_.resize(common);
+    if (common == tokens.size()) {
+      return;
+    }
+
+    // Same trick as KVPrefixCache::Fork: run the new tokens as a prompt and stop at
+    // the first sample, with a throwaway RNG.
+    const std::vector<int> suffix(tokens.begin() + common, tokens.end());
+    std::mt19937 throwaway_gen(0);
+    size_t streamed = 0;
+    const size_t suffix_size = suffix.size();
+    gcpp::StreamFunc stop_after_suffix = [&streamed, suffix_size](int, float) {
+      streamed += 1;
+      return streamed <= suffix_size;
+    };
+    gcpp::AcceptFunc accept_all = [](int) { return true; };
+    gcpp::RuntimeConfig runtime_config = {
+        .max_tokens = args.max_tokens,
+        .max_generated_tokens = 1,
+        .temperature = args.temperature,
+        .verbosity = 0,
+        .gen = &throwaway_gen,
+        .stream_token = stop_after_suffix,
+        .accept_token = accept_all,
+    };
+    gcpp::TimingInfo timing_info;
+    GenerateGemma(model, runtime_config, suffix, start_pos + common, kv_cache, pool, timing_info);
+    tokens_.insert(tokens_.end(), suffix.begin(), suffix.end());
+    stats_.tokens_prefilled += suffix.size();
+  }
+
+  // Number of leading tokens of prompt (to be run at start_pos) that are already in the
+  // cache. Always leaves the last token to be run, since generation starts from it.
+  // Forgets the draft either way.
+  size_t Take(const std::vector<int>& prompt, size_t start_pos) {
+    size_t reused = 0;
+    if (start_pos == start_pos_ && prompt.size() > 0) {
+      reused = std::min(CommonPrefix(prompt), prompt.size() - 1);
+    }
+    stats_.tokens_reused += reused;
+    Clear();
+    return reused;
+  }
+
+  // The rows past abs_pos are about to be written by something else.
+  void Clear() {
+    tokens_.clear();
+  }
+
+  bool active() const { return tokens_.size() > 0; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  size_t CommonPrefix(const std::vector<int>& tokens) const {
+    size_t n = 0;
+    while (n < tokens.size() && n < tokens_.size() && tokens[n] == tokens_[n]) {
+      n += 1;
+    }
+    return n;
+  }
+
+  bool supported_;
+  size_t start_pos_ = 0;
+  std::vector<int> tokens_; // what rows [start_pos_, start_pos_ + size) hold
+  Stats stats_;
+};
+
+void print_typing_prefill_stats(const TypingPrefill::Stats& stats) {
+  std::cout << stats.tokens_reused << " prompt tokens prefilled while typing ("
+            << stats.drafts << " drafts, " << stats.tokens_prefilled << " tokens prefilled, "
+            << stats.tokens_rolled_back << " rolled back)\n";
+}